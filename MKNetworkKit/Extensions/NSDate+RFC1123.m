@@ -12,6 +12,59 @@
 #import <time.h>
 #import <xlocale.h>
 
+static const char kMKNKDayNames[7][4] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char kMKNKMonthNames[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+// days since 1970-01-01 of a proleptic Gregorian date, month is 1 based
+static int64_t MKNKDaysFromCivil(int64_t year, int64_t month, int64_t day) {
+    
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    int64_t yearOfEra = year - era * 400;
+    int64_t dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + dayOfEra - 719468;
+}
+
+static BOOL MKNKReadDigits(const char *str, int count, int *value) {
+    
+    *value = 0;
+    for(int index = 0; index < count; index ++) {
+        if(str[index] < '0' || str[index] > '9') return NO;
+        *value = *value * 10 + (str[index] - '0');
+    }
+    return YES;
+}
+
+// IMF-fixdate, the only format servers are allowed to generate: "Sun, 06 Nov 1994 08:49:37 GMT"
+static BOOL MKNKParseIMFFixdate(const char *str, size_t length, NSTimeInterval *interval) {
+    
+    if(length != 29 || str[3] != ',' || str[4] != ' ' || str[7] != ' ' || str[11] != ' ' ||
+       str[16] != ' ' || str[19] != ':' || str[22] != ':' || str[25] != ' ' || memcmp(str + 26, "GMT", 3) != 0) {
+        return NO;
+    }
+    
+    int month = 0;
+    for(int index = 0; index < 12; index ++) {
+        if(memcmp(str + 8, kMKNKMonthNames[index], 3) == 0) {
+            month = index + 1;
+            break;
+        }
+    }
+    
+    int day, year, hour, minute, second;
+    if(month == 0 ||
+       !MKNKReadDigits(str + 5, 2, &day) || !MKNKReadDigits(str + 12, 4, &year) ||
+       !MKNKReadDigits(str + 17, 2, &hour) || !MKNKReadDigits(str + 20, 2, &minute) || !MKNKReadDigits(str + 23, 2, &second)) {
+        return NO;
+    }
+    
+    if(day < 1 || day > 31 || hour > 23 || minute > 59 || second > 60) return NO;
+    
+    *interval = (NSTimeInterval) (MKNKDaysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second);
+    return YES;
+}
+
 @implementation NSDate (RFC1123)
 
 +(NSDate*)dateFromRFC1123:(NSString*)value_
@@ -21,30 +74,20 @@
     
     const char *str = [value_ UTF8String];
     const char *fmt;
-    NSDate *retDate;
     char *ret;
     
-    fmt = "%a, %d %b %Y %H:%M:%S %Z";
-    struct tm rfc1123timeinfo;
-    memset(&rfc1123timeinfo, 0, sizeof(rfc1123timeinfo));
-    ret = strptime_l(str, fmt, &rfc1123timeinfo, NULL);
-    if (ret) {
-        time_t rfc1123time = mktime(&rfc1123timeinfo);
-        retDate = [NSDate dateWithTimeIntervalSince1970:rfc1123time];
-        if (retDate != nil)
-            return retDate;
-    }
-    
+    NSTimeInterval interval;
+    if (MKNKParseIMFFixdate(str, strlen(str), &interval))
+        return [NSDate dateWithTimeIntervalSince1970:interval];
     
+    // obsolete formats, HTTP dates are always in GMT, so timegm instead of mktime
     fmt = "%A, %d-%b-%y %H:%M:%S %Z";
     struct tm rfc850timeinfo;
     memset(&rfc850timeinfo, 0, sizeof(rfc850timeinfo));
     ret = strptime_l(str, fmt, &rfc850timeinfo, NULL);
     if (ret) {
-        time_t rfc850time = mktime(&rfc850timeinfo);
-        retDate = [NSDate dateWithTimeIntervalSince1970:rfc850time];
-        if (retDate != nil)
-            return retDate;
+        time_t rfc850time = timegm(&rfc850timeinfo);
+        return [NSDate dateWithTimeIntervalSince1970:rfc850time];
     }
     
     fmt = "%a %b %e %H:%M:%S %Y";
@@ -52,10 +95,20 @@
     memset(&asctimeinfo, 0, sizeof(asctimeinfo));
     ret = strptime_l(str, fmt, &asctimeinfo, NULL);
     if (ret) {
-        time_t asctime = mktime(&asctimeinfo);
+        time_t asctime = timegm(&asctimeinfo);
         return [NSDate dateWithTimeIntervalSince1970:asctime];
     }
     
+    // lenient IMF-fixdate, for instance single digit days
+    fmt = "%a, %d %b %Y %H:%M:%S %Z";
+    struct tm rfc1123timeinfo;
+    memset(&rfc1123timeinfo, 0, sizeof(rfc1123timeinfo));
+    ret = strptime_l(str, fmt, &rfc1123timeinfo, NULL);
+    if (ret) {
+        time_t rfc1123time = timegm(&rfc1123timeinfo);
+        return [NSDate dateWithTimeIntervalSince1970:rfc1123time];
+    }
+    
     return nil;
 }
 
@@ -63,14 +116,14 @@
 {
     time_t date = (time_t)[self timeIntervalSince1970];
     struct tm timeinfo;
-    gmtime_r(&date, &timeinfo);
-    char buffer[32];
-    size_t ret = strftime_l(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", &timeinfo, NULL);
-    if (ret) {
-        return @(buffer);
-    } else {
+    if (!gmtime_r(&date, &timeinfo) || timeinfo.tm_year + 1900 < 0 || timeinfo.tm_year + 1900 > 9999)
         return nil;
-    }
+    
+    char buffer[30];
+    snprintf(buffer, sizeof(buffer), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+             kMKNKDayNames[timeinfo.tm_wday], timeinfo.tm_mday, kMKNKMonthNames[timeinfo.tm_mon], timeinfo.tm_year + 1900,
+             timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec);
+    return @(buffer);
 }
 
 @end
@@ -31,6 +31,8 @@
 
 -(id) objectForCaseInsensitiveKey:(id)aKey;
 -(NSString*) urlEncodedKeyValueString;
+-(NSData*) urlEncodedKeyValueData; // the same, as ASCII bytes ready for a form body
 -(NSString*) jsonEncodedKeyValueString;
 -(NSString*) plistEncodedKeyValueString;
+-(NSData*) binaryPlistEncodedKeyValueData;
 @end
@@ -40,22 +40,44 @@
   return  nil;
 }
 
--(NSString*) urlEncodedKeyValueString {
+// keys are sorted so that the same parameters always produce the same query string (and cache key)
+// they are sorted as the strings they are encoded from, keys of mixed types can't be compared to each other
+-(NSData*) urlEncodedKeyValueData {
+  
+  static const uint8_t separator = '&';
+  static const uint8_t assignment = '=';
   
-  NSMutableString *string = [NSMutableString string];
-  for (NSString *key in self) {
+  NSMutableArray *pairs = [NSMutableArray arrayWithCapacity:self.count];
+  [self enumerateKeysAndObjectsUsingBlock:^(id key, id value, BOOL *stop) {
     
-    NSObject *value = [self valueForKey:key];
-    if([value isKindOfClass:[NSString class]])
-      [string appendFormat:@"%@=%@&", [key mk_urlEncodedString], [((NSString*)value) mk_urlEncodedString]];
-    else
-      [string appendFormat:@"%@=%@&", [key mk_urlEncodedString], value];
+    NSString *keyString = [key isKindOfClass:[NSString class]] ? key : [key description];
+    NSString *valueString = [value isKindOfClass:[NSString class]] ? value : [value description];
+    [pairs addObject:@[keyString, valueString]];
+  }];
+  
+  // @1 and @"1" encode the same key, their values decide the order
+  [pairs sortUsingComparator:^NSComparisonResult(NSArray *pair1, NSArray *pair2) {
+    
+    NSComparisonResult result = [pair1[0] compare:pair2[0]];
+    return result != NSOrderedSame ? result : [pair1[1] compare:pair2[1]];
+  }];
+  
+  NSMutableData *data = [NSMutableData dataWithCapacity:self.count * 32];
+  for (NSArray *pair in pairs) {
+    
+    if(data.length > 0) [data appendBytes:&separator length:1];
+    
+    [pair[0] mk_appendURLEncodedBytesToData:data];
+    [data appendBytes:&assignment length:1];
+    [pair[1] mk_appendURLEncodedBytesToData:data];
   }
   
-  if([string length] > 0)
-    [string deleteCharactersInRange:NSMakeRange([string length] - 1, 1)];
+  return data;
+}
+
+-(NSString*) urlEncodedKeyValueString {
   
-  return string;
+  return [[NSString alloc] initWithData:[self urlEncodedKeyValueData] encoding:NSASCIIStringEncoding];
 }
 
 
@@ -84,4 +106,16 @@
   return [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
 }
 
+-(NSData*) binaryPlistEncodedKeyValueData {
+  
+  NSError *error = nil;
+  NSData *data = [NSPropertyListSerialization dataWithPropertyList:self
+                                                            format:NSPropertyListBinaryFormat_v1_0
+                                                           options:0 error:&error];
+  if(error)
+    NSLog(@"Property List Encoding Error: %@", error);
+  
+  return data;
+}
+
 @end
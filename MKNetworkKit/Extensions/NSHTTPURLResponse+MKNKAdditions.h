@@ -8,10 +8,18 @@
 
 #import <Foundation/Foundation.h>
 
+@class MKCacheMetadata;
+
 @interface NSHTTPURLResponse (MKNKAdditions)
 @property (readonly) BOOL isContentTypeImage;
 @property (readonly) BOOL hasDoNotCacheDirective;
 @property (readonly) BOOL hasRequiredRevalidationHeaders;
 @property (readonly) BOOL hasHTTPCacheHeaders;
+@property (readonly) NSInteger maxAge;
 @property (readonly) NSDate* cacheExpiryDate;
+
+// parsed once per response, expiry is relative to the receipt date recorded with -cacheMetadataReceivedAt:
+// responses whose receipt wasn't recorded use their Date header
+@property (readonly) MKCacheMetadata *cacheMetadata;
+-(MKCacheMetadata*) cacheMetadataReceivedAt:(NSDate*) receiptDate;
 @end
@@ -10,7 +10,9 @@
 
 #import "NSDictionary+MKNKAdditions.h"
 
-#import "NSDate+RFC1123.h"
+#import "MKCacheMetadata.h"
+
+#import <objc/runtime.h>
 
 @implementation NSHTTPURLResponse (MKNKAdditions)
 
@@ -20,85 +22,49 @@
   return ([contentType.lowercaseString rangeOfString:@"image"].location != NSNotFound);
 }
 
--(BOOL) hasDoNotCacheDirective {
+-(MKCacheMetadata*) cacheMetadata {
   
-  NSString *cacheControl = [self.allHeaderFields objectForCaseInsensitiveKey:@"Cache-Control"];
-  if(!cacheControl) return NO;
-  if(([cacheControl.lowercaseString rangeOfString:@"no-cache"].location != NSNotFound)) return YES;
-  if(self.maxAge == 0) return YES;
-  return NO;
+  return [self cacheMetadataReceivedAt:nil];
 }
 
--(BOOL) hasHTTPCacheHeaders {
+// the first call decides the receipt date, later ones return the same metadata
+-(MKCacheMetadata*) cacheMetadataReceivedAt:(NSDate*) receiptDate {
   
-  NSString *cacheControl = [self.allHeaderFields objectForCaseInsensitiveKey:@"Cache-Control"];
-  NSString *eTag = [self.allHeaderFields objectForCaseInsensitiveKey:@"ETag"];
-  NSString *lastModified = [self.allHeaderFields objectForCaseInsensitiveKey:@"Last-Modified"];
+  @synchronized(self) {
+    
+    MKCacheMetadata *metadata = objc_getAssociatedObject(self, @selector(cacheMetadata));
+    if(!metadata) {
+      
+      metadata = [[MKCacheMetadata alloc] initWithHeaderFields:self.allHeaderFields responseDate:receiptDate];
+      objc_setAssociatedObject(self, @selector(cacheMetadata), metadata, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+    }
+    
+    return metadata;
+  }
+}
+
+-(BOOL) hasDoNotCacheDirective {
   
-  return (cacheControl || eTag || lastModified);
+  return self.cacheMetadata.hasDoNotCacheDirective;
 }
 
+-(BOOL) hasHTTPCacheHeaders {
+  
+  return self.cacheMetadata.hasHTTPCacheHeaders;
+}
 
 -(NSInteger) maxAge {
   
-  __block NSInteger maxAge = 0;
-  NSString *cacheControl = [self.allHeaderFields objectForCaseInsensitiveKey:@"Cache-Control"];
-  NSArray *cacheControlEntities = [cacheControl componentsSeparatedByString:@","]; // max-age, must-revalidate, no-cache
-  [cacheControlEntities enumerateObjectsUsingBlock:^(NSString *substring, NSUInteger idx, BOOL *stop) {
-    
-    if([substring.lowercaseString rangeOfString:@"max-age"].location != NSNotFound) {
-      
-      // do some processing to calculate expiresOn
-      NSString *maxAge = nil;
-      NSArray *array = [substring componentsSeparatedByString:@"="];
-      if(array.count > 1) {
-        maxAge = array[1];
-        *stop = YES;
-      }
-    }
-  }];
-  
-  return maxAge;
+  return self.cacheMetadata.maxAge;
 }
 
 -(BOOL) hasRequiredRevalidationHeaders {
   
-  NSString *lastModified = [self.allHeaderFields objectForCaseInsensitiveKey:@"Last-Modified"];
-  NSString *eTag = [self.allHeaderFields objectForCaseInsensitiveKey:@"ETag"];
-
-  return (eTag || lastModified);
+  return self.cacheMetadata.hasValidators;
 }
 
 -(NSDate*) cacheExpiryDate {
   
-  NSString *expiresOn = [self.allHeaderFields objectForCaseInsensitiveKey:@"Expires"];
-  __block NSDate *expiresOnDate = [NSDate dateFromRFC1123:expiresOn];
-  if(expiresOnDate) return expiresOnDate;
-  
-  NSString *cacheControl = [self.allHeaderFields objectForCaseInsensitiveKey:@"Cache-Control"];
-  NSArray *cacheControlEntities = [cacheControl componentsSeparatedByString:@","]; // max-age, must-revalidate, no-cache
-  
-  [cacheControlEntities enumerateObjectsUsingBlock:^(NSString *substring, NSUInteger idx, BOOL *stop) {
-    
-    if([substring.lowercaseString rangeOfString:@"max-age"].location != NSNotFound) {
-      
-      // do some processing to calculate expiresOn
-      NSString *maxAge = nil;
-      NSArray *array = [substring componentsSeparatedByString:@"="];
-      if(array.count > 1) {
-        maxAge = array[1];
-        expiresOnDate = [[NSDate date] dateByAddingTimeInterval:[maxAge intValue]];
-      }
-    }
-    if([substring.lowercaseString rangeOfString:@"no-cache"].location != NSNotFound) {
-      
-      // Don't cache this request. It expires NOW
-      expiresOnDate = [NSDate date];
-    }
-    
-    // You can ignore must-revalidate
-  }];
-  
-  return expiresOnDate;
+  return self.cacheMetadata.expiryDate;
 }
 @end
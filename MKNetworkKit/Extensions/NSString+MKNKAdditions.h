@@ -28,6 +28,9 @@
 @interface NSString (MKNKAdditions)
 
 + (NSString *) md5StringFromData:(NSData*) data;
++ (NSString *) sha256StringFromData:(NSData*) data;
 - (NSString*) mk_urlEncodedString;
+// Appends the string's UTF-8 bytes, percent-encoded except for RFC 3986 unreserved characters
+- (void) mk_appendURLEncodedBytesToData:(NSMutableData*) data;
 - (NSString*) urlDecodedString;
 @end
@@ -28,46 +28,142 @@
 
 @implementation NSString (MKNKAdditions)
 
+static NSString *MKNKHexStringFromDigest(const unsigned char *digest, NSUInteger length)
+{
+    static const char hexCharacters[] = "0123456789abcdef";
+    char hexString[2 * CC_SHA256_DIGEST_LENGTH];
+    
+    for(NSUInteger index = 0; index < length; index ++) {
+        hexString[2 * index] = hexCharacters[digest[index] >> 4];
+        hexString[2 * index + 1] = hexCharacters[digest[index] & 0x0f];
+    }
+    
+    return [[NSString alloc] initWithBytes:hexString length:2 * length encoding:NSASCIIStringEncoding];
+}
+
+// data can contain NUL bytes, so the digests always use data.length
 + (NSString *) md5StringFromData:(NSData*) data
 {
-    const char *cStr = data.bytes;
-    unsigned char result[16];
-    CC_MD5( cStr, (unsigned int) strlen(cStr), result);
-    return [NSString stringWithFormat:
-			@"%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x%02x",
-			result[0], result[1], result[2], result[3], 
-			result[4], result[5], result[6], result[7],
-			result[8], result[9], result[10], result[11],
-			result[12], result[13], result[14], result[15]
-			];      
+    unsigned char result[CC_MD5_DIGEST_LENGTH];
+    CC_MD5(data.bytes, (CC_LONG) data.length, result);
+    return MKNKHexStringFromDigest(result, CC_MD5_DIGEST_LENGTH);
 }
 
-- (NSString*) mk_urlEncodedString { // mk_ prefix prevents a clash with a private api
-    
-    CFStringRef encodedCFString = CFURLCreateStringByAddingPercentEscapes(kCFAllocatorDefault, 
-                                                                        (__bridge CFStringRef) self, 
-                                                                        nil,
-                                                                        CFSTR("?!@#$^&%*+,:;='\"`<>()[]{}/\\| "), 
-                                                                        kCFStringEncodingUTF8);
++ (NSString *) sha256StringFromData:(NSData*) data
+{
+    unsigned char result[CC_SHA256_DIGEST_LENGTH];
+    CC_SHA256(data.bytes, (CC_LONG) data.length, result);
+    return MKNKHexStringFromDigest(result, CC_SHA256_DIGEST_LENGTH);
+}
+
+// RFC 3986 unreserved characters, everything else is percent-encoded
+static const BOOL kMKNKUnreservedCharacters[256] = {
+    ['A' ... 'Z'] = YES, ['a' ... 'z'] = YES, ['0' ... '9'] = YES,
+    ['-'] = YES, ['.'] = YES, ['_'] = YES, ['~'] = YES
+};
+
+static const uint8_t kMKNKUppercaseHexCharacters[] = "0123456789ABCDEF";
+
+static NSUInteger const kMKNKEncodingChunkSize = 256;
+
+// the value of a hex digit, or -1
+static inline int MKNKHexDigitValue(uint8_t character)
+{
+    if(character >= '0' && character <= '9') return character - '0';
+    if(character >= 'A' && character <= 'F') return character - 'A' + 10;
+    if(character >= 'a' && character <= 'f') return character - 'a' + 10;
+    return -1;
+}
+
+- (void) mk_appendURLEncodedBytesToData:(NSMutableData*) data
+{
+    // the string is converted to UTF-8 a chunk at a time on the stack, each byte becomes at most three
+    uint8_t utf8Bytes[kMKNKEncodingChunkSize * 3];
+    NSRange remainingRange = NSMakeRange(0, self.length);
     
-    NSString *encodedString = [[NSString alloc] initWithString:(__bridge_transfer NSString*) encodedCFString];    
+    while(remainingRange.length > 0) {
+        
+        NSUInteger usedLength = 0;
+        NSRange chunkRange = NSMakeRange(remainingRange.location, MIN(remainingRange.length, kMKNKEncodingChunkSize));
+        chunkRange = [self rangeOfComposedCharacterSequencesForRange:chunkRange]; // don't split surrogate pairs
+        NSRange unconvertedRange = NSMakeRange(NSNotFound, 0);
+        if(![self getBytes:utf8Bytes maxLength:sizeof(utf8Bytes) usedLength:&usedLength encoding:NSUTF8StringEncoding
+                   options:0 range:chunkRange remainingRange:&unconvertedRange] || usedLength == 0) break;
+        
+        NSUInteger offset = data.length;
+        data.length = offset + usedLength * 3;
+        uint8_t *output = (uint8_t*) data.mutableBytes + offset;
+        
+        for(NSUInteger index = 0; index < usedLength; index ++) {
+            
+            uint8_t character = utf8Bytes[index];
+            if(kMKNKUnreservedCharacters[character]) {
+                *output++ = character;
+            } else {
+                *output++ = '%';
+                *output++ = kMKNKUppercaseHexCharacters[character >> 4];
+                *output++ = kMKNKUppercaseHexCharacters[character & 0x0f];
+            }
+        }
+        
+        data.length = output - (uint8_t*) data.mutableBytes;
+        
+        // the buffer can fill up before the end of an unusually long composed character sequence
+        NSUInteger nextLocation = unconvertedRange.length ? unconvertedRange.location : NSMaxRange(chunkRange);
+        remainingRange = NSMakeRange(nextLocation, NSMaxRange(remainingRange) - nextLocation);
+    }
+}
 
-    if(!encodedString)
-        encodedString = @"";    
+- (NSString*) mk_urlEncodedString { // mk_ prefix prevents a clash with a private api
     
-    return encodedString;
+    NSMutableData *encodedData = [NSMutableData dataWithCapacity:self.length * 3];
+    [self mk_appendURLEncodedBytesToData:encodedData];
+    
+    NSString *encodedString = [[NSString alloc] initWithData:encodedData encoding:NSASCIIStringEncoding];
+    return encodedString ? encodedString : @"";
 }
 
+// Decodes in place in a single buffer, "+" is a space as in form bodies
+// Malformed escapes are kept as they are, bytes that don't decode to UTF-8 give an empty string
 - (NSString*) urlDecodedString {
-
-    CFStringRef decodedCFString = CFURLCreateStringByReplacingPercentEscapesUsingEncoding(kCFAllocatorDefault, 
-                                                                                          (__bridge CFStringRef) self, 
-                                                                                          CFSTR(""),
-                                                                                          kCFStringEncodingUTF8);
     
-    // We need to replace "+" with " " because the CF method above doesn't do it
-    NSString *decodedString = [[NSString alloc] initWithString:(__bridge_transfer NSString*) decodedCFString];    
-    return (!decodedString) ? @"" : [decodedString stringByReplacingOccurrencesOfString:@"+" withString:@" "];
+    NSUInteger maximumLength = [self maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    uint8_t stackBuffer[1024];
+    uint8_t *bytes = maximumLength <= sizeof(stackBuffer) ? stackBuffer : malloc(maximumLength);
+    if(!bytes) return @"";
+    
+    NSUInteger length = 0;
+    [self getBytes:bytes maxLength:maximumLength usedLength:&length encoding:NSUTF8StringEncoding
+           options:0 range:NSMakeRange(0, self.length) remainingRange:NULL];
+    
+    NSUInteger decodedLength = 0;
+    BOOL changed = NO;
+    for(NSUInteger index = 0; index < length; index ++) {
+        
+        uint8_t character = bytes[index];
+        if(character == '+') {
+            
+            character = ' ';
+            changed = YES;
+        } else if(character == '%' && index + 2 < length) {
+            
+            int high = MKNKHexDigitValue(bytes[index + 1]);
+            int low = MKNKHexDigitValue(bytes[index + 2]);
+            if(high >= 0 && low >= 0) {
+                
+                character = (uint8_t) (high << 4 | low);
+                index += 2;
+                changed = YES;
+            }
+        }
+        
+        bytes[decodedLength ++] = character;
+    }
+    
+    NSString *decodedString = changed ? [[NSString alloc] initWithBytes:bytes length:decodedLength encoding:NSUTF8StringEncoding] : [self copy];
+    if(bytes != stackBuffer) free(bytes);
+    
+    return decodedString ? decodedString : @"";
 }
 
 @end
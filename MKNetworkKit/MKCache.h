@@ -25,13 +25,52 @@
 
 #import <Foundation/Foundation.h>
 
+// Objects that know how to write themselves to disk without NSKeyedArchiver
+// Records are read back from memory mapped files, so initWithCacheRecordData: should avoid copying the data
+@protocol MKCacheRecord <NSCoding>
+-(instancetype) initWithCacheRecordData:(NSData*) recordData;
+-(NSData*) cacheRecordData;
+@property (readonly) NSUInteger cacheRecordCost;
+@optional
+// Records past this date are removed from disk by the janitor before any other entry
+@property (readonly) NSDate *cacheRecordExpiryDate;
+@end
+
 @interface MKCache : NSObject
 
+// inMemoryByteBudget is the number of bytes the in memory tier is allowed to hold, 0 uses the default of 10 MB
+-(instancetype) initWithCacheDirectory:(NSString*) cacheDirectory inMemoryByteBudget:(NSUInteger) inMemoryByteBudget;
+
+// inMemoryCost is the number of entries the in memory tier is allowed to hold, whatever their size
+// Prefer initWithCacheDirectory:inMemoryByteBudget:, large responses make an entry count a poor bound on memory
 -(instancetype) initWithCacheDirectory:(NSString*) cacheDirectory inMemoryCost:(NSUInteger) inMemoryCost;
 
 @property NSString *directoryPath;
-@property NSUInteger cacheMemoryCost;
+@property NSUInteger cacheMemoryCost; // number of entries kept in memory, 0 means no limit
+@property NSUInteger memoryByteBudget; // number of bytes kept in memory, 0 means no limit
+
+// When set, entries are stored as records of this class (conforming to MKCacheRecord) instead of keyed archives
+@property Class recordClass;
 
+// Number of bytes the on disk tier is allowed to use, 0 means unlimited
+// A low priority janitor removes expired entries first and then the least recently used ones
+@property unsigned long long diskCapacity;
+@property (readonly) unsigned long long totalDiskCost;
+
+@property (readonly) NSUInteger totalMemoryCost;
+@property (readonly) NSUInteger hitCount;
+@property (readonly) NSUInteger missCount;
+@property (readonly) NSUInteger evictionCount;
+
+// Safe to call from any thread. Memory hits only take a striped lock, misses read the disk on the cache queue
 - (id) objectForKeyedSubscript:(id<NSCopying>) key;
 - (void)setObject:(id<NSCoding>)obj forKeyedSubscript:(id<NSCopying>) key;
+
+// Memory hits call the completion handler right away on the calling thread
+// Misses read the disk on the cache queue and call it there. Concurrent misses for the same key share one disk read
+-(void) objectForKey:(id<NSCopying>) key completionHandler:(void (^)(id object)) completionHandler;
+
+// Evicts least recently used entries to disk until the in memory tier is within the given cost
+-(void) trimToCost:(NSUInteger) cost;
+-(void) flush;
 @end
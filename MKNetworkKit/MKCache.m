@@ -25,65 +25,286 @@
 
 #import "MKCache.h"
 
+#import <pthread.h>
+#import <stdatomic.h>
+
 @import UIKit;
 
 NSString *const kMKCacheDefaultPathExtension = @"mkcache";
-NSUInteger const kMKCacheDefaultCost = 10;
+NSUInteger const kMKCacheDefaultByteBudget = 10 * 1024 * 1024; // 10 MB
+NSUInteger const kMKCacheDefaultEntryCount = 10;
+NSUInteger const kMKCacheShardCount = 16;
+NSUInteger const kMKCacheTrimBatchSize = 16;
+unsigned long long const kMKCacheDefaultDiskCapacity = 100 * 1024 * 1024; // 100 MB
+NSString *const kMKCacheIndexFileName = @"index.plist";
+NSString *const kMKCacheIndexSizeKey = @"size";
+NSString *const kMKCacheIndexAccessDateKey = @"accessDate";
+NSString *const kMKCacheIndexExpiryDateKey = @"expiryDate";
+
+// set on the io queue, tells blocks already running on it not to enter it again
+static void *kMKCacheIOQueueKey = &kMKCacheIOQueueKey;
+
+// A node in the LRU list. The list is owned through next pointers, starting from the most recently used entry
+@interface MKCacheEntry : NSObject
+@property id <NSCopying> key;
+@property id object;
+@property NSUInteger cost;
+@property BOOL persisted;
+@property MKCacheEntry *next;
+@property (unsafe_unretained) MKCacheEntry *previous;
+@end
+
+@implementation MKCacheEntry
+@end
+
+// A lock striped slice of the in memory tier. Every shard is an independent LRU list
+// Keys are spread across shards by hash so that readers on different threads rarely contend
+@interface MKCacheShard : NSObject
+@property (nonatomic) NSMutableDictionary *entries;
+@property (nonatomic) MKCacheEntry *mostRecentlyUsedEntry;
+@property (nonatomic, unsafe_unretained) MKCacheEntry *leastRecentlyUsedEntry;
+-(void) lock;
+-(void) unlock;
+@end
+
+@implementation MKCacheShard {
+  
+  pthread_mutex_t _lock;
+}
+
+-(instancetype) init {
+  
+  if(self = [super init]) {
+    
+    self.entries = [NSMutableDictionary dictionary];
+    pthread_mutex_init(&_lock, NULL);
+  }
+  
+  return self;
+}
+
+-(void) dealloc {
+  
+  pthread_mutex_destroy(&_lock);
+}
+
+-(void) lock {
+  
+  pthread_mutex_lock(&_lock);
+}
+
+-(void) unlock {
+  
+  pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark -
+#pragma mark LRU list (call these methods only while holding the lock)
+
+-(void) unlinkEntry:(MKCacheEntry*) entry {
+  
+  if(entry.previous) {
+    entry.previous.next = entry.next;
+  } else {
+    self.mostRecentlyUsedEntry = entry.next;
+  }
+  
+  if(entry.next) {
+    entry.next.previous = entry.previous;
+  } else {
+    self.leastRecentlyUsedEntry = entry.previous;
+  }
+  
+  entry.next = nil;
+  entry.previous = nil;
+}
+
+-(void) insertEntryAtFront:(MKCacheEntry*) entry {
+  
+  entry.previous = nil;
+  entry.next = self.mostRecentlyUsedEntry;
+  self.mostRecentlyUsedEntry.previous = entry;
+  self.mostRecentlyUsedEntry = entry;
+  
+  if(!self.leastRecentlyUsedEntry) {
+    self.leastRecentlyUsedEntry = entry;
+  }
+}
+
+-(void) moveEntryToFront:(MKCacheEntry*) entry {
+  
+  if(self.mostRecentlyUsedEntry == entry) return;
+  
+  MKCacheEntry *retainedEntry = entry; // unlinking drops the strong reference held by the previous entry
+  [self unlinkEntry:retainedEntry];
+  [self insertEntryAtFront:retainedEntry];
+}
+
+// Empties the shard and returns the entries that were never written to disk
+-(NSArray*) removeAllEntries {
+  
+  NSMutableArray *unpersistedEntries = [NSMutableArray array];
+  
+  // breaks the chain while walking it, releasing a long list recursively could exhaust the stack
+  MKCacheEntry *entry = self.mostRecentlyUsedEntry;
+  while(entry) {
+    
+    if(!entry.persisted) [unpersistedEntries addObject:entry];
+    MKCacheEntry *nextEntry = entry.next;
+    entry.next = nil;
+    entry.previous = nil;
+    entry = nextEntry;
+  }
+  
+  [self.entries removeAllObjects];
+  self.mostRecentlyUsedEntry = nil;
+  self.leastRecentlyUsedEntry = nil;
+  
+  return unpersistedEntries;
+}
+
+@end
 
 @interface MKCache (/*Private Methods*/)
-@property NSMutableDictionary *inMemoryCache;
-@property NSMutableArray *recentlyUsedKeys;
-@property dispatch_queue_t queue;
+@property NSArray *shards;
+
+// disk reads run concurrently, disk writes are barriers
+@property dispatch_queue_t ioQueue;
+
+// completion handlers of asynchronous lookups waiting for the same key
+@property NSMutableDictionary *pendingLookups;
+
+// disk index, accessed only on the janitor queue
+@property dispatch_queue_t janitorQueue;
+@property NSMutableDictionary *diskIndex; // file name -> size, access date, expiry date
+@property BOOL diskIndexLoaded;
+@property BOOL janitorScheduled;
+@property (readwrite) unsigned long long totalDiskCost;
+
+// keys hit in memory since the janitor last applied them to the disk index
+@property NSMutableSet *memoryHitKeys;
 @end
 
-@implementation MKCache
+@implementation MKCache {
+  
+  atomic_ulong _totalMemoryCost;
+  atomic_ulong _entryCount;
+  atomic_ulong _hitCount;
+  atomic_ulong _missCount;
+  atomic_ulong _evictionCount;
+  pthread_mutex_t _pendingLookupsLock;
+  pthread_mutex_t _memoryHitKeysLock;
+}
+
+-(NSUInteger) totalMemoryCost {
+  
+  return atomic_load(&_totalMemoryCost);
+}
+
+-(NSUInteger) hitCount {
+  
+  return atomic_load(&_hitCount);
+}
+
+-(NSUInteger) missCount {
+  
+  return atomic_load(&_missCount);
+}
+
+-(NSUInteger) evictionCount {
+  
+  return atomic_load(&_evictionCount);
+}
 
 -(void) flush {
   
-  [self.inMemoryCache enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
+  NSMutableArray *unpersistedEntries = [NSMutableArray array];
+  for(MKCacheShard *shard in self.shards) {
     
-    NSString *stringKey = [NSString stringWithFormat:@"%@", key];
-    NSString *filePath = [[self.directoryPath stringByAppendingPathComponent:stringKey]
-                          stringByAppendingPathExtension:kMKCacheDefaultPathExtension];
+    [shard lock];
+    for(MKCacheEntry *entry in shard.entries.allValues) {
+      atomic_fetch_sub(&_totalMemoryCost, entry.cost);
+    }
+    atomic_fetch_sub(&_entryCount, shard.entries.count);
+    [unpersistedEntries addObjectsFromArray:[shard removeAllEntries]];
+    [shard unlock];
+  }
+  
+  dispatch_barrier_sync(self.ioQueue, ^{
+    
+    for(MKCacheEntry *entry in unpersistedEntries) {
+      [self writeEntryToDisk:entry];
+    }
+  });
+}
+
+-(void) didReceiveMemoryWarning {
+  
+  [self trimToCost:0];
+}
+
+-(void) trimToCost:(NSUInteger) cost {
+  
+  // evicts in small batches so that readers and writers are not locked out for long
+  dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
     
-    if([[NSFileManager defaultManager] fileExistsAtPath:filePath]) {
+    BOOL evictedEntries = NO;
+    for(MKCacheShard *shard in self.shards) {
       
-      NSError *error = nil;
-      if(![[NSFileManager defaultManager] removeItemAtPath:filePath error:&error]) {
-        NSLog(@"%@", error);
+      [shard lock];
+      for(NSUInteger index = 0; index < kMKCacheTrimBatchSize; index ++) {
+        
+        if(self.totalMemoryCost <= cost || !shard.leastRecentlyUsedEntry) break;
+        [self evictLeastRecentlyUsedEntryInShard:shard];
+        evictedEntries = YES;
       }
+      [shard unlock];
     }
     
-    NSData *dataToBeWritten = nil;
-    id objToBeWritten = self.inMemoryCache[key];
-    dataToBeWritten = [NSKeyedArchiver archivedDataWithRootObject:objToBeWritten];
-    [dataToBeWritten writeToFile:filePath atomically:YES];
-  }];
-  
-  [self.inMemoryCache removeAllObjects];
-  [self.recentlyUsedKeys removeAllObjects];
+    if(evictedEntries && self.totalMemoryCost > cost) {
+      [self trimToCost:cost];
+    }
+  });
 }
 
 -(instancetype) init {
   
   @throw [NSException exceptionWithName:NSInternalInconsistencyException
-                                 reason:@"MKCache should be initialized with the designated initializer initWithCacheDirectory:inMemoryCost:"
+                                 reason:@"MKCache should be initialized with the designated initializer initWithCacheDirectory:inMemoryByteBudget:"
                                userInfo:nil];
   return nil;
 }
 
 -(instancetype) initWithCacheDirectory:(NSString*) cacheDirectory inMemoryCost:(NSUInteger) inMemoryCost {
   
+  // inMemoryCost has always been a number of entries, they are kept whatever their size
+  if(self = [self initWithCacheDirectory:cacheDirectory inMemoryByteBudget:0]) {
+    
+    self.memoryByteBudget = 0;
+    self.cacheMemoryCost = inMemoryCost ? inMemoryCost : kMKCacheDefaultEntryCount;
+  }
+  
+  return self;
+}
+
+-(instancetype) initWithCacheDirectory:(NSString*) cacheDirectory inMemoryByteBudget:(NSUInteger) inMemoryByteBudget {
+  
   NSParameterAssert(cacheDirectory != nil);
   
   if(self = [super init]) {
     
     NSArray *paths = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES);
     self.directoryPath = [paths.firstObject stringByAppendingPathComponent:cacheDirectory];
-    self.cacheMemoryCost = inMemoryCost ? inMemoryCost : kMKCacheDefaultCost;
+    self.memoryByteBudget = inMemoryByteBudget ? inMemoryByteBudget : kMKCacheDefaultByteBudget;
+    
+    NSMutableArray *shards = [NSMutableArray arrayWithCapacity:kMKCacheShardCount];
+    for(NSUInteger index = 0; index < kMKCacheShardCount; index ++) {
+      [shards addObject:[[MKCacheShard alloc] init]];
+    }
+    self.shards = shards;
     
-    self.inMemoryCache = [NSMutableDictionary dictionaryWithCapacity:self.cacheMemoryCost];
-    self.recentlyUsedKeys = [NSMutableArray arrayWithCapacity:self.cacheMemoryCost];
+    self.pendingLookups = [NSMutableDictionary dictionary];
+    pthread_mutex_init(&_pendingLookupsLock, NULL);
     
     BOOL isDirectory = YES;
     BOOL directoryExists = [[NSFileManager defaultManager] fileExistsAtPath:self.directoryPath isDirectory:&isDirectory];
@@ -107,10 +328,19 @@ NSUInteger const kMKCacheDefaultCost = 10;
       }
     }
     
-    self.queue = dispatch_queue_create("com.mknetworkkit.cachequeue", DISPATCH_QUEUE_SERIAL);
+    self.ioQueue = dispatch_queue_create("com.mknetworkkit.cachequeue", DISPATCH_QUEUE_CONCURRENT);
+    dispatch_queue_set_specific(self.ioQueue, kMKCacheIOQueueKey, (__bridge void*) self, NULL);
+    
+    self.diskCapacity = kMKCacheDefaultDiskCapacity;
+    self.diskIndex = [NSMutableDictionary dictionary];
+    self.memoryHitKeys = [NSMutableSet set];
+    pthread_mutex_init(&_memoryHitKeysLock, NULL);
+    self.janitorQueue = dispatch_queue_create("com.mknetworkkit.cachejanitorqueue", DISPATCH_QUEUE_SERIAL);
+    dispatch_set_target_queue(self.janitorQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    [self scheduleJanitor];
     
 #if TARGET_OS_IPHONE
-    [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(flush)
+    [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(didReceiveMemoryWarning)
                                                  name:UIApplicationDidReceiveMemoryWarningNotification
                                                object:nil];
     [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(flush)
@@ -149,65 +379,491 @@ NSUInteger const kMKCacheDefaultCost = 10;
   [[NSNotificationCenter defaultCenter] removeObserver:self name:NSApplicationWillResignActiveNotification object:nil];
   [[NSNotificationCenter defaultCenter] removeObserver:self name:NSApplicationWillTerminateNotification object:nil];
 #endif
+  
+  pthread_mutex_destroy(&_pendingLookupsLock);
+  pthread_mutex_destroy(&_memoryHitKeysLock);
 }
 
--(id <NSCoding>) objectForKeyedSubscript:(id <NSCopying>) key {
+#pragma mark -
+#pragma mark In memory tier
+
+-(MKCacheShard*) shardForKey:(id <NSCopying>) key {
   
-  NSData *cachedData = self.inMemoryCache[key];
-  if(cachedData) return cachedData;
+  return self.shards[[(id) key hash] % kMKCacheShardCount];
+}
+
+-(NSString*) filePathForKey:(id <NSCopying>) key {
   
   NSString *stringKey = [NSString stringWithFormat:@"%@", key];
+  return [[self.directoryPath stringByAppendingPathComponent:stringKey]
+          stringByAppendingPathExtension:kMKCacheDefaultPathExtension];
+}
+
+-(NSUInteger) costOfObject:(id) obj {
+  
+  if(self.recordClass) {
+    
+    return [obj cacheRecordCost];
+  } else if([obj isKindOfClass:[NSData class]]) {
+    
+    return [obj length];
+  } else if([obj isKindOfClass:[NSString class]]) {
+    
+    return [obj lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+  } else if([obj isKindOfClass:[NSHTTPURLResponse class]]) {
+    
+    __block NSUInteger cost = [[obj URL] absoluteString].length;
+    [[obj allHeaderFields] enumerateKeysAndObjectsUsingBlock:^(NSString *key, NSString *value, BOOL *stop) {
+      
+      cost += key.length + value.length;
+    }];
+    return cost;
+  }
+  
+  return [NSKeyedArchiver archivedDataWithRootObject:obj].length;
+}
+
+-(id) objectInMemoryForKey:(id <NSCopying>) key {
+  
+  MKCacheShard *shard = [self shardForKey:key];
+  [shard lock];
+  MKCacheEntry *entry = shard.entries[key];
+  if(entry) [shard moveEntryToFront:entry];
+  id cachedObject = entry.object;
+  BOOL persisted = entry.persisted;
+  [shard unlock];
   
-  NSString *filePath = [[self.directoryPath stringByAppendingPathComponent:stringKey]
-                        stringByAppendingPathExtension:kMKCacheDefaultPathExtension];
+  if(cachedObject) atomic_fetch_add(&_hitCount, 1);
   
-  if([[NSFileManager defaultManager] fileExistsAtPath:filePath]) {
+  // a file that is read from memory only would otherwise look unused to the janitor
+  if(cachedObject && persisted) [self recordMemoryHitForKey:key];
+  return cachedObject;
+}
+
+// A limit of 0 is no limit
+-(BOOL) exceedsMemoryLimits {
+  
+  NSUInteger memoryByteBudget = self.memoryByteBudget;
+  if(memoryByteBudget > 0 && self.totalMemoryCost > memoryByteBudget) return YES;
+  
+  NSUInteger cacheMemoryCost = self.cacheMemoryCost;
+  return cacheMemoryCost > 0 && atomic_load(&_entryCount) > cacheMemoryCost;
+}
+
+// Must be called while holding the shard's lock
+// The disk write is queued before the entry disappears from memory, so a later disk read always sees it
+-(void) evictLeastRecentlyUsedEntryInShard:(MKCacheShard*) shard {
+  
+  MKCacheEntry *entry = shard.leastRecentlyUsedEntry;
+  if(!entry) return;
+  
+  [shard unlinkEntry:entry];
+  [shard.entries removeObjectForKey:entry.key];
+  atomic_fetch_sub(&_totalMemoryCost, entry.cost);
+  atomic_fetch_sub(&_entryCount, 1);
+  atomic_fetch_add(&_evictionCount, 1);
+  
+  if(!entry.persisted) {
     
-    cachedData = [NSKeyedUnarchiver unarchiveObjectWithData:[NSData dataWithContentsOfFile:filePath]];
-    self.inMemoryCache[key] = cachedData;
-    return cachedData;
+    dispatch_barrier_async(self.ioQueue, ^{
+      [self writeEntryToDisk:entry];
+    });
   }
+}
+
+// Returns the object that ends up in memory
+// An object read from disk never replaces a newer one that was set while the read was in progress
+-(id) addEntryWithObject:(id) obj forKey:(id <NSCopying>) key cost:(NSUInteger) cost persisted:(BOOL) persisted {
   
-  return nil;
+  MKCacheShard *shard = [self shardForKey:key];
+  [shard lock];
+  
+  MKCacheEntry *entry = shard.entries[key];
+  
+  if(entry && persisted) {
+    
+    [shard moveEntryToFront:entry];
+    id cachedObject = entry.object;
+    [shard unlock];
+    return cachedObject;
+  }
+  
+  if(entry) {
+    
+    atomic_fetch_sub(&_totalMemoryCost, entry.cost);
+    [shard moveEntryToFront:entry];
+  } else {
+    
+    entry = [[MKCacheEntry alloc] init];
+    entry.key = key;
+    shard.entries[key] = entry;
+    [shard insertEntryAtFront:entry];
+    atomic_fetch_add(&_entryCount, 1);
+  }
+  
+  entry.object = obj;
+  entry.cost = cost;
+  entry.persisted = persisted;
+  atomic_fetch_add(&_totalMemoryCost, cost);
+  
+  while([self exceedsMemoryLimits] && shard.leastRecentlyUsedEntry) {
+    
+    [self evictLeastRecentlyUsedEntryInShard:shard];
+  }
+  [shard unlock];
+  
+  // still over budget, the other shards give up their least recently used entries
+  // only one shard lock is held at a time
+  for(MKCacheShard *otherShard in self.shards) {
+    
+    if(![self exceedsMemoryLimits]) break;
+    if(otherShard == shard) continue;
+    
+    [otherShard lock];
+    while([self exceedsMemoryLimits] && otherShard.leastRecentlyUsedEntry) {
+      
+      [self evictLeastRecentlyUsedEntryInShard:otherShard];
+    }
+    [otherShard unlock];
+  }
+  
+  return obj;
 }
 
-- (void)setObject:(id <NSCoding>) obj forKeyedSubscript:(id <NSCopying>) key {
+#pragma mark -
+#pragma mark Disk tier (call these methods only on the io queue)
+
+-(void) writeEntryToDisk:(MKCacheEntry*) entry {
+  
+  if(entry.persisted) return;
+  
+  NSData *dataToBeWritten = self.recordClass ? [entry.object cacheRecordData] :
+  [NSKeyedArchiver archivedDataWithRootObject:entry.object];
+  NSString *filePath = [self filePathForKey:entry.key];
+  if(![dataToBeWritten writeToFile:filePath atomically:YES]) {
+    NSLog(@"Cannot write cache entry for key %@ to disk", entry.key);
+    return;
+  }
+  entry.persisted = YES;
+  
+  NSDate *expiryDate = nil;
+  if([entry.object respondsToSelector:@selector(cacheRecordExpiryDate)]) {
+    expiryDate = [entry.object cacheRecordExpiryDate];
+  }
+  
+  [self updateDiskIndexForFileName:filePath.lastPathComponent size:dataToBeWritten.length expiryDate:expiryDate];
+}
+
+-(id) loadObjectFromDiskForKey:(id <NSCopying>) key {
   
-  dispatch_async(self.queue, ^{
+  // another lookup might have loaded it while this one was waiting
+  id cachedObject = [self objectInMemoryForKey:key];
+  if(cachedObject) return cachedObject;
+  
+  NSUInteger cost = 0;
+  NSString *filePath = [self filePathForKey:key];
+  if(self.recordClass) {
     
-    self.inMemoryCache[key] = obj;
+    NSData *recordData = [NSData dataWithContentsOfFile:filePath
+                                                options:NSDataReadingMappedIfSafe
+                                                  error:nil];
+    if(recordData) {
+      
+      cachedObject = [[self.recordClass alloc] initWithCacheRecordData:recordData];
+      cost = [cachedObject cacheRecordCost];
+    }
+  } else {
     
-    // inserts the recently added item's key into the top of the queue.
-    NSUInteger index = [self.recentlyUsedKeys indexOfObject:key];
+    NSData *archivedData = [NSData dataWithContentsOfFile:filePath];
+    if(archivedData) {
+      
+      cachedObject = [NSKeyedUnarchiver unarchiveObjectWithData:archivedData];
+      cost = archivedData.length;
+    }
+  }
+  
+  if(!cachedObject) {
     
-    if(index != NSNotFound) {
-      [self.recentlyUsedKeys removeObjectAtIndex:index];
+    atomic_fetch_add(&_missCount, 1);
+    return nil;
+  }
+  
+  atomic_fetch_add(&_hitCount, 1);
+  [self touchDiskIndexForFileName:filePath.lastPathComponent];
+  
+  // the entry is already on disk, evicting it again doesn't need another write
+  return [self addEntryWithObject:cachedObject forKey:key cost:cost persisted:YES];
+}
+
+#pragma mark -
+#pragma mark Disk index and janitor
+
+-(void) updateDiskIndexForFileName:(NSString*) fileName size:(unsigned long long) size expiryDate:(NSDate*) expiryDate {
+  
+  NSDate *accessDate = [NSDate date];
+  dispatch_async(self.janitorQueue, ^{
+    
+    NSDictionary *previousInfo = self.diskIndex[fileName];
+    self.totalDiskCost -= [previousInfo[kMKCacheIndexSizeKey] unsignedLongLongValue];
+    
+    NSMutableDictionary *info = [NSMutableDictionary dictionaryWithCapacity:3];
+    info[kMKCacheIndexSizeKey] = @(size);
+    info[kMKCacheIndexAccessDateKey] = accessDate;
+    if(expiryDate) info[kMKCacheIndexExpiryDateKey] = expiryDate;
+    self.diskIndex[fileName] = info;
+    self.totalDiskCost += size;
+    
+    if(self.diskCapacity > 0 && self.totalDiskCost > self.diskCapacity) {
+      [self scheduleJanitor];
     }
+  });
+}
+
+-(void) touchDiskIndexForFileName:(NSString*) fileName {
+  
+  NSDate *accessDate = [NSDate date];
+  dispatch_async(self.janitorQueue, ^{
+    
+    NSMutableDictionary *info = [self.diskIndex[fileName] mutableCopy];
+    if(!info) return;
+    
+    info[kMKCacheIndexAccessDateKey] = accessDate;
+    self.diskIndex[fileName] = info;
+  });
+}
+
+// Hits are batched, the first hit after a flush queues one update of the disk index for all of them
+-(void) recordMemoryHitForKey:(id <NSCopying>) key {
+  
+  pthread_mutex_lock(&_memoryHitKeysLock);
+  BOOL updateQueued = self.memoryHitKeys.count > 0;
+  [self.memoryHitKeys addObject:key];
+  pthread_mutex_unlock(&_memoryHitKeysLock);
+  
+  if(updateQueued) return;
+  dispatch_async(self.janitorQueue, ^{
+    [self applyMemoryHitsToDiskIndex];
+  });
+}
+
+// Must be called on the janitor queue
+-(void) applyMemoryHitsToDiskIndex {
+  
+  pthread_mutex_lock(&_memoryHitKeysLock);
+  NSSet *keys = self.memoryHitKeys;
+  if(keys.count > 0) self.memoryHitKeys = [NSMutableSet set];
+  pthread_mutex_unlock(&_memoryHitKeysLock);
+  
+  if(keys.count == 0) return;
+  
+  NSDate *accessDate = [NSDate date];
+  for(id <NSCopying> key in keys) {
+    
+    NSString *fileName = [self filePathForKey:key].lastPathComponent;
+    NSMutableDictionary *info = [self.diskIndex[fileName] mutableCopy];
+    if(!info) continue;
+    
+    info[kMKCacheIndexAccessDateKey] = accessDate;
+    self.diskIndex[fileName] = info;
+  }
+}
+
+// Must be called on the janitor queue
+// Merges the index persisted by the previous run with the files actually present in the cache directory
+-(void) loadDiskIndexIfNeeded {
+  
+  if(self.diskIndexLoaded) return;
+  self.diskIndexLoaded = YES;
+  
+  NSString *indexPath = [self.directoryPath stringByAppendingPathComponent:kMKCacheIndexFileName];
+  NSDictionary *persistedIndex = [NSDictionary dictionaryWithContentsOfFile:indexPath];
+  NSMutableDictionary *loadedIndex = [NSMutableDictionary dictionary];
+  
+  NSFileManager *fileManager = [[NSFileManager alloc] init];
+  NSArray *fileNames = [fileManager contentsOfDirectoryAtPath:self.directoryPath error:nil];
+  for(NSString *fileName in fileNames) {
     
-    [self.recentlyUsedKeys insertObject:key atIndex:0];
+    if(![fileName.pathExtension isEqualToString:kMKCacheDefaultPathExtension]) continue;
     
-    if(self.recentlyUsedKeys.count > self.cacheMemoryCost) {
+    NSDictionary *info = persistedIndex[fileName];
+    if(!info) {
       
-      id<NSCopying> lastUsedKey = self.recentlyUsedKeys.lastObject;
-      id objectThatNeedsToBeWrittenToDisk = [NSKeyedArchiver archivedDataWithRootObject:self.inMemoryCache[lastUsedKey]];
-      [self.inMemoryCache removeObjectForKey:lastUsedKey];
+      NSDictionary *attributes = [fileManager attributesOfItemAtPath:
+                                  [self.directoryPath stringByAppendingPathComponent:fileName] error:nil];
+      if(!attributes) continue;
+      info = @{kMKCacheIndexSizeKey : @(attributes.fileSize),
+               kMKCacheIndexAccessDateKey : attributes.fileModificationDate ? attributes.fileModificationDate : [NSDate date]};
+    }
+    
+    loadedIndex[fileName] = info;
+  }
+  
+  // entries written since launch are newer than anything on disk
+  [loadedIndex addEntriesFromDictionary:self.diskIndex];
+  self.diskIndex = loadedIndex;
+  
+  unsigned long long totalDiskCost = 0;
+  for(NSDictionary *info in self.diskIndex.allValues) {
+    totalDiskCost += [info[kMKCacheIndexSizeKey] unsignedLongLongValue];
+  }
+  self.totalDiskCost = totalDiskCost;
+}
+
+-(void) scheduleJanitor {
+  
+  dispatch_async(self.janitorQueue, ^{
+    
+    if(self.janitorScheduled) return;
+    self.janitorScheduled = YES;
+    
+    // runs as a separate block so that index updates queued in the meantime are applied first
+    dispatch_async(self.janitorQueue, ^{
+      
+      self.janitorScheduled = NO;
+      [self removeExpiredAndLeastRecentlyUsedFiles];
+    });
+  });
+}
+
+// Must be called on the janitor queue
+-(void) removeExpiredAndLeastRecentlyUsedFiles {
+  
+  [self loadDiskIndexIfNeeded];
+  [self applyMemoryHitsToDiskIndex];
+  
+  NSFileManager *fileManager = [[NSFileManager alloc] init];
+  NSDate *now = [NSDate date];
+  
+  NSMutableArray *expiredFileNames = [NSMutableArray array];
+  [self.diskIndex enumerateKeysAndObjectsUsingBlock:^(NSString *fileName, NSDictionary *info, BOOL *stop) {
+    
+    NSDate *expiryDate = info[kMKCacheIndexExpiryDateKey];
+    if(expiryDate && [expiryDate compare:now] == NSOrderedAscending) {
+      [expiredFileNames addObject:fileName];
+    }
+  }];
+  
+  [self removeFilesNamed:expiredFileNames fileManager:fileManager];
+  
+  if(self.diskCapacity > 0 && self.totalDiskCost > self.diskCapacity) {
+    
+    // trim below the limit so that the next few writes don't trigger another pass right away
+    unsigned long long targetDiskCost = self.diskCapacity / 4 * 3;
+    unsigned long long remainingDiskCost = self.totalDiskCost;
+    NSArray *fileNamesByAccessDate =
+    [self.diskIndex keysSortedByValueUsingComparator:^NSComparisonResult(NSDictionary *info1, NSDictionary *info2) {
       
-      NSString *stringKey = [NSString stringWithFormat:@"%@", lastUsedKey];
+      return [info1[kMKCacheIndexAccessDateKey] compare:info2[kMKCacheIndexAccessDateKey]];
+    }];
+    
+    NSMutableArray *leastRecentlyUsedFileNames = [NSMutableArray array];
+    for(NSString *fileName in fileNamesByAccessDate) {
       
-      NSString *filePath = [[self.directoryPath stringByAppendingPathComponent:stringKey] stringByAppendingPathExtension:kMKCacheDefaultPathExtension];
+      if(remainingDiskCost <= targetDiskCost) break;
+      [leastRecentlyUsedFileNames addObject:fileName];
+      remainingDiskCost -= [self.diskIndex[fileName][kMKCacheIndexSizeKey] unsignedLongLongValue];
+    }
+    
+    [self removeFilesNamed:leastRecentlyUsedFileNames fileManager:fileManager];
+  }
+  
+  NSString *indexPath = [self.directoryPath stringByAppendingPathComponent:kMKCacheIndexFileName];
+  if(![self.diskIndex writeToFile:indexPath atomically:YES]) {
+    NSLog(@"Cannot write cache index to %@", indexPath);
+  }
+}
+
+// Must be called on the janitor queue
+// Files are removed in a barrier on the io queue, so they never disappear under a read or a write in progress
+-(void) removeFilesNamed:(NSArray*) fileNames fileManager:(NSFileManager*) fileManager {
+  
+  if(fileNames.count == 0) return;
+  
+  NSMutableArray *removedFileNames = [NSMutableArray arrayWithCapacity:fileNames.count];
+  dispatch_barrier_sync(self.ioQueue, ^{
+    
+    for(NSString *fileName in fileNames) {
       
-      if([[NSFileManager defaultManager] fileExistsAtPath:filePath]) {
+      NSError *error = nil;
+      NSString *filePath = [self.directoryPath stringByAppendingPathComponent:fileName];
+      if(![fileManager removeItemAtPath:filePath error:&error] && [fileManager fileExistsAtPath:filePath]) {
         
-        NSError *error = nil;
-        if(![[NSFileManager defaultManager] removeItemAtPath:filePath error:&error]) {
-          NSLog(@"Cannot remove file: %@", error);
-        }
+        NSLog(@"Cannot remove file: %@", error);
+        continue;
       }
       
-      [objectThatNeedsToBeWrittenToDisk writeToFile:filePath atomically:YES];
-      [self.recentlyUsedKeys removeLastObject];
+      [removedFileNames addObject:fileName];
+    }
+  });
+  
+  for(NSString *fileName in removedFileNames) {
+    
+    self.totalDiskCost -= [self.diskIndex[fileName][kMKCacheIndexSizeKey] unsignedLongLongValue];
+    [self.diskIndex removeObjectForKey:fileName];
+  }
+}
+
+#pragma mark -
+#pragma mark Subscripting
+
+-(id <NSCoding>) objectForKeyedSubscript:(id <NSCopying>) key {
+  
+  id cachedObject = [self objectInMemoryForKey:key];
+  if(cachedObject) return cachedObject;
+  
+  // lookup completion handlers run on the io queue, waiting on it from there deadlocks behind a pending write
+  if(dispatch_get_specific(kMKCacheIOQueueKey) == (__bridge void*) self) {
+    return [self loadObjectFromDiskForKey:key];
+  }
+  
+  __block id loadedObject = nil;
+  dispatch_sync(self.ioQueue, ^{
+    loadedObject = [self loadObjectFromDiskForKey:key];
+  });
+  
+  return loadedObject;
+}
+
+-(void) objectForKey:(id <NSCopying>) key completionHandler:(void (^)(id object)) completionHandler {
+  
+  id cachedObject = [self objectInMemoryForKey:key];
+  if(cachedObject) {
+    
+    completionHandler(cachedObject);
+    return;
+  }
+  
+  pthread_mutex_lock(&_pendingLookupsLock);
+  NSMutableArray *waitingHandlers = self.pendingLookups[key];
+  BOOL lookupInProgress = (waitingHandlers != nil);
+  if(!lookupInProgress) {
+    
+    waitingHandlers = [NSMutableArray array];
+    self.pendingLookups[key] = waitingHandlers;
+  }
+  [waitingHandlers addObject:[completionHandler copy]];
+  pthread_mutex_unlock(&_pendingLookupsLock);
+  
+  if(lookupInProgress) return; // joins the lookup that is already reading this key
+  
+  dispatch_async(self.ioQueue, ^{
+    
+    id loadedObject = [self loadObjectFromDiskForKey:key];
+    
+    pthread_mutex_lock(&self->_pendingLookupsLock);
+    NSArray *handlers = self.pendingLookups[key];
+    [self.pendingLookups removeObjectForKey:key];
+    pthread_mutex_unlock(&self->_pendingLookupsLock);
+    
+    for(void (^handler)(id) in handlers) {
+      handler(loadedObject);
     }
   });
 }
 
+- (void)setObject:(id <NSCoding>) obj forKeyedSubscript:(id <NSCopying>) key {
+  
+  [self addEntryWithObject:obj forKey:key cost:[self costOfObject:obj] persisted:NO];
+}
+
 @end
@@ -0,0 +1,60 @@
+//
+//  MKCacheMetadata.h
+//  MKNetworkKit
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+/*!
+ *  @abstract HTTP caching information of a response, parsed in a single pass over its headers
+ *
+ *  @discussion
+ *	Cache-Control directives, validators and the absolute expiry date are computed once when the metadata is created.
+ *  Durations are in seconds and are -1 when the directive is absent.
+ */
+@interface MKCacheMetadata : NSObject
+
+// expiry is computed relative to the date the response was received, less the age it already had
+// without a receipt date, the response's Date header (or else the current date) stands in for it
+-(instancetype) initWithHeaderFields:(NSDictionary*) headerFields responseDate:(NSDate*) responseDate;
+
+// used when the absolute expiry date was stored alongside a cached response
+-(instancetype) initWithHeaderFields:(NSDictionary*) headerFields expiryDate:(NSDate*) expiryDate;
+
+// s-maxage only applies to shared caches, MKCache is a private one and ignores it
+@property (readonly) NSInteger maxAge;
+@property (readonly) NSInteger staleWhileRevalidate;
+@property (readonly) NSInteger staleIfError;
+@property (readonly) BOOL noStore;
+@property (readonly) BOOL noCache;
+@property (readonly) BOOL mustRevalidate;
+
+@property (readonly) NSString *eTag;
+@property (readonly) NSString *lastModified;
+@property (readonly) NSDate *expiryDate;
+
+@property (readonly) BOOL hasCacheControl;
+@property (readonly) BOOL hasValidators;
+@property (readonly) BOOL hasHTTPCacheHeaders;
+@property (readonly) BOOL hasDoNotCacheDirective;
+
+@end
@@ -0,0 +1,217 @@
+//
+//  MKCacheMetadata.m
+//  MKNetworkKit
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import "MKCacheMetadata.h"
+
+#import "NSDate+RFC1123.h"
+
+#import <strings.h>
+
+@interface MKCacheMetadata (/*Private Methods*/)
+@property (readwrite) NSInteger maxAge;
+@property (readwrite) NSInteger staleWhileRevalidate;
+@property (readwrite) NSInteger staleIfError;
+@property (readwrite) BOOL noStore;
+@property (readwrite) BOOL noCache;
+@property (readwrite) BOOL mustRevalidate;
+@property (readwrite) NSString *eTag;
+@property (readwrite) NSString *lastModified;
+@property (readwrite) NSDate *expiryDate;
+@property (readwrite) BOOL hasCacheControl;
+@property NSString *expires;
+@property NSString *date;
+@property NSInteger age;
+@end
+
+static BOOL MKCacheMetadataDirectiveMatches(const char *name, size_t nameLength, const char *directive) {
+  
+  return strlen(directive) == nameLength && strncasecmp(name, directive, nameLength) == 0;
+}
+
+static NSInteger MKCacheMetadataParseSeconds(const char *value, size_t valueLength) {
+  
+  if(valueLength == 0) return -1;
+  
+  NSInteger seconds = 0;
+  for(size_t index = 0; index < valueLength; index ++) {
+    
+    if(value[index] < '0' || value[index] > '9') return -1;
+    if(seconds < NSIntegerMax / 10) seconds = seconds * 10 + (value[index] - '0');
+  }
+  
+  return seconds;
+}
+
+@implementation MKCacheMetadata
+
+-(instancetype) initWithHeaderFields:(NSDictionary*) headerFields {
+  
+  if(self = [super init]) {
+    
+    self.maxAge = -1;
+    self.staleWhileRevalidate = -1;
+    self.staleIfError = -1;
+    
+    __block NSString *cacheControl = nil;
+    __block NSString *age = nil;
+    [headerFields enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSString *value, BOOL *stop) {
+      
+      if([name caseInsensitiveCompare:@"Cache-Control"] == NSOrderedSame) {
+        cacheControl = value;
+      } else if([name caseInsensitiveCompare:@"ETag"] == NSOrderedSame) {
+        self.eTag = value;
+      } else if([name caseInsensitiveCompare:@"Last-Modified"] == NSOrderedSame) {
+        self.lastModified = value;
+      } else if([name caseInsensitiveCompare:@"Expires"] == NSOrderedSame) {
+        self.expires = value;
+      } else if([name caseInsensitiveCompare:@"Age"] == NSOrderedSame) {
+        age = value;
+      } else if([name caseInsensitiveCompare:@"Date"] == NSOrderedSame) {
+        self.date = value;
+      }
+    }];
+    
+    if(age) self.age = MAX(age.integerValue, 0);
+    if(cacheControl) [self parseCacheControl:cacheControl];
+  }
+  
+  return self;
+}
+
+-(instancetype) initWithHeaderFields:(NSDictionary*) headerFields responseDate:(NSDate*) responseDate {
+  
+  if(self = [self initWithHeaderFields:headerFields]) {
+    
+    NSDate *date = self.date ? [NSDate dateFromRFC1123:self.date] : nil;
+    NSDate *receiptDate = responseDate ? responseDate : (date ? date : [NSDate date]);
+    
+    // RFC 7234 4.2.3, the response is as old as its Age header or its Date says, whichever is older
+    NSTimeInterval apparentAge = date ? MAX(0, [receiptDate timeIntervalSinceDate:date]) : 0;
+    NSTimeInterval currentAge = MAX(apparentAge, self.age);
+    
+    if(self.noStore || self.noCache) {
+      
+      self.expiryDate = receiptDate; // expires right away
+    } else if(self.maxAge >= 0) {
+      
+      // max-age takes precedence over Expires
+      self.expiryDate = [receiptDate dateByAddingTimeInterval:self.maxAge - currentAge];
+    } else if(self.expires) {
+      
+      // Expires is compared with the server's Date, so that a skewed local clock doesn't matter
+      NSDate *expiresDate = [NSDate dateFromRFC1123:self.expires];
+      if(expiresDate && date) {
+        self.expiryDate = [receiptDate dateByAddingTimeInterval:[expiresDate timeIntervalSinceDate:date] - currentAge];
+      } else {
+        self.expiryDate = expiresDate;
+      }
+    }
+  }
+  
+  return self;
+}
+
+-(instancetype) initWithHeaderFields:(NSDictionary*) headerFields expiryDate:(NSDate*) expiryDate {
+  
+  if(self = [self initWithHeaderFields:headerFields]) {
+    
+    self.expiryDate = expiryDate;
+  }
+  
+  return self;
+}
+
+// Cache-Control: directive[=value], directive[="quoted value"], ...
+-(void) parseCacheControl:(NSString*) cacheControl {
+  
+  self.hasCacheControl = YES;
+  
+  const char *cursor = cacheControl.UTF8String;
+  while(cursor && *cursor) {
+    
+    while(*cursor == ' ' || *cursor == '\t' || *cursor == ',') cursor ++;
+    if(!*cursor) break;
+    
+    const char *name = cursor;
+    while(*cursor && *cursor != '=' && *cursor != ',' && *cursor != ' ' && *cursor != '\t') cursor ++;
+    size_t nameLength = cursor - name;
+    
+    while(*cursor == ' ' || *cursor == '\t') cursor ++;
+    
+    const char *value = NULL;
+    size_t valueLength = 0;
+    if(*cursor == '=') {
+      
+      cursor ++;
+      while(*cursor == ' ' || *cursor == '\t') cursor ++;
+      
+      if(*cursor == '"') {
+        
+        value = ++cursor;
+        while(*cursor && *cursor != '"') cursor ++;
+        valueLength = cursor - value;
+        if(*cursor == '"') cursor ++;
+      } else {
+        
+        value = cursor;
+        while(*cursor && *cursor != ',' && *cursor != ' ' && *cursor != '\t') cursor ++;
+        valueLength = cursor - value;
+      }
+    }
+    
+    // skips anything left of this directive
+    while(*cursor && *cursor != ',') cursor ++;
+    
+    if(MKCacheMetadataDirectiveMatches(name, nameLength, "max-age")) {
+      self.maxAge = MKCacheMetadataParseSeconds(value, valueLength);
+    } else if(MKCacheMetadataDirectiveMatches(name, nameLength, "no-store")) {
+      self.noStore = YES;
+    } else if(MKCacheMetadataDirectiveMatches(name, nameLength, "no-cache")) {
+      self.noCache = YES;
+    } else if(MKCacheMetadataDirectiveMatches(name, nameLength, "must-revalidate")) {
+      self.mustRevalidate = YES;
+    } else if(MKCacheMetadataDirectiveMatches(name, nameLength, "stale-while-revalidate")) {
+      self.staleWhileRevalidate = MKCacheMetadataParseSeconds(value, valueLength);
+    } else if(MKCacheMetadataDirectiveMatches(name, nameLength, "stale-if-error")) {
+      self.staleIfError = MKCacheMetadataParseSeconds(value, valueLength);
+    }
+  }
+}
+
+-(BOOL) hasValidators {
+  
+  return (self.eTag || self.lastModified);
+}
+
+-(BOOL) hasHTTPCacheHeaders {
+  
+  return (self.hasCacheControl || self.hasValidators);
+}
+
+-(BOOL) hasDoNotCacheDirective {
+  
+  return self.noCache || self.noStore || self.maxAge == 0;
+}
+
+@end
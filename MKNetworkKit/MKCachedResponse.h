@@ -0,0 +1,48 @@
+//
+//  MKCachedResponse.h
+//  MKNetworkKit
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+#import "MKCache.h"
+#import "MKCacheMetadata.h"
+
+/*!
+ *  @abstract A cached HTTP response, stored as a single record on disk
+ *
+ *  @discussion
+ *	The record is a compact binary header (status code, absolute expiry, URL and header fields) followed by the raw body.
+ *  When read back from a memory mapped file, the body is returned without copying or unarchiving it.
+ */
+@interface MKCachedResponse : NSObject <MKCacheRecord>
+
+-(instancetype) initWithResponse:(NSHTTPURLResponse*) response data:(NSData*) data;
+
+// The same body with the stored header fields updated from a 304 Not Modified response, and a new expiry
+-(instancetype) cachedResponseUpdatedWithNotModifiedResponse:(NSHTTPURLResponse*) notModifiedResponse;
+
+@property (readonly) NSHTTPURLResponse *response;
+@property (readonly) NSData *data;
+@property (readonly) MKCacheMetadata *metadata;
+
+@end
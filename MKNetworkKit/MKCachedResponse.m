@@ -0,0 +1,255 @@
+//
+//  MKCachedResponse.m
+//  MKNetworkKit
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import "MKCachedResponse.h"
+
+#import <libkern/OSByteOrder.h>
+
+#import "NSHTTPURLResponse+MKNKAdditions.h"
+
+// Record layout, all integers are little endian
+// 'MKCR' | version (uint16) | flags (uint16) | status code (uint32) | header block length (uint32) | expiry (int64)
+// expiry is in seconds since 1970 and only valid when kMKCachedResponseHasExpiryFlag is set
+// header block: URL, header count (uint32), then each header name and value
+// strings are stored as length (uint32) followed by UTF-8 bytes
+// body: everything after the header block
+
+static const char kMKCachedResponseMagic[4] = {'M', 'K', 'C', 'R'};
+static const uint16_t kMKCachedResponseVersion = 2;
+static const uint16_t kMKCachedResponseHasExpiryFlag = 1 << 0;
+static const NSUInteger kMKCachedResponsePreambleLength = 24;
+
+static void MKCachedResponseAppendUInt32(NSMutableData *data, uint32_t value) {
+  
+  uint32_t littleEndianValue = OSSwapHostToLittleInt32(value);
+  [data appendBytes:&littleEndianValue length:sizeof(littleEndianValue)];
+}
+
+static void MKCachedResponseAppendString(NSMutableData *data, NSString *string) {
+  
+  NSData *stringData = [string dataUsingEncoding:NSUTF8StringEncoding];
+  MKCachedResponseAppendUInt32(data, (uint32_t) stringData.length);
+  [data appendData:stringData];
+}
+
+static BOOL MKCachedResponseReadUInt32(const uint8_t *bytes, NSUInteger length, NSUInteger *offset, uint32_t *value) {
+  
+  if(length < *offset + sizeof(uint32_t)) return NO;
+  *value = OSReadLittleInt32(bytes, *offset);
+  *offset += sizeof(uint32_t);
+  return YES;
+}
+
+static NSString *MKCachedResponseReadString(const uint8_t *bytes, NSUInteger length, NSUInteger *offset) {
+  
+  uint32_t stringLength = 0;
+  if(!MKCachedResponseReadUInt32(bytes, length, offset, &stringLength)) return nil;
+  if(length < *offset + stringLength) return nil;
+  
+  NSString *string = [[NSString alloc] initWithBytes:bytes + *offset length:stringLength encoding:NSUTF8StringEncoding];
+  *offset += stringLength;
+  return string;
+}
+
+@interface MKCachedResponse (/*Private Methods*/)
+@property (readwrite) NSHTTPURLResponse *response;
+@property (readwrite) NSData *data;
+@property (readwrite) MKCacheMetadata *metadata;
+@end
+
+@implementation MKCachedResponse
+
+-(instancetype) initWithResponse:(NSHTTPURLResponse*) response data:(NSData*) data metadata:(MKCacheMetadata*) metadata {
+  
+  if(self = [super init]) {
+    
+    self.response = response;
+    self.data = data ? data : [NSData data];
+    self.metadata = metadata;
+  }
+  
+  return self;
+}
+
+-(instancetype) initWithResponse:(NSHTTPURLResponse*) response data:(NSData*) data {
+  
+  return [self initWithResponse:response data:data metadata:response.cacheMetadata];
+}
+
+-(instancetype) cachedResponseUpdatedWithNotModifiedResponse:(NSHTTPURLResponse*) notModifiedResponse {
+  
+  // header names are case insensitive, an updated header replaces the stored one whatever its spelling
+  NSMutableDictionary *headerFields = [NSMutableDictionary dictionary];
+  NSMutableDictionary *headerNames = [NSMutableDictionary dictionary];
+  
+  void (^addHeaderField)(NSString*, NSString*, BOOL*) = ^(NSString *name, NSString *value, BOOL *stop) {
+    
+    NSString *lowercaseName = name.lowercaseString;
+    NSString *storedName = headerNames[lowercaseName];
+    if(storedName) [headerFields removeObjectForKey:storedName];
+    
+    headerNames[lowercaseName] = name;
+    headerFields[name] = value;
+  };
+  
+  [self.response.allHeaderFields enumerateKeysAndObjectsUsingBlock:addHeaderField];
+  [notModifiedResponse.allHeaderFields enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSString *value, BOOL *stop) {
+    
+    // the 304 has no body, its length doesn't describe the stored one
+    if([name caseInsensitiveCompare:@"Content-Length"] == NSOrderedSame) return;
+    addHeaderField(name, value, stop);
+  }];
+  
+  NSHTTPURLResponse *response = [[NSHTTPURLResponse alloc] initWithURL:self.response.URL
+                                                            statusCode:self.response.statusCode
+                                                           HTTPVersion:@"HTTP/1.1"
+                                                          headerFields:headerFields];
+  return [[[self class] alloc] initWithResponse:response data:self.data];
+}
+
+#pragma mark -
+#pragma mark MKCacheRecord
+
+-(instancetype) initWithCacheRecordData:(NSData*) recordData {
+  
+  const uint8_t *bytes = recordData.bytes;
+  NSUInteger length = recordData.length;
+  
+  if(length < kMKCachedResponsePreambleLength ||
+     memcmp(bytes, kMKCachedResponseMagic, sizeof(kMKCachedResponseMagic)) != 0 ||
+     OSReadLittleInt16(bytes, 4) != kMKCachedResponseVersion) {
+    
+    return nil;
+  }
+  
+  uint16_t flags = OSReadLittleInt16(bytes, 6);
+  NSInteger statusCode = OSReadLittleInt32(bytes, 8);
+  NSUInteger headerBlockLength = OSReadLittleInt32(bytes, 12);
+  int64_t expiry = (int64_t) OSReadLittleInt64(bytes, 16);
+  NSUInteger bodyOffset = kMKCachedResponsePreambleLength + headerBlockLength;
+  if(length < bodyOffset) return nil;
+  
+  NSUInteger offset = kMKCachedResponsePreambleLength;
+  NSString *urlString = MKCachedResponseReadString(bytes, bodyOffset, &offset);
+  
+  uint32_t headerCount = 0;
+  if(!urlString || !MKCachedResponseReadUInt32(bytes, bodyOffset, &offset, &headerCount)) return nil;
+  
+  NSMutableDictionary *headers = [NSMutableDictionary dictionaryWithCapacity:headerCount];
+  for(uint32_t index = 0; index < headerCount; index ++) {
+    
+    NSString *name = MKCachedResponseReadString(bytes, bodyOffset, &offset);
+    NSString *value = MKCachedResponseReadString(bytes, bodyOffset, &offset);
+    if(!name || !value) return nil;
+    headers[name] = value;
+  }
+  
+  NSHTTPURLResponse *response = [[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:urlString]
+                                                            statusCode:statusCode
+                                                           HTTPVersion:@"HTTP/1.1"
+                                                          headerFields:headers];
+  
+  // the body points straight into the record, the deallocator keeps the (mapped) record alive
+  NSData *body = [[NSData alloc] initWithBytesNoCopy:(void*) (bytes + bodyOffset)
+                                              length:length - bodyOffset
+                                         deallocator:^(void *deallocatedBytes, NSUInteger deallocatedLength) {
+                                           
+                                           (void) recordData;
+                                         }];
+  
+  // the expiry was computed when the response was received, only the header fields are parsed again
+  NSDate *expiryDate = (flags & kMKCachedResponseHasExpiryFlag) ? [NSDate dateWithTimeIntervalSince1970:expiry] : nil;
+  MKCacheMetadata *metadata = [[MKCacheMetadata alloc] initWithHeaderFields:headers expiryDate:expiryDate];
+  
+  return [self initWithResponse:response data:body metadata:metadata];
+}
+
+-(NSData*) cacheRecordData {
+  
+  NSMutableData *headerBlock = [NSMutableData data];
+  MKCachedResponseAppendString(headerBlock, self.response.URL.absoluteString ? self.response.URL.absoluteString : @"");
+  
+  NSDictionary *headers = self.response.allHeaderFields;
+  MKCachedResponseAppendUInt32(headerBlock, (uint32_t) headers.count);
+  [headers enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSString *value, BOOL *stop) {
+    
+    MKCachedResponseAppendString(headerBlock, name);
+    MKCachedResponseAppendString(headerBlock, [NSString stringWithFormat:@"%@", value]);
+  }];
+  
+  NSMutableData *recordData = [NSMutableData dataWithCapacity:kMKCachedResponsePreambleLength + headerBlock.length + self.data.length];
+  [recordData appendBytes:kMKCachedResponseMagic length:sizeof(kMKCachedResponseMagic)];
+  
+  NSDate *expiryDate = self.metadata.expiryDate;
+  uint16_t version = OSSwapHostToLittleInt16(kMKCachedResponseVersion);
+  uint16_t flags = OSSwapHostToLittleInt16(expiryDate ? kMKCachedResponseHasExpiryFlag : 0);
+  uint64_t expiry = OSSwapHostToLittleInt64((uint64_t) (int64_t) expiryDate.timeIntervalSince1970);
+  [recordData appendBytes:&version length:sizeof(version)];
+  [recordData appendBytes:&flags length:sizeof(flags)];
+  MKCachedResponseAppendUInt32(recordData, (uint32_t) self.response.statusCode);
+  MKCachedResponseAppendUInt32(recordData, (uint32_t) headerBlock.length);
+  [recordData appendBytes:&expiry length:sizeof(expiry)];
+  [recordData appendData:headerBlock];
+  [recordData appendData:self.data];
+  
+  return recordData;
+}
+
+-(NSUInteger) cacheRecordCost {
+  
+  __block NSUInteger cost = kMKCachedResponsePreambleLength + self.response.URL.absoluteString.length + self.data.length;
+  [self.response.allHeaderFields enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSString *value, BOOL *stop) {
+    
+    cost += name.length + value.length;
+  }];
+  
+  return cost;
+}
+
+// Responses that can be revalidated stay on disk until they are the least recently used ones
+// Others are kept for as long as stale-while-revalidate or stale-if-error allows serving them
+-(NSDate*) cacheRecordExpiryDate {
+  
+  MKCacheMetadata *metadata = self.metadata;
+  if(metadata.hasValidators) return nil;
+  
+  NSInteger staleDuration = MAX(metadata.staleWhileRevalidate, metadata.staleIfError);
+  if(staleDuration > 0) return [metadata.expiryDate dateByAddingTimeInterval:staleDuration];
+  return metadata.expiryDate;
+}
+
+#pragma mark -
+#pragma mark NSCoding
+
+-(void) encodeWithCoder:(NSCoder*) coder {
+  
+  [coder encodeObject:[self cacheRecordData] forKey:@"record"];
+}
+
+-(instancetype) initWithCoder:(NSCoder*) coder {
+  
+  return [self initWithCacheRecordData:[coder decodeObjectForKey:@"record"]];
+}
+
+@end
@@ -39,6 +39,11 @@
 -(void) networkHost:(MKNetworkHost*) networkHost didCreateEphemeralSessionConfiguration:(NSURLSessionConfiguration*) configuration;
 -(void) networkHost:(MKNetworkHost*) networkHost didCreateBackgroundSessionConfiguration:(NSURLSessionConfiguration*) configuration;
 
+// Called once per request, on its completionQueue after its completion handlers, or on the cancelling thread
+-(void) networkHost:(MKNetworkHost*) networkHost
+   didFinishRequest:(MKNetworkRequest*) request
+        withMetrics:(MKNetworkRequestMetrics*) metrics;
+
 @end
 @interface MKNetworkHost : NSObject
 
@@ -55,7 +60,12 @@
 - (id) initWithHostName:(NSString*) hostName;
 
 -(void) enableCache;
+// inMemoryCost is a number of cached responses, inMemoryByteBudget a number of bytes (0 for the default of 10 MB)
 -(void) enableCacheWithDirectory:(NSString*) cacheDirectoryPath inMemoryCost:(NSUInteger) inMemoryCost;
+-(void) enableCacheWithDirectory:(NSString*) cacheDirectoryPath inMemoryByteBudget:(NSUInteger) inMemoryByteBudget;
+-(void) enableCacheWithDirectory:(NSString*) cacheDirectoryPath
+              inMemoryByteBudget:(NSUInteger) inMemoryByteBudget
+                    diskCapacity:(unsigned long long) diskCapacity;
 
 @property NSString *hostName;
 @property NSString *path;
@@ -63,9 +73,36 @@
 @property NSDictionary *defaultHeaders;
 @property BOOL secureHost;
 @property MKNKParameterEncoding defaultParameterEncoding;
+@property MKNKBodyCompression defaultBodyCompression; // see -[MKNetworkRequest bodyCompression]
+
+// Requests started with startRequest: beyond this limit wait in a queue ordered by priority and deadline
+// Also used as the sessions' HTTPMaximumConnectionsPerHost. 0 for no limit, defaults to 6
+// The sessions read it once, when the host creates them for its first request. Later changes only resize the queue
+@property NSUInteger maximumConcurrentRequests;
+
+// Idempotent requests (GET, HEAD, PUT, DELETE and OPTIONS) are retried on transient network errors and retryable status codes
+// Waits between attempts grow exponentially from retryBaseDelay, with full jitter, and honour Retry-After
+@property NSUInteger maximumAttempts; // defaults to 1, no retries
+@property NSTimeInterval retryBaseDelay; // defaults to 0.5 seconds
+@property NSIndexSet *retryableStatusCodes; // defaults to 408, 429, 500, 502, 503 and 504
+
+// Hedged GET requests are sent again when they take longer than the 95th percentile of recent GET latencies
+// This delay is used until the host has seen enough requests. Defaults to 1 second
+@property NSTimeInterval defaultHedgingDelay;
+
+// Session callbacks, status handling, response decoding and cache writes run on this queue
+// Defaults to a serial background queue. Change it before starting the first request
+@property NSOperationQueue *callbackQueue;
 
 @property (weak) id <MKNetworkHostDelegate> delegate;
+
+// Counters and latency histograms of the requests this host has finished so far
+-(MKNetworkHostMetrics*) metricsSnapshot;
+-(void) resetMetrics;
 @property (copy) void (^backgroundSessionCompletionHandler)(void);
+// Identifies the host's own background session, the bundle identifier followed by the host name
+// Match it against the identifier passed to application:handleEventsForBackgroundURLSession:completionHandler:
+@property (readonly) NSString *backgroundSessionIdentifier;
 
 // You can override this method to tweak request creation
 // But ensure that you call super
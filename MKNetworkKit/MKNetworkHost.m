@@ -27,15 +27,27 @@
 
 #import "MKCache.h"
 
+#import "MKCachedResponse.h"
+
+#import "MKSegmentedDownload.h"
+
 #import "NSDate+RFC1123.h"
 
+#import "NSDictionary+MKNKAdditions.h"
 #import "NSMutableDictionary+MKNKAdditions.h"
 
 #import "NSHTTPURLResponse+MKNKAdditions.h"
 
 NSUInteger const kMKNKDefaultCacheDuration = 600; // 10 minutes
 NSUInteger const kMKNKDefaultImageCacheDuration = 3600*24*7; // 7 days
+NSUInteger const kMKNKDefaultMaximumConcurrentRequests = 6;
+NSTimeInterval const kMKNKDefaultRetryBaseDelay = 0.5;
+NSTimeInterval const kMKNKMaximumRetryDelay = 30;
+NSTimeInterval const kMKNKDefaultHedgingDelay = 1;
+NSUInteger const kMKNKLatencySampleCount = 64;
+NSUInteger const kMKNKMinimumLatencySampleCount = 20;
 NSString *const kMKCacheDefaultDirectoryName = @"com.mknetworkkit.mkcache";
+NSString *const kMKNKResumeDataExtension = @"mknkresume";
 
 @interface MKNetworkRequest (/*Private Methods*/)
 @property (readwrite) NSHTTPURLResponse *response;
@@ -43,86 +55,158 @@ NSString *const kMKCacheDefaultDirectoryName = @"com.mknetworkkit.mkcache";
 @property (readwrite) NSError *error;
 @property (readwrite) MKNKRequestState state;
 @property (readwrite) NSURLSessionTask *task;
+@property (copy) void (^cancellationHandler)(MKNetworkRequest *cancelledRequest);
+@property (copy) void (^metricsHandler)(MKNetworkRequest *finishedRequest);
+@property NSString *uploadBodyFilePath;
+@property NSUInteger attemptCount;
+@property NSDate *attemptStartDate;
+@property MKCachedResponse *cachedRecord;
+-(MKNetworkRequest*) revalidationRequest;
+-(NSURLRequest*) urlRequest;
 -(void) setProgressValue:(CGFloat) updatedValue;
+-(NSURLRequest*) writeUploadBodyToFile:(NSString*) filePath error:(NSError**) error;
+-(BOOL) needsBodyCompression;
+-(NSURLRequest*) compressedCopyOfRequest:(NSURLRequest*) request;
+-(void) setCompressedRequest:(NSURLRequest*) compressedRequest ofRequest:(NSURLRequest*) builtRequest;
+-(NSURLRequest*) requestToSend;
+-(BOOL) beginStreamingResponse:(NSHTTPURLResponse*) response;
+-(BOOL) appendResponseChunk:(NSData*) chunk;
+-(NSData*) finishStreamingResponse:(NSError**) error;
+-(void) decodeResponse;
+-(void) adoptDecodedResponseOfRequest:(MKNetworkRequest*) decodedRequest;
+-(BOOL) performAfterPendingCompletionHandlers:(dispatch_block_t) block;
+@property id decodedResponseJSON;
+@end
+
+@interface MKNetworkRequestMetrics (/*Private Methods*/)
+@property (readwrite) MKNKCacheOutcome cacheOutcome;
+-(void) recordStart;
+-(void) recordCacheLookupStartedAt:(NSTimeInterval) lookupStartTime;
+-(void) recordAttempt;
+-(void) recordPreemption;
+-(void) recordHedge;
+-(void) recordTaskMetrics:(NSURLSessionTaskMetrics*) taskMetrics ofTask:(NSURLSessionTask*) task;
 @end
 
-@interface MKNetworkHost (/*Private Methods*/) <NSURLSessionDelegate>
+@interface MKNetworkHostMetrics (/*Private Methods*/)
+-(void) addRequestMetrics:(MKNetworkRequestMetrics*) requestMetrics;
+-(void) reset;
+@end
+
+@interface MKNetworkHost (/*Private Methods*/) <NSURLSessionDataDelegate>
 
 @property (readonly) NSURLSession *defaultSession;
 @property (readonly) NSURLSession *ephemeralSession;
 @property (readonly) NSURLSession *backgroundSession;
 
-@property MKCache *dataCache;
 @property MKCache *responseCache;
 
 @property dispatch_queue_t runningTasksSynchronizingQueue;
-@property NSMutableArray *activeTasks;
+@property NSMapTable *activeTasks; // session -> (taskIdentifier -> request)
+@property NSMutableDictionary *inflightRequests;
+
+// scheduler state, guarded by runningTasksSynchronizingQueue
+@property NSMutableArray *queuedRequests; // sorted, next request first
+@property NSMutableArray *runningRequests;
+@property NSHashTable *preemptedRequests;
+@property NSMapTable *hedgeTasks; // request -> second copy of its task
+@property NSMutableArray *latencySamples; // recent GET latencies, oldest first
+@property dispatch_source_t deadlineTimer; // fires at the earliest deadline in queuedRequests
+@property NSDate *deadlineTimerFireDate; // nil while the timer is idle
+
+@property MKNetworkHostMetrics *collectedMetrics;
 @end
 
-@implementation MKNetworkHost
+@implementation MKNetworkHost {
+  
+  NSURLSession *_defaultSession;
+  NSURLSession *_ephemeralSession;
+  NSURLSession *_backgroundSession;
+}
+
+// Only background sessions have an identifier, checking it doesn't create the host's background session
+-(BOOL) isBackgroundSession:(NSURLSession*) session {
+  
+  return session.configuration.identifier != nil;
+}
+
+-(NSString*) backgroundSessionIdentifier {
+  
+  return [NSString stringWithFormat:@"%@.mknetworkkit.%@", [[NSBundle mainBundle] bundleIdentifier],
+          self.hostName ? self.hostName : @"default"];
+}
 
+// Each host has its own background session, so that the tasks of a host are reported to that host
 -(NSURLSession*) backgroundSession {
   
-  static dispatch_once_t onceToken;
-  static NSURLSessionConfiguration *backgroundSessionConfiguration;
-  static NSURLSession *backgroundSession;
-  dispatch_once(&onceToken, ^{
-    backgroundSessionConfiguration =
-    [NSURLSessionConfiguration backgroundSessionConfigurationWithIdentifier:
-     [[NSBundle mainBundle] bundleIdentifier]];
+  @synchronized(self) {
     
-    if([self.delegate respondsToSelector:@selector(networkHost:didCreateBackgroundSessionConfiguration:)]) {
-      [self.delegate networkHost:self didCreateBackgroundSessionConfiguration:backgroundSessionConfiguration];
+    if(!_backgroundSession) {
+      
+      NSURLSessionConfiguration *backgroundSessionConfiguration =
+      [NSURLSessionConfiguration backgroundSessionConfigurationWithIdentifier:[self backgroundSessionIdentifier]];
+      
+      if([self.delegate respondsToSelector:@selector(networkHost:didCreateBackgroundSessionConfiguration:)]) {
+        [self.delegate networkHost:self didCreateBackgroundSessionConfiguration:backgroundSessionConfiguration];
+      }
+      
+      _backgroundSession = [NSURLSession sessionWithConfiguration:backgroundSessionConfiguration
+                                                         delegate:self
+                                                    delegateQueue:[[NSOperationQueue alloc] init]];
     }
     
-    backgroundSession = [NSURLSession sessionWithConfiguration:backgroundSessionConfiguration
-                                                           delegate:self
-                                                      delegateQueue:[[NSOperationQueue alloc] init]];
-  });
-  
-  return backgroundSession;
+    return _backgroundSession;
+  }
 }
 
+// Default and ephemeral sessions belong to the host, so their configuration and connection limits are per host
+// They are created outside runningTasksSynchronizingQueue (see -runQueuedRequests), creating one calls out to the delegate
 -(NSURLSession*) defaultSession {
   
-  static dispatch_once_t onceToken;
-  static NSURLSessionConfiguration *defaultSessionConfiguration;
-  static NSURLSession *defaultSession;
-  dispatch_once(&onceToken, ^{
+  @synchronized(self) {
     
-    defaultSessionConfiguration = [NSURLSessionConfiguration defaultSessionConfiguration];
-
-    if([self.delegate respondsToSelector:@selector(networkHost:didCreateDefaultSessionConfiguration:)]) {
-      [self.delegate networkHost:self didCreateDefaultSessionConfiguration:defaultSessionConfiguration];
+    if(!_defaultSession) {
+      
+      NSURLSessionConfiguration *defaultSessionConfiguration = [NSURLSessionConfiguration defaultSessionConfiguration];
+      if(self.maximumConcurrentRequests) {
+        defaultSessionConfiguration.HTTPMaximumConnectionsPerHost = self.maximumConcurrentRequests;
+      }
+      
+      if([self.delegate respondsToSelector:@selector(networkHost:didCreateDefaultSessionConfiguration:)]) {
+        [self.delegate networkHost:self didCreateDefaultSessionConfiguration:defaultSessionConfiguration];
+      }
+      
+      _defaultSession = [NSURLSession sessionWithConfiguration:defaultSessionConfiguration
+                                                      delegate:self
+                                                 delegateQueue:self.callbackQueue];
     }
     
-    defaultSession = [NSURLSession sessionWithConfiguration:defaultSessionConfiguration
-                                                      delegate:self
-                                                 delegateQueue:[NSOperationQueue mainQueue]];
-  });
-  
-  return defaultSession;
+    return _defaultSession;
+  }
 }
 
 -(NSURLSession*) ephemeralSession {
   
-  static dispatch_once_t onceToken;
-  static NSURLSessionConfiguration *ephemeralSessionConfiguration;
-  static NSURLSession *ephemeralSession;
-  dispatch_once(&onceToken, ^{
+  @synchronized(self) {
     
-    ephemeralSessionConfiguration = [NSURLSessionConfiguration ephemeralSessionConfiguration];
-
-    if([self.delegate respondsToSelector:@selector(networkHost:didCreateEphemeralSessionConfiguration:)]) {
-      [self.delegate networkHost:self didCreateEphemeralSessionConfiguration:ephemeralSessionConfiguration];
+    if(!_ephemeralSession) {
+      
+      NSURLSessionConfiguration *ephemeralSessionConfiguration = [NSURLSessionConfiguration ephemeralSessionConfiguration];
+      if(self.maximumConcurrentRequests) {
+        ephemeralSessionConfiguration.HTTPMaximumConnectionsPerHost = self.maximumConcurrentRequests;
+      }
+      
+      if([self.delegate respondsToSelector:@selector(networkHost:didCreateEphemeralSessionConfiguration:)]) {
+        [self.delegate networkHost:self didCreateEphemeralSessionConfiguration:ephemeralSessionConfiguration];
+      }
+      
+      _ephemeralSession = [NSURLSession sessionWithConfiguration:ephemeralSessionConfiguration
+                                                        delegate:self
+                                                   delegateQueue:self.callbackQueue];
     }
     
-    ephemeralSession = [NSURLSession sessionWithConfiguration:ephemeralSessionConfiguration
-                                                   delegate:self
-                                              delegateQueue:[NSOperationQueue mainQueue]];
-  });
-  
-  return ephemeralSession;
+    return _ephemeralSession;
+  }
 }
 
 -(instancetype) init {
@@ -130,8 +214,36 @@ NSString *const kMKCacheDefaultDirectoryName = @"com.mknetworkkit.mkcache";
   if((self = [super init])) {
     
     self.runningTasksSynchronizingQueue = dispatch_queue_create("com.mknetworkkit.cachequeue", DISPATCH_QUEUE_SERIAL);
+    
+    // serial, so that a task's delegate callbacks are never reordered
+    self.callbackQueue = [[NSOperationQueue alloc] init];
+    self.callbackQueue.maxConcurrentOperationCount = 1;
+    self.callbackQueue.name = @"com.mknetworkkit.callbackqueue";
+    
+    self.maximumConcurrentRequests = kMKNKDefaultMaximumConcurrentRequests;
+    
+    self.maximumAttempts = 1;
+    self.retryBaseDelay = kMKNKDefaultRetryBaseDelay;
+    NSMutableIndexSet *retryableStatusCodes = [NSMutableIndexSet indexSet];
+    [retryableStatusCodes addIndex:408];
+    [retryableStatusCodes addIndex:429];
+    [retryableStatusCodes addIndexesInRange:NSMakeRange(502, 3)];
+    [retryableStatusCodes addIndex:500];
+    self.retryableStatusCodes = retryableStatusCodes;
+    self.defaultHedgingDelay = kMKNKDefaultHedgingDelay;
+    
+    self.collectedMetrics = [[MKNetworkHostMetrics alloc] init];
+    
     dispatch_async(self.runningTasksSynchronizingQueue, ^{
-      self.activeTasks = [NSMutableArray array];
+      self.activeTasks = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                                               valueOptions:NSPointerFunctionsStrongMemory];
+      self.inflightRequests = [NSMutableDictionary dictionary];
+      self.queuedRequests = [NSMutableArray array];
+      self.runningRequests = [NSMutableArray array];
+      self.preemptedRequests = [NSHashTable hashTableWithOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality];
+      self.hedgeTasks = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                                              valueOptions:NSPointerFunctionsStrongMemory];
+      self.latencySamples = [NSMutableArray arrayWithCapacity:kMKNKLatencySampleCount];
     });
   }
   
@@ -147,33 +259,94 @@ NSString *const kMKCacheDefaultDirectoryName = @"com.mknetworkkit.mkcache";
 
 -(void) enableCache {
   
-  [self enableCacheWithDirectory:kMKCacheDefaultDirectoryName inMemoryCost:0];
+  [self enableCacheWithDirectory:kMKCacheDefaultDirectoryName inMemoryByteBudget:0];
 }
 
 -(void) enableCacheWithDirectory:(NSString*) cacheDirectoryPath inMemoryCost:(NSUInteger) inMemoryCost {
   
-  self.dataCache = [[MKCache alloc] initWithCacheDirectory:[NSString stringWithFormat:@"%@/data", cacheDirectoryPath]
-                                              inMemoryCost:inMemoryCost];
-  
-  self.responseCache = [[MKCache alloc] initWithCacheDirectory:[NSString stringWithFormat:@"%@/responses", cacheDirectoryPath]
+  // response and body are stored together as one MKCachedResponse record per request
+  self.responseCache = [[MKCache alloc] initWithCacheDirectory:[NSString stringWithFormat:@"%@/records", cacheDirectoryPath]
                                                   inMemoryCost:inMemoryCost];
+  self.responseCache.recordClass = [MKCachedResponse class];
+}
+
+-(void) enableCacheWithDirectory:(NSString*) cacheDirectoryPath inMemoryByteBudget:(NSUInteger) inMemoryByteBudget {
+  
+  [self enableCacheWithDirectory:cacheDirectoryPath inMemoryByteBudget:inMemoryByteBudget diskCapacity:0];
+}
+
+-(void) enableCacheWithDirectory:(NSString*) cacheDirectoryPath
+              inMemoryByteBudget:(NSUInteger) inMemoryByteBudget
+                    diskCapacity:(unsigned long long) diskCapacity {
+  
+  self.responseCache = [[MKCache alloc] initWithCacheDirectory:[NSString stringWithFormat:@"%@/records", cacheDirectoryPath]
+                                            inMemoryByteBudget:inMemoryByteBudget];
+  self.responseCache.recordClass = [MKCachedResponse class];
+  if(diskCapacity) self.responseCache.diskCapacity = diskCapacity;
 }
 
 -(void) startUploadRequest:(MKNetworkRequest*) request {
   
-  if(!request || !request.request) {
+  if(!request || !request.urlRequest) {
     
-    NSAssert((request && request.request),
+    NSAssert((request && request.urlRequest),
              @"Request is nil, check your URL and other parameters you use to build your request");
     return;
   }
   
-  request.task = [self.backgroundSession uploadTaskWithRequest:request.request
-                                                      fromData:request.multipartFormData];
-  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
-    [self.activeTasks addObject:request];
-  });
+  [self collectMetricsOfRequest:request];
+  
+  // The body is streamed into a temporary file instead of being built in memory
+  // Background sessions upload from files anyway. The file is removed when the task completes
+  NSString *bodyFilePath = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                            [NSString stringWithFormat:@"%@.mknkupload", [NSUUID UUID].UUIDString]];
+  
+  // the request is started before its body is written, so that it can be cancelled in the meantime
+  // the task doesn't exist until then, cancelling it is a no-op
+  request.cancellationHandler = ^(MKNetworkRequest *cancelledRequest) {
+    [cancelledRequest.task cancel];
+  };
   request.state = MKNKRequestStateStarted;
+  
+  dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+    
+    NSError *error = nil;
+    NSURLRequest *uploadRequest = [request writeUploadBodyToFile:bodyFilePath error:&error];
+    if(!uploadRequest) {
+      
+      NSLog(@"Failed to write upload body to [%@] with error %@", bodyFilePath, error);
+      [[NSFileManager defaultManager] removeItemAtPath:bodyFilePath error:nil];
+      [self.callbackQueue addOperationWithBlock:^{
+        
+        if(request.state == MKNKRequestStateCancelled) return;
+        request.error = error;
+        request.state = MKNKRequestStateError;
+      }];
+      return;
+    }
+    
+    if(request.state == MKNKRequestStateCancelled) {
+      
+      [[NSFileManager defaultManager] removeItemAtPath:bodyFilePath error:nil];
+      return;
+    }
+    
+    request.uploadBodyFilePath = bodyFilePath;
+    NSURLSessionTask *task = [self.backgroundSession uploadTaskWithRequest:uploadRequest
+                                                                  fromFile:[NSURL fileURLWithPath:bodyFilePath]];
+    [self registerRequest:request forTask:task inSession:self.backgroundSession];
+    request.task = task;
+    
+    // a cancel that raced with creating the task either sees it or is seen here
+    if(request.state == MKNKRequestStateCancelled) {
+      
+      [task cancel];
+      return;
+    }
+    
+    [request.metrics recordAttempt];
+    [task resume];
+  });
 }
 
 -(void) startDownloadRequest:(MKNetworkRequest*) request {
@@ -191,62 +364,485 @@ NSString *const kMKCacheDefaultDirectoryName = @"com.mknetworkkit.mkcache";
     NSLog(@"application:handleEventsForBackgroundURLSession:completionHandler: is not implemented in your application delegate. Download tasks might not work properly. Implement the method and set the completionHandler value to MKNetworkHost's backgroundSessionCompletionHandler");
   }
   
-  if(!request || !request.request) {
+  if(!request || !request.urlRequest) {
     
     NSLog(@"Request is nil, check your URL and other parameters you use to build your request");
     return;
   }
   
-  request.task = [self.backgroundSession downloadTaskWithRequest:request.request];
-  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
-    [self.activeTasks addObject:request];
-  });
-  request.state = MKNKRequestStateStarted;
+  [self collectMetricsOfRequest:request];
+  
+  if(request.downloadSegmentCount > 1) {
+    
+    MKSegmentedDownload *segmentedDownload = [[MKSegmentedDownload alloc] initWithRequest:request
+                                                                                  session:self.defaultSession
+                                                                             segmentCount:request.downloadSegmentCount];
+    segmentedDownload.rangesUnsupportedHandler = ^(MKNetworkRequest *unsupportedRequest) {
+      
+      unsupportedRequest.task = [self backgroundDownloadTaskForRequest:unsupportedRequest];
+      [unsupportedRequest.task resume];
+    };
+    // the download is kept alive by its tasks' completion handlers, the request shouldn't keep it beyond that
+    __weak MKSegmentedDownload *weakSegmentedDownload = segmentedDownload;
+    request.cancellationHandler = ^(MKNetworkRequest *cancelledRequest) {
+      [weakSegmentedDownload cancel];
+    };
+    
+    // started before the probe goes out, a download that fails right away must not be marked as started after it failed
+    request.state = MKNKRequestStateStarted;
+    [request.metrics recordAttempt];
+    [segmentedDownload start];
+  } else {
+    
+    // setting the state resumes the task
+    request.task = [self backgroundDownloadTaskForRequest:request];
+    request.state = MKNKRequestStateStarted;
+    [request.metrics recordAttempt];
+  }
+}
+
+// A download that failed or was cancelled earlier continues from the resume data saved next to its downloadPath
+// NSURLSession resumes with Range and If-Range, so a file that changed on the server is downloaded again from the start
+-(NSURLSessionDownloadTask*) backgroundDownloadTaskForRequest:(MKNetworkRequest*) request {
+  
+  NSString *resumeDataPath = [self resumeDataPathForRequest:request];
+  NSData *resumeData = resumeDataPath ? [NSData dataWithContentsOfFile:resumeDataPath] : nil;
+  
+  NSURLSessionDownloadTask *task = resumeData ? [self.backgroundSession downloadTaskWithResumeData:resumeData] :
+  [self.backgroundSession downloadTaskWithRequest:request.urlRequest];
+  [self registerRequest:request forTask:task inSession:self.backgroundSession];
+  
+  request.cancellationHandler = ^(MKNetworkRequest *cancelledRequest) {
+    
+    [task cancelByProducingResumeData:^(NSData *producedResumeData) {
+      if(producedResumeData && resumeDataPath) [producedResumeData writeToFile:resumeDataPath atomically:YES];
+    }];
+  };
+  
+  return task;
+}
+
+-(NSString*) resumeDataPathForRequest:(MKNetworkRequest*) request {
+  
+  return [request.downloadPath stringByAppendingPathExtension:kMKNKResumeDataExtension];
 }
 
 -(void) startRequest:(MKNetworkRequest*) request {
   
-  if(!request || !request.request) {
+  if(!request || !request.urlRequest) {
     
     NSLog(@"Request is nil, check your URL and other parameters you use to build your request");
     return;
   }
   
-  if(request.cacheable && !request.doNotCache) {
+  [self collectMetricsOfRequest:request];
+  
+  // Requests with a body are never served from the cache, they are scheduled once the body is compressed
+  // The compressed copy is built off the callback queue and handed to the request on it, the request isn't shared meanwhile
+  if([request needsBodyCompression]) {
+    
+    NSURLRequest *builtRequest = request.urlRequest;
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+      
+      NSURLRequest *compressedRequest = [request compressedCopyOfRequest:builtRequest];
+      [self.callbackQueue addOperationWithBlock:^{
+        
+        if(compressedRequest) [request setCompressedRequest:compressedRequest ofRequest:builtRequest];
+        [self startRequest:request withCachedResponse:nil];
+      }];
+    });
+    return;
+  }
+  
+  if(request.cacheable && !request.doNotCache && self.responseCache) {
     
-    NSHTTPURLResponse *cachedResponse = self.responseCache[@(request.hash)];
-    NSDate *cacheExpiryDate = cachedResponse.cacheExpiryDate;
+    // memory hits continue right away, disk lookups run on the cache queue and continue on the callback queue
+    request.metrics.cacheOutcome = MKNKCacheOutcomeMiss;
+    NSTimeInterval lookupStartTime = [NSProcessInfo processInfo].systemUptime;
+    [self.responseCache objectForKey:request.cacheKey completionHandler:^(MKCachedResponse *cachedRecord) {
+      
+      [request.metrics recordCacheLookupStartedAt:lookupStartTime];
+      
+      if([NSThread isMainThread]) {
+        
+        [self startRequest:request withCachedResponse:cachedRecord];
+      } else {
+        
+        [self.callbackQueue addOperationWithBlock:^{
+          [self startRequest:request withCachedResponse:cachedRecord];
+        }];
+      }
+    }];
+    return;
+  }
+  
+  [self startRequest:request withCachedResponse:nil];
+}
+
+-(void) startRequest:(MKNetworkRequest*) request withCachedResponse:(MKCachedResponse*) cachedRecord {
+  
+  if(cachedRecord) {
+    
+    NSHTTPURLResponse *cachedResponse = cachedRecord.response;
+    MKCacheMetadata *metadata = cachedRecord.metadata;
+    
+    if(!request.ignoreCache) {
+      
+      if(metadata.lastModified) [request addHeaders:@{@"IF-MODIFIED-SINCE" : metadata.lastModified}];
+      if(metadata.eTag) [request addHeaders:@{@"IF-NONE-MATCH" : metadata.eTag}];
+    }
+    
+    NSDate *cacheExpiryDate = metadata.expiryDate;
     NSTimeInterval expiryTimeFromNow = [cacheExpiryDate timeIntervalSinceNow];
     
     if(cachedResponse.isContentTypeImage && !cacheExpiryDate) {
       
       expiryTimeFromNow =
-      cachedResponse.hasRequiredRevalidationHeaders ? kMKNKDefaultCacheDuration : kMKNKDefaultImageCacheDuration;
+      metadata.hasValidators ? kMKNKDefaultCacheDuration : kMKNKDefaultImageCacheDuration;
     }
     
-    if(cachedResponse.hasDoNotCacheDirective || !cachedResponse.hasHTTPCacheHeaders) {
+    if(metadata.hasDoNotCacheDirective || !metadata.hasHTTPCacheHeaders) {
       
       expiryTimeFromNow = kMKNKDefaultCacheDuration;
     }
     
-    NSData *cachedData = self.dataCache[@(request.hash)];
+    request.responseData = cachedRecord.data;
+    request.response = cachedResponse;
     
-    if(cachedData) {
-      request.responseData = cachedData;
-      request.response = cachedResponse;
+    if(expiryTimeFromNow > 0 && !request.alwaysLoad) {
       
-      if(expiryTimeFromNow > 0 && !request.alwaysLoad) {
-        
-        request.state = MKNKRequestStateResponseAvailableFromCache;
-        return; // don't make another request
-      } else {
-        
-        request.state = expiryTimeFromNow > 0 ? MKNKRequestStateResponseAvailableFromCache :
-        MKNKRequestStateStaleResponseAvailableFromCache;
+      request.metrics.cacheOutcome = MKNKCacheOutcomeFreshHit;
+      request.state = MKNKRequestStateResponseAvailableFromCache;
+      return; // don't make another request
+    }
+    
+    // within stale-while-revalidate the stale response is final and the entry is refreshed off the critical path
+    if(expiryTimeFromNow <= 0 && !request.alwaysLoad && !metadata.mustRevalidate &&
+       -expiryTimeFromNow < metadata.staleWhileRevalidate) {
+      
+      request.metrics.cacheOutcome = MKNKCacheOutcomeStaleWhileRevalidate;
+      request.state = MKNKRequestStateStaleResponseAvailableFromCache;
+      [self revalidateCachedRecord:cachedRecord ofRequest:request];
+      return;
+    }
+    
+    // refreshed when the server answers 304, served again when the reload fails within stale-if-error
+    request.cachedRecord = cachedRecord;
+    request.metrics.cacheOutcome = MKNKCacheOutcomeStaleHit;
+    request.state = expiryTimeFromNow > 0 ? MKNKRequestStateResponseAvailableFromCache :
+    MKNKRequestStateStaleResponseAvailableFromCache;
+  }
+  
+  [self scheduleRequest:request];
+}
+
+// Revalidations of the same entry share one task, like any other GET with the same cache key
+-(void) revalidateCachedRecord:(MKCachedResponse*) cachedRecord ofRequest:(MKNetworkRequest*) request {
+  
+  MKNetworkRequest *revalidationRequest = [request revalidationRequest];
+  NSString *requestKey = [self coalescingKeyForRequest:revalidationRequest];
+  __block BOOL revalidating = NO;
+  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
+    revalidating = requestKey && self.inflightRequests[requestKey] != nil;
+  });
+  
+  if(revalidating) return;
+  
+  revalidationRequest.cachedRecord = cachedRecord;
+  [self scheduleRequest:revalidationRequest];
+}
+
+-(void) scheduleRequest:(MKNetworkRequest*) request {
+  
+  // GET and HEAD requests with the same cache key are identical (see -[MKNetworkRequest cacheKey])
+  // Such requests are attached to the task that is already running (or queued) instead of creating a new one
+  NSString *requestKey = [self coalescingKeyForRequest:request];
+  
+  // queued requests get their task when the scheduler runs them, cancelling them just takes them off the queue
+  request.cancellationHandler = ^(MKNetworkRequest *cancelledRequest) {
+    
+    [self cancelScheduledRequest:cancelledRequest forKey:requestKey];
+  };
+  
+  __block BOOL attached = NO;
+  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
+    
+    NSMutableArray *coalescedRequests = requestKey ? self.inflightRequests[requestKey] : nil;
+    
+    if(coalescedRequests) {
+      
+      request.task = [coalescedRequests.firstObject task];
+      [coalescedRequests addObject:request];
+      attached = YES;
+      
+      // followers of a request that is still queued time out on their own deadline
+      if(request.deadline && [self.queuedRequests containsObject:coalescedRequests.firstObject]) {
+        [self armDeadlineTimerForDate:request.deadline];
+      }
+    } else {
+      
+      if(requestKey) {
+        self.inflightRequests[requestKey] = [NSMutableArray arrayWithObject:request];
       }
+      
+      [self enqueueRequest:request];
+    }
+  });
+  
+  request.state = MKNKRequestStateStarted;
+  if(!attached) [self runQueuedRequests];
+}
+
+// Streamed responses have their own sinks and are never shared
+// Only requests that use the cache the same way and send the same validators share a response
+// A 304 answers the validators that were sent, a request that sent none has no cached body to complete with
+-(NSString*) coalescingKeyForRequest:(MKNetworkRequest*) request {
+  
+  NSString *requestMethod = request.httpMethod.uppercaseString;
+  if(request.streamsResponse) return nil;
+  if(!([requestMethod isEqualToString:@"GET"] || [requestMethod isEqualToString:@"HEAD"])) return nil;
+  
+  NSString *cacheKey = request.cacheKey;
+  if(!cacheKey) return nil;
+  
+  NSURLRequest *urlRequest = request.urlRequest;
+  NSString *eTag = [urlRequest valueForHTTPHeaderField:@"If-None-Match"];
+  NSString *lastModified = [urlRequest valueForHTTPHeaderField:@"If-Modified-Since"];
+  return [NSString stringWithFormat:@"%@|%d%d|%@|%@", cacheKey, request.doNotCache, request.ignoreCache,
+          eTag ? eTag : @"", lastModified ? lastModified : @""];
+}
+
+#pragma mark -
+#pragma mark Request scheduling
+
+// Higher priority first, then the earliest deadline, then first come first served
+static NSComparisonResult MKNKCompareRequestsForScheduling(MKNetworkRequest *request1, MKNetworkRequest *request2) {
+  
+  if(request1.priority != request2.priority) {
+    return request1.priority > request2.priority ? NSOrderedAscending : NSOrderedDescending;
+  }
+  
+  if(request1.deadline && request2.deadline) return [request1.deadline compare:request2.deadline];
+  if(request1.deadline) return NSOrderedAscending;
+  if(request2.deadline) return NSOrderedDescending;
+  return NSOrderedSame;
+}
+
+// Must be called on runningTasksSynchronizingQueue
+-(void) enqueueRequest:(MKNetworkRequest*) request {
+  
+  NSUInteger index = [self.queuedRequests indexOfObject:request
+                                          inSortedRange:NSMakeRange(0, self.queuedRequests.count)
+                                                options:NSBinarySearchingInsertionIndex | NSBinarySearchingLastEqual
+                                        usingComparator:^NSComparisonResult(MKNetworkRequest *request1, MKNetworkRequest *request2) {
+                                          
+                                          return MKNKCompareRequestsForScheduling(request1, request2);
+                                        }];
+  [self.queuedRequests insertObject:request atIndex:index];
+  
+  if(request.deadline) [self armDeadlineTimerForDate:request.deadline];
+}
+
+// Must be called on runningTasksSynchronizingQueue
+// Queued requests time out at their deadline even when nothing else runs the queue
+-(void) armDeadlineTimerForDate:(NSDate*) fireDate {
+  
+  if(self.deadlineTimerFireDate && [self.deadlineTimerFireDate compare:fireDate] != NSOrderedDescending) return;
+  
+  if(!self.deadlineTimer) {
+    
+    __weak MKNetworkHost *weakSelf = self;
+    self.deadlineTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, self.runningTasksSynchronizingQueue);
+    dispatch_source_set_event_handler(self.deadlineTimer, ^{
+      [weakSelf expireQueuedRequests];
+    });
+    dispatch_resume(self.deadlineTimer);
+  }
+  
+  self.deadlineTimerFireDate = fireDate;
+  int64_t delay = (int64_t) (MAX(fireDate.timeIntervalSinceNow, 0) * NSEC_PER_SEC);
+  dispatch_source_set_timer(self.deadlineTimer, dispatch_time(DISPATCH_TIME_NOW, delay), DISPATCH_TIME_FOREVER, NSEC_PER_SEC / 100);
+}
+
+static BOOL MKNKIsPastDeadline(MKNetworkRequest *request) {
+  
+  return request.deadline && request.deadline.timeIntervalSinceNow <= 0;
+}
+
+// Must be called on runningTasksSynchronizingQueue
+// Removes the queued requests past their own deadline, and those coalesced onto a queued request
+// When a queued request expires, the first of its followers still within their deadline is queued in its place
+-(NSArray*) dequeueExpiredRequests {
+  
+  NSMutableArray *expiredRequests = [NSMutableArray array];
+  
+  for(MKNetworkRequest *queuedRequest in [self.queuedRequests copy]) {
+    
+    NSString *requestKey = [self coalescingKeyForRequest:queuedRequest];
+    NSMutableArray *coalescedRequests = requestKey ? self.inflightRequests[requestKey] : nil;
+    if(coalescedRequests.firstObject != queuedRequest) coalescedRequests = nil;
+    
+    NSArray *requests = coalescedRequests ? coalescedRequests : @[queuedRequest];
+    NSIndexSet *expiredIndexes = [requests indexesOfObjectsPassingTest:^BOOL(MKNetworkRequest *request, NSUInteger idx, BOOL *stop) {
+      return MKNKIsPastDeadline(request);
+    }];
+    if(expiredIndexes.count == 0) continue;
+    
+    [expiredRequests addObjectsFromArray:[requests objectsAtIndexes:expiredIndexes]];
+    [coalescedRequests removeObjectsAtIndexes:expiredIndexes];
+    
+    if(![expiredIndexes containsIndex:0]) continue;
+    
+    [self.queuedRequests removeObject:queuedRequest];
+    if(coalescedRequests.count > 0) {
+      [self enqueueRequest:coalescedRequests.firstObject];
+    } else if(requestKey) {
+      [self.inflightRequests removeObjectForKey:requestKey];
+    }
+  }
+  
+  return expiredRequests;
+}
+
+// Runs on runningTasksSynchronizingQueue, from deadlineTimer
+-(void) expireQueuedRequests {
+  
+  NSArray *expiredRequests = [self dequeueExpiredRequests];
+  
+  self.deadlineTimerFireDate = nil;
+  dispatch_source_set_timer(self.deadlineTimer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+  for(MKNetworkRequest *queuedRequest in self.queuedRequests) {
+    
+    NSString *requestKey = [self coalescingKeyForRequest:queuedRequest];
+    NSArray *coalescedRequests = requestKey ? self.inflightRequests[requestKey] : nil;
+    for(MKNetworkRequest *request in (coalescedRequests.firstObject == queuedRequest ? coalescedRequests : @[queuedRequest])) {
+      if(request.deadline) [self armDeadlineTimerForDate:request.deadline];
     }
   }
   
+  if(expiredRequests.count == 0) return;
+  
+  [self.callbackQueue addOperationWithBlock:^{
+    [self completeExpiredRequests:expiredRequests];
+  }];
+}
+
+-(void) completeExpiredRequests:(NSArray*) expiredRequests {
+  
+  NSError *timeoutError = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:nil];
+  [expiredRequests enumerateObjectsUsingBlock:^(MKNetworkRequest *expiredRequest, NSUInteger idx, BOOL *stop) {
+    
+    [self completeRequest:expiredRequest withData:nil response:nil error:timeoutError cacheResponse:NO];
+  }];
+}
+
+// Must be called on runningTasksSynchronizingQueue
+// Cancels running prefetches while more interactive requests are waiting than there are free slots
+-(void) preemptLowPriorityRequestsIfNeeded {
+  
+  if(self.maximumConcurrentRequests == 0) return;
+  
+  NSUInteger waitingRequests = [self.queuedRequests indexOfObjectPassingTest:^BOOL(MKNetworkRequest *queuedRequest, NSUInteger idx, BOOL *stop) {
+    
+    return queuedRequest.priority <= MKNKRequestPriorityLow;
+  }];
+  if(waitingRequests == NSNotFound) waitingRequests = self.queuedRequests.count;
+  
+  NSUInteger runningRequests = self.runningRequests.count;
+  NSUInteger freeSlots = runningRequests < self.maximumConcurrentRequests ? self.maximumConcurrentRequests - runningRequests : 0;
+  
+  while(waitingRequests > freeSlots) {
+    
+    // the most recently started prefetch has made the least progress
+    NSUInteger victimIndex = [self.runningRequests indexOfObjectWithOptions:NSEnumerationReverse
+                                                                passingTest:^BOOL(MKNetworkRequest *runningRequest, NSUInteger idx, BOOL *stop) {
+                                                                  
+                                                                  return runningRequest.priority <= MKNKRequestPriorityLow &&
+                                                                  !runningRequest.streamsResponse;
+                                                                }];
+    if(victimIndex == NSNotFound) break;
+    
+    MKNetworkRequest *victim = self.runningRequests[victimIndex];
+    [self.runningRequests removeObjectAtIndex:victimIndex];
+    [self.preemptedRequests addObject:victim];
+    [[self.hedgeTasks objectForKey:victim] cancel];
+    [self.hedgeTasks removeObjectForKey:victim];
+    [victim.task cancel]; // requeued when its task reports the cancellation
+    freeSlots ++;
+  }
+}
+
+-(void) runQueuedRequests {
+  
+  // the tasks are created on the queue, the sessions they belong to are created before entering it
+  (void) self.defaultSession;
+  (void) self.ephemeralSession;
+  
+  NSMutableArray *tasksToResume = [NSMutableArray array];
+  __block NSArray *expiredRequests = nil;
+  
+  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
+    
+    expiredRequests = [self dequeueExpiredRequests];
+    [self preemptLowPriorityRequestsIfNeeded];
+    
+    while(self.queuedRequests.count > 0 &&
+          (self.maximumConcurrentRequests == 0 || self.runningRequests.count < self.maximumConcurrentRequests)) {
+      
+      MKNetworkRequest *request = self.queuedRequests.firstObject;
+      [self.queuedRequests removeObjectAtIndex:0];
+      
+      NSString *requestKey = [self coalescingKeyForRequest:request];
+      [self.runningRequests addObject:request];
+      [tasksToResume addObject:[self createTaskForScheduledRequest:request coalescingKey:requestKey]];
+    }
+  });
+  
+  [tasksToResume makeObjectsPerformSelector:@selector(resume)];
+  [self completeExpiredRequests:expiredRequests];
+}
+
+// Must be called on runningTasksSynchronizingQueue
+-(NSURLSessionTask*) createTaskForScheduledRequest:(NSURLSession*) session
+                                           request:(MKNetworkRequest*) request
+                                     coalescingKey:(NSString*) requestKey {
+  
+  NSURLRequest *urlRequest = request.requestToSend;
+  
+  if(request.streamsResponse) {
+    
+    // without a completion handler, the session hands the body to the data delegate as it arrives
+    return [session dataTaskWithRequest:urlRequest];
+  }
+  
+  // hedges and retries of the same request have their own tasks, the identifier tells which one completed
+  __block NSUInteger taskIdentifier = 0;
+  NSURLSessionTask *task = [session
+                            dataTaskWithRequest:urlRequest
+                            completionHandler:^(NSData *data, NSURLResponse *response, NSError *error) {
+                              
+                              [self scheduledRequest:request
+                                       coalescingKey:requestKey
+                                   didCompleteTaskWithIdentifier:taskIdentifier
+                                           inSession:session
+                                                data:data
+                                            response:response
+                                               error:error];
+                            }];
+  taskIdentifier = task.taskIdentifier;
+  
+  if(request.priority > MKNKRequestPriorityNormal) {
+    task.priority = NSURLSessionTaskPriorityHigh;
+  } else if(request.priority < MKNKRequestPriorityNormal) {
+    task.priority = NSURLSessionTaskPriorityLow;
+  }
+  
+  return task;
+}
+
+// Must be called on runningTasksSynchronizingQueue
+-(NSURLSessionTask*) createTaskForScheduledRequest:(MKNetworkRequest*) request coalescingKey:(NSString*) requestKey {
+  
   NSURLSession *sessionToUse = self.defaultSession;
   
   if(request.isSSL || request.requiresAuthentication) {
@@ -254,85 +850,527 @@ NSString *const kMKCacheDefaultDirectoryName = @"com.mknetworkkit.mkcache";
     sessionToUse = self.ephemeralSession;
   }
   
-  NSURLSessionDataTask *task = [sessionToUse
-                                dataTaskWithRequest:request.request
-                                completionHandler:^(NSData *data, NSURLResponse *response, NSError *error) {
-                                  
-                                  if(request.state == MKNKRequestStateCancelled) {
-                                    
-                                    request.response = (NSHTTPURLResponse*) response;
-                                    if(error) {
-                                      request.error = error;
-                                    }
-                                    if(data) {
-                                      request.responseData = data;
-                                    }
-                                    return;
-                                  }
-                                  if(!response) {
-                                    
-                                    request.response = (NSHTTPURLResponse*) response;
-                                    request.error = error;
-                                    request.responseData = data;
-                                    request.state = MKNKRequestStateError;
-                                    return;
-                                  }
-                                  
-                                  request.response = (NSHTTPURLResponse*) response;
-                                  
-                                  if(request.response.statusCode >= 200 && request.response.statusCode < 300) {
-                                    
-                                    request.responseData = data;
-                                    request.error = error;
-                                  } else if(request.response.statusCode == 304) {
-                                    
-                                    // don't do anything
-                                    
-                                  } else if(request.response.statusCode >= 400) {
-                                    request.responseData = data;
-                                    NSMutableDictionary *userInfo = [NSMutableDictionary dictionary];
-                                    if(response) userInfo[@"response"] = response;
-                                    if(error) userInfo[@"error"] = error;
-                                    
-                                    NSError *httpError = [NSError errorWithDomain:@"com.mknetworkkit.httperrordomain"
-                                                                             code:request.response.statusCode
-                                                                         userInfo:userInfo];
-                                    request.error = httpError;
-                                    
-                                    // if subclass of host overrides errorForRequest: they can provide more insightful error objects by parsing the response body.
-                                    // the super class implementation just returns the same error object set in previous line
-                                    request.error = [self errorForCompletedRequest:request];
-                                  }
-                                  
-                                  if(!request.error) {
-                                    
-                                    if(request.cacheable) {
-                                      self.dataCache[@(request.hash)] = data;
-                                      self.responseCache[@(request.hash)] = response;
-                                    }
-                                    
-                                    dispatch_sync(self.runningTasksSynchronizingQueue, ^{
-                                      [self.activeTasks removeObject:request];
-                                    });
-                                    
-                                    request.state = MKNKRequestStateCompleted;
-                                  } else {
-                                    
-                                    dispatch_sync(self.runningTasksSynchronizingQueue, ^{
-                                      [self.activeTasks removeObject:request];
-                                    });
-                                    request.state = MKNKRequestStateError;
-                                    NSLog(@"%@", request);
-                                  }
-                                }];
-  
-  request.task = task;
+  request.task = [self createTaskForScheduledRequest:sessionToUse request:request coalescingKey:requestKey];
+  request.attemptCount ++;
+  request.attemptStartDate = [NSDate date];
+  [request.metrics recordAttempt];
+  
+  // requests that were attached while this one was queued share its task
+  [self.inflightRequests[requestKey] enumerateObjectsUsingBlock:^(MKNetworkRequest *coalescedRequest, NSUInteger idx, BOOL *stop) {
+    
+    coalescedRequest.task = request.task;
+  }];
+  
+  [self requestsInSession:sessionToUse][@(request.task.taskIdentifier)] = request;
+  
+  if(request.hedged && !request.streamsResponse && [request.httpMethod.uppercaseString isEqualToString:@"GET"]) {
+    [self scheduleHedgeForRequest:request inSession:sessionToUse coalescingKey:requestKey];
+  }
+  
+  return request.task;
+}
+
+-(void) scheduledRequest:(MKNetworkRequest*) request
+           coalescingKey:(NSString*) requestKey
+didCompleteTaskWithIdentifier:(NSUInteger) taskIdentifier
+               inSession:(NSURLSession*) session
+                    data:(NSData*) data
+                response:(NSURLResponse*) response
+                   error:(NSError*) error {
+  
+  __block NSArray *completedRequests = nil;
+  __block NSURLSessionTask *losingTask = nil;
+  __block NSTimeInterval retryDelay = -1;
   
   dispatch_sync(self.runningTasksSynchronizingQueue, ^{
-    [self.activeTasks addObject:request];
+    
+    [[self requestsInSession:session] removeObjectForKey:@(taskIdentifier)];
+    
+    NSURLSessionTask *hedgeTask = [self.hedgeTasks objectForKey:request];
+    BOOL isHedge = hedgeTask.taskIdentifier == taskIdentifier && hedgeTask;
+    if(!isHedge && request.task.taskIdentifier != taskIdentifier) return; // the loser of a hedge, already cancelled
+    
+    if(hedgeTask) {
+      
+      NSURLSessionTask *otherTask = isHedge ? request.task : hedgeTask;
+      BOOL failed = error || [(NSHTTPURLResponse*) response statusCode] >= 500;
+      if(failed && otherTask.state == NSURLSessionTaskStateRunning) {
+        
+        // the other copy may still succeed, wait for it
+        if(isHedge) {
+          [self.hedgeTasks removeObjectForKey:request];
+        } else {
+          request.task = hedgeTask;
+          [self.hedgeTasks removeObjectForKey:request];
+          [self.inflightRequests[requestKey] enumerateObjectsUsingBlock:^(MKNetworkRequest *coalescedRequest, NSUInteger idx, BOOL *stop) {
+            coalescedRequest.task = hedgeTask;
+          }];
+        }
+        return;
+      }
+      
+      losingTask = otherTask;
+      [self.hedgeTasks removeObjectForKey:request];
+      
+      if(isHedge) {
+        
+        request.task = hedgeTask;
+        [self.inflightRequests[requestKey] enumerateObjectsUsingBlock:^(MKNetworkRequest *coalescedRequest, NSUInteger idx, BOOL *stop) {
+          coalescedRequest.task = hedgeTask;
+        }];
+      }
+      [[self requestsInSession:session] removeObjectForKey:@(otherTask.taskIdentifier)];
+    }
+    
+    [self.runningRequests removeObjectIdenticalTo:request];
+    
+    if([self.preemptedRequests containsObject:request]) {
+      
+      [self.preemptedRequests removeObject:request];
+      if([error.domain isEqualToString:NSURLErrorDomain] && error.code == NSURLErrorCancelled &&
+         [self isScheduledRequestWanted:request coalescingKey:requestKey]) {
+        
+        // preempting doesn't use up one of the request's attempts
+        request.attemptCount --;
+        [request.metrics recordPreemption];
+        [self enqueueRequest:request];
+        return;
+      }
+    }
+    
+    if(!error && [(NSHTTPURLResponse*) response statusCode] < 400) {
+      [self recordLatency:-[request.attemptStartDate timeIntervalSinceNow] forRequest:request];
+    }
+    
+    retryDelay = [self retryDelayForRequest:request response:response error:error];
+    if(retryDelay >= 0) return; // the coalesced requests keep waiting for the retry
+    
+    NSMutableArray *requestsForKey = requestKey ? self.inflightRequests[requestKey] : nil;
+    if(requestsForKey.firstObject == request) {
+      
+      completedRequests = requestsForKey;
+      [self.inflightRequests removeObjectForKey:requestKey];
+    } else {
+      
+      completedRequests = @[request];
+    }
   });
   
-  request.state = MKNKRequestStateStarted;
+  [losingTask cancel];
+  
+  if(retryDelay >= 0) {
+    
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t) (retryDelay * NSEC_PER_SEC)),
+                   dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                     
+                     __block BOOL requeued = NO;
+                     dispatch_sync(self.runningTasksSynchronizingQueue, ^{
+                       
+                       if([self isScheduledRequestWanted:request coalescingKey:requestKey]) {
+                         
+                         [self enqueueRequest:request];
+                         requeued = YES;
+                       }
+                     });
+                     
+                     if(requeued) [self runQueuedRequests];
+                   });
+  }
+  
+  // the response is cached and decoded once, by the first request that gets that far
+  __block BOOL responseCached = NO;
+  __block MKNetworkRequest *decodedRequest = nil;
+  [completedRequests enumerateObjectsUsingBlock:^(MKNetworkRequest *completedRequest, NSUInteger idx, BOOL *stop) {
+    
+    if(decodedRequest) [completedRequest adoptDecodedResponseOfRequest:decodedRequest];
+    [self completeRequest:completedRequest
+                 withData:data
+                 response:response
+                    error:error
+            cacheResponse:!responseCached];
+    
+    if(completedRequest.state == MKNKRequestStateCompleted && completedRequest.cacheable) {
+      responseCached = YES;
+    }
+    if(!decodedRequest && completedRequest.decodedResponseJSON) decodedRequest = completedRequest;
+  }];
+  
+  [self runQueuedRequests];
+}
+
+// Must be called on runningTasksSynchronizingQueue
+// A request waiting to be requeued is still wanted unless it (and everything coalesced with it) was cancelled
+-(BOOL) isScheduledRequestWanted:(MKNetworkRequest*) request coalescingKey:(NSString*) requestKey {
+  
+  if(requestKey) return [self.inflightRequests[requestKey] firstObject] == request;
+  return request.state != MKNKRequestStateCancelled;
+}
+
+#pragma mark -
+#pragma mark Retries
+
+// RFC 7231 section 4.2.2, repeating these requests has the same effect as sending them once
+static BOOL MKNKIsIdempotentMethod(NSString *httpMethod) {
+  
+  return [@[@"GET", @"HEAD", @"PUT", @"DELETE", @"OPTIONS"] containsObject:httpMethod.uppercaseString];
+}
+
+// Retry-After is either a number of seconds or an HTTP date (RFC 7231 section 7.1.3)
+static NSTimeInterval MKNKRetryAfterDelay(NSString *retryAfter) {
+  
+  NSString *value = [retryAfter stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+  if(value.length == 0) return 0;
+  
+  if([value rangeOfCharacterFromSet:[NSCharacterSet decimalDigitCharacterSet].invertedSet].location == NSNotFound) {
+    return value.integerValue;
+  }
+  
+  NSDate *retryDate = [NSDate dateFromRFC1123:value];
+  return retryDate ? retryDate.timeIntervalSinceNow : 0;
+}
+
+static BOOL MKNKIsTransientError(NSError *error) {
+  
+  if(![error.domain isEqualToString:NSURLErrorDomain]) return NO;
+  
+  switch (error.code) {
+    case NSURLErrorTimedOut:
+    case NSURLErrorNetworkConnectionLost:
+    case NSURLErrorCannotConnectToHost:
+    case NSURLErrorCannotFindHost:
+    case NSURLErrorDNSLookupFailed:
+    case NSURLErrorNotConnectedToInternet:
+      return YES;
+    default:
+      return NO;
+  }
+}
+
+// Must be called on runningTasksSynchronizingQueue
+// Returns a negative delay when the request shouldn't be retried
+-(NSTimeInterval) retryDelayForRequest:(MKNetworkRequest*) request response:(NSURLResponse*) response error:(NSError*) error {
+  
+  if(request.state == MKNKRequestStateCancelled) return -1;
+  
+  if(!MKNKIsIdempotentMethod(request.httpMethod)) return -1;
+  
+  NSUInteger maximumAttempts = request.maximumAttempts ? request.maximumAttempts : self.maximumAttempts;
+  if(request.attemptCount >= maximumAttempts) return -1;
+  
+  NSHTTPURLResponse *httpResponse = (NSHTTPURLResponse*) response;
+  BOOL retryable = error ? MKNKIsTransientError(error) : [self.retryableStatusCodes containsIndex:httpResponse.statusCode];
+  if(!retryable) return -1;
+  
+  // exponential backoff with full jitter, so that clients that failed together don't retry together
+  NSTimeInterval backoff = MIN(kMKNKMaximumRetryDelay, self.retryBaseDelay * pow(2, request.attemptCount - 1));
+  NSTimeInterval delay = backoff * arc4random_uniform(1001) / 1000.0;
+  
+  NSTimeInterval retryAfterDelay = MKNKRetryAfterDelay([httpResponse.allHeaderFields objectForCaseInsensitiveKey:@"Retry-After"]);
+  if(retryAfterDelay > 0) {
+    delay = MAX(delay, MIN(retryAfterDelay, kMKNKMaximumRetryDelay));
+  }
+  
+  return delay;
+}
+
+#pragma mark -
+#pragma mark Hedged requests
+
+// Must be called on runningTasksSynchronizingQueue
+-(void) recordLatency:(NSTimeInterval) latency forRequest:(MKNetworkRequest*) request {
+  
+  if(![request.httpMethod.uppercaseString isEqualToString:@"GET"]) return;
+  
+  if(self.latencySamples.count == kMKNKLatencySampleCount) [self.latencySamples removeObjectAtIndex:0];
+  [self.latencySamples addObject:@(latency)];
+}
+
+// Must be called on runningTasksSynchronizingQueue
+// The 95th percentile of recent GET latencies, or the default delay until there are enough samples
+-(NSTimeInterval) hedgingDelay {
+  
+  if(self.latencySamples.count < kMKNKMinimumLatencySampleCount) return self.defaultHedgingDelay;
+  
+  NSArray *sortedSamples = [self.latencySamples sortedArrayUsingSelector:@selector(compare:)];
+  NSUInteger index = (NSUInteger) ceil(sortedSamples.count * 0.95) - 1;
+  return [sortedSamples[index] doubleValue];
+}
+
+// Must be called on runningTasksSynchronizingQueue
+// Sends a second copy of a GET that is still running after the hedging delay, the first response wins
+-(void) scheduleHedgeForRequest:(MKNetworkRequest*) request inSession:(NSURLSession*) session coalescingKey:(NSString*) requestKey {
+  
+  NSURLSessionTask *originalTask = request.task;
+  NSTimeInterval delay = [self hedgingDelay];
+  
+  dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t) (delay * NSEC_PER_SEC)),
+                 dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+                   
+                   __block NSURLSessionTask *hedgeTask = nil;
+                   dispatch_sync(self.runningTasksSynchronizingQueue, ^{
+                     
+                     if(request.task != originalTask || originalTask.state != NSURLSessionTaskStateRunning) return;
+                     if([self.runningRequests indexOfObjectIdenticalTo:request] == NSNotFound) return;
+                     if([self.hedgeTasks objectForKey:request]) return;
+                     
+                     hedgeTask = [self createTaskForScheduledRequest:session request:request coalescingKey:requestKey];
+                     [self.hedgeTasks setObject:hedgeTask forKey:request];
+                     [request.metrics recordHedge];
+                     [self requestsInSession:session][@(hedgeTask.taskIdentifier)] = request;
+                   });
+                   
+                   [hedgeTask resume];
+                 });
+}
+
+// Must be called when a streamed request's task completes, frees its slot for the next queued request
+-(void) finishRunningRequest:(MKNetworkRequest*) request {
+  
+  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
+    [self.runningRequests removeObjectIdenticalTo:request];
+  });
+  
+  [self runQueuedRequests];
+}
+
+// Queued requests are taken off the queue, running tasks are cancelled
+// A shared task is cancelled only when every request attached to it has been cancelled
+-(void) cancelScheduledRequest:(MKNetworkRequest*) request forKey:(NSString*) requestKey {
+  
+  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
+    
+    MKNetworkRequest *scheduledRequest = request;
+    NSMutableArray *coalescedRequests = requestKey ? self.inflightRequests[requestKey] : nil;
+    
+    if([coalescedRequests indexOfObjectIdenticalTo:request] != NSNotFound) {
+      
+      NSUInteger liveRequestIndex =
+      [coalescedRequests indexOfObjectPassingTest:^BOOL(MKNetworkRequest *coalescedRequest, NSUInteger idx, BOOL *stop) {
+        
+        return coalescedRequest.state != MKNKRequestStateCancelled;
+      }];
+      
+      if(liveRequestIndex != NSNotFound) return;
+      
+      // nobody is waiting for this response anymore, new requests should start a fresh task
+      [self.inflightRequests removeObjectForKey:requestKey];
+      scheduledRequest = coalescedRequests.firstObject;
+    }
+    
+    NSUInteger queuedIndex = [self.queuedRequests indexOfObjectIdenticalTo:scheduledRequest];
+    if(queuedIndex != NSNotFound) {
+      [self.queuedRequests removeObjectAtIndex:queuedIndex];
+    } else {
+      [[self.hedgeTasks objectForKey:scheduledRequest] cancel];
+      [self.hedgeTasks removeObjectForKey:scheduledRequest];
+      [scheduledRequest.task cancel];
+    }
+  });
+}
+
+-(void) completeRequest:(MKNetworkRequest*) request
+               withData:(NSData*) data
+               response:(NSURLResponse*) response
+                  error:(NSError*) error
+          cacheResponse:(BOOL) cacheResponse {
+  
+  // handlers told about a cached response keep reading it, the network response is applied once they have returned
+  if([request performAfterPendingCompletionHandlers:^{
+    [self.callbackQueue addOperationWithBlock:^{
+      [self completeRequest:request withData:data response:response error:error cacheResponse:cacheResponse];
+    }];
+  }]) return;
+  
+  // freshness is measured from now, before anything reads the response's cache metadata
+  if([response isKindOfClass:[NSHTTPURLResponse class]]) {
+    [(NSHTTPURLResponse*) response cacheMetadataReceivedAt:[NSDate date]];
+  }
+  
+  if(request.state == MKNKRequestStateCancelled) {
+    
+    request.response = (NSHTTPURLResponse*) response;
+    if(error) {
+      request.error = error;
+    }
+    if(data) {
+      request.responseData = data;
+    }
+    return;
+  }
+  
+  MKCachedResponse *cachedRecord = request.cachedRecord;
+  if(cachedRecord && (!response || [(NSHTTPURLResponse*) response statusCode] >= 500)) {
+    
+    // within stale-if-error, the cached response is served instead of the failure
+    MKCacheMetadata *metadata = cachedRecord.metadata;
+    if(metadata.staleIfError >= 0 && metadata.expiryDate &&
+       metadata.expiryDate.timeIntervalSinceNow + metadata.staleIfError > 0) {
+      
+      request.response = cachedRecord.response;
+      request.responseData = cachedRecord.data;
+      request.error = nil;
+      request.metrics.cacheOutcome = MKNKCacheOutcomeStaleIfError;
+      request.state = MKNKRequestStateCompleted;
+      return;
+    }
+  }
+  
+  if(!response) {
+    
+    request.response = (NSHTTPURLResponse*) response;
+    request.error = error;
+    request.responseData = data;
+    request.state = MKNKRequestStateError;
+    return;
+  }
+  
+  request.response = (NSHTTPURLResponse*) response;
+  
+  if(request.response.statusCode >= 200 && request.response.statusCode < 300) {
+    
+    request.responseData = data;
+    request.error = error;
+    [request decodeResponse];
+  } else if(request.response.statusCode == 304) {
+    
+    // the cached body is still valid, only the stored headers and expiry are refreshed
+    request.metrics.cacheOutcome = MKNKCacheOutcomeRevalidated;
+    if(cachedRecord) {
+      
+      MKCachedResponse *refreshedRecord = [cachedRecord cachedResponseUpdatedWithNotModifiedResponse:request.response];
+      request.response = refreshedRecord.response;
+      request.responseData = refreshedRecord.data;
+      
+      if(request.cacheable && cacheResponse) {
+        self.responseCache[request.cacheKey] = refreshedRecord;
+      }
+    }
+
+  } else if(request.response.statusCode >= 400) {
+    request.responseData = data;
+    [request decodeResponse];
+    NSMutableDictionary *userInfo = [NSMutableDictionary dictionary];
+    if(response) userInfo[@"response"] = response;
+    if(error) userInfo[@"error"] = error;
+    
+    NSError *httpError = [NSError errorWithDomain:@"com.mknetworkkit.httperrordomain"
+                                             code:request.response.statusCode
+                                         userInfo:userInfo];
+    request.error = httpError;
+    
+    // if subclass of host overrides errorForRequest: they can provide more insightful error objects by parsing the response body.
+    // the super class implementation just returns the same error object set in previous line
+    request.error = [self errorForCompletedRequest:request];
+  }
+  
+  if(!request.error) {
+    
+    if(request.cacheable && cacheResponse && request.response.statusCode < 300) {
+      
+      NSData *cachedBody = (request.streamsResponse && request.downloadPath) ? [self privateCopyOfDownloadedBody:request] : data;
+      if(cachedBody) {
+        self.responseCache[request.cacheKey] = [[MKCachedResponse alloc] initWithResponse:(NSHTTPURLResponse*) response
+                                                                                    data:cachedBody];
+      }
+    }
+    
+    request.state = MKNKRequestStateCompleted;
+  } else {
+    
+    request.state = MKNKRequestStateError;
+    NSLog(@"%@", request);
+  }
+}
+
+// Streamed downloads are mapped from the caller's file, which may be truncated or replaced at any time
+// The cache maps a copy in its own directory instead, unlinked right away so that only the mapping keeps it
+-(NSData*) privateCopyOfDownloadedBody:(MKNetworkRequest*) request {
+  
+  NSError *error = nil;
+  NSString *copyPath = [self.responseCache.directoryPath stringByAppendingPathComponent:
+                        [NSString stringWithFormat:@"%@.mknkbody", [NSUUID UUID].UUIDString]];
+  if(![[NSFileManager defaultManager] copyItemAtPath:request.downloadPath toPath:copyPath error:&error]) {
+    
+    NSLog(@"Failed to copy [%@] into the cache with error %@", request.downloadPath, error);
+    return nil;
+  }
+  
+  NSData *body = [NSData dataWithContentsOfFile:copyPath options:NSDataReadingMappedAlways error:nil];
+  [[NSFileManager defaultManager] removeItemAtPath:copyPath error:nil];
+  return body;
+}
+
+#pragma mark -
+#pragma mark Metrics
+
+-(void) collectMetricsOfRequest:(MKNetworkRequest*) request {
+  
+  [request.metrics recordStart];
+  request.metricsHandler = ^(MKNetworkRequest *finishedRequest) {
+    
+    [self.collectedMetrics addRequestMetrics:finishedRequest.metrics];
+    
+    if([self.delegate respondsToSelector:@selector(networkHost:didFinishRequest:withMetrics:)]) {
+      [self.delegate networkHost:self didFinishRequest:finishedRequest withMetrics:finishedRequest.metrics];
+    }
+  };
+}
+
+-(MKNetworkHostMetrics*) metricsSnapshot {
+  
+  return [self.collectedMetrics copy];
+}
+
+-(void) resetMetrics {
+  
+  [self.collectedMetrics reset];
+}
+
+#pragma mark -
+#pragma mark Active task registry
+
+// Must be called on runningTasksSynchronizingQueue
+-(NSMutableDictionary*) requestsInSession:(NSURLSession*) session {
+  
+  NSMutableDictionary *requests = [self.activeTasks objectForKey:session];
+  if(!requests) {
+    
+    requests = [NSMutableDictionary dictionary];
+    [self.activeTasks setObject:requests forKey:session];
+  }
+  
+  return requests;
+}
+
+-(void) registerRequest:(MKNetworkRequest*) request forTask:(NSURLSessionTask*) task inSession:(NSURLSession*) session {
+  
+  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
+    [self requestsInSession:session][@(task.taskIdentifier)] = request;
+  });
+}
+
+-(MKNetworkRequest*) requestForTask:(NSURLSessionTask*) task inSession:(NSURLSession*) session {
+  
+  __block MKNetworkRequest *matchingRequest = nil;
+  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
+    matchingRequest = [self requestsInSession:session][@(task.taskIdentifier)];
+  });
+  
+  return matchingRequest;
+}
+
+-(MKNetworkRequest*) unregisterTask:(NSURLSessionTask*) task inSession:(NSURLSession*) session {
+  
+  __block MKNetworkRequest *matchingRequest = nil;
+  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
+    
+    NSMutableDictionary *requests = [self requestsInSession:session];
+    NSNumber *taskIdentifier = @(task.taskIdentifier);
+    matchingRequest = requests[taskIdentifier];
+    [requests removeObjectForKey:taskIdentifier];
+  });
+  
+  return matchingRequest;
 }
 
 -(MKNetworkRequest*) requestWithURLString:(NSString*) urlString {
@@ -398,6 +1436,7 @@ NSString *const kMKCacheDefaultDirectoryName = @"com.mknetworkkit.mkcache";
                                                                httpMethod:httpMethod.uppercaseString];
   
   request.parameterEncoding = self.defaultParameterEncoding;
+  request.bodyCompression = self.defaultBodyCompression;
   [request addHeaders:self.defaultHeaders];
   [self prepareRequest:request];
   return request;
@@ -407,15 +1446,8 @@ NSString *const kMKCacheDefaultDirectoryName = @"com.mknetworkkit.mkcache";
 // But ensure that you call super
 -(void) prepareRequest: (MKNetworkRequest*) request {
   
-  if(!request.cacheable || request.ignoreCache) return;
-  
-  NSHTTPURLResponse *cachedResponse = self.responseCache[@(request.hash)];
-  
-  NSString *lastModified = [cachedResponse.allHeaderFields objectForCaseInsensitiveKey:@"Last-Modified"];
-  NSString *eTag = [cachedResponse.allHeaderFields objectForCaseInsensitiveKey:@"ETag"];
-  
-  if(lastModified) [request addHeaders:@{@"IF-MODIFIED-SINCE" : lastModified}];
-  if(eTag) [request addHeaders:@{@"IF-NONE-MATCH" : eTag}];
+  // Conditional GET headers (If-Modified-Since/If-None-Match) are added in startRequest:
+  // once the cached response has been looked up off the calling thread
 }
 
 -(NSError*) errorForCompletedRequest: (MKNetworkRequest*) completedRequest {
@@ -438,14 +1470,7 @@ didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
     completionHandler(NSURLSessionAuthChallengeUseCredential,credential);
   }
   
-  __block MKNetworkRequest *matchingRequest = nil;
-  [self.activeTasks enumerateObjectsUsingBlock:^(MKNetworkRequest *request, NSUInteger idx, BOOL *stop) {
-    
-    if([request.task isEqual:task]) {
-      matchingRequest = request;
-      *stop = YES;
-    }
-  }];
+  MKNetworkRequest *matchingRequest = [self requestForTask:task inSession:session];
   
   if([challenge.protectionSpace.authenticationMethod isEqualToString:NSURLAuthenticationMethodHTTPBasic] ||
      [challenge.protectionSpace.authenticationMethod isEqualToString:NSURLAuthenticationMethodHTTPDigest]){
@@ -465,32 +1490,91 @@ didReceiveChallenge:(NSURLAuthenticationChallenge *)challenge
   }
 }
 
+#pragma mark -
+#pragma mark NSURLSession (Streamed response) delegates
+
+- (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)dataTask
+didReceiveResponse:(NSURLResponse *)response
+ completionHandler:(void (^)(NSURLSessionResponseDisposition disposition))completionHandler {
+  
+  MKNetworkRequest *request = [self requestForTask:dataTask inSession:session];
+  if(request.streamsResponse && ![request beginStreamingResponse:(NSHTTPURLResponse*) response]) {
+    
+    completionHandler(NSURLSessionResponseCancel);
+    return;
+  }
+  
+  completionHandler(NSURLSessionResponseAllow);
+}
+
+- (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)dataTask
+    didReceiveData:(NSData *)data {
+  
+  MKNetworkRequest *request = [self requestForTask:dataTask inSession:session];
+  if(request.streamsResponse && ![request appendResponseChunk:data]) {
+    
+    NSLog(@"Failed to write streamed response to requested path [%@]", request.downloadPath);
+    [dataTask cancel];
+  }
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task
+didFinishCollectingMetrics:(NSURLSessionTaskMetrics *)metrics {
+  
+  // delivered before the task completes, while it is still registered
+  [[self requestForTask:task inSession:session].metrics recordTaskMetrics:metrics ofTask:task];
+}
+
 #pragma mark -
 #pragma mark NSURLSession (Download/Upload) Progress notification delegates
 
 - (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task
 didCompleteWithError:(NSError *)error {
   
-  __block MKNetworkRequest *matchingRequest = nil;
-  [self.activeTasks enumerateObjectsUsingBlock:^(MKNetworkRequest *request, NSUInteger idx, BOOL *stop) {
+  MKNetworkRequest *matchingRequest = [self unregisterTask:task inSession:session];
+  if(!matchingRequest) return;
+  
+  if(matchingRequest.uploadBodyFilePath) {
     
-    if([request.task isEqual:task]) {
-      
-      request.responseData = nil;
-      request.response = (NSHTTPURLResponse*) task.response;
-      request.error = error;
-      if(error) {
-        request.state = MKNKRequestStateError;
-      } else {
-        request.state = MKNKRequestStateCompleted;
-      }
-      *stop = YES;
+    [[NSFileManager defaultManager] removeItemAtPath:matchingRequest.uploadBodyFilePath error:nil];
+    matchingRequest.uploadBodyFilePath = nil;
+  }
+  
+  if([task isKindOfClass:[NSURLSessionDownloadTask class]] && [self isBackgroundSession:session]) {
+    
+    // failures keep their resume data, cancellations save theirs through cancelByProducingResumeData:
+    NSString *resumeDataPath = [self resumeDataPathForRequest:matchingRequest];
+    NSData *resumeData = error.userInfo[NSURLSessionDownloadTaskResumeData];
+    BOOL cancelled = [error.domain isEqualToString:NSURLErrorDomain] && error.code == NSURLErrorCancelled;
+    
+    if(resumeData && resumeDataPath) {
+      [resumeData writeToFile:resumeDataPath atomically:YES];
+    } else if(resumeDataPath && !cancelled) {
+      [[NSFileManager defaultManager] removeItemAtPath:resumeDataPath error:nil];
     }
-  }];
+  }
   
-  dispatch_sync(self.runningTasksSynchronizingQueue, ^{
-    [self.activeTasks removeObject:matchingRequest];
-  });
+  if(matchingRequest.streamsResponse && ![self isBackgroundSession:session]) {
+    
+    NSError *streamError = nil;
+    NSData *body = [matchingRequest finishStreamingResponse:&streamError];
+    [self completeRequest:matchingRequest
+                 withData:body
+                 response:task.response
+                    error:streamError ? streamError : error
+            cacheResponse:YES];
+    [self finishRunningRequest:matchingRequest];
+    return;
+  }
+  
+  matchingRequest.responseData = nil;
+  matchingRequest.response = (NSHTTPURLResponse*) task.response;
+  matchingRequest.error = error;
+  if(error) {
+    matchingRequest.state = MKNKRequestStateError;
+  } else {
+    matchingRequest.state = MKNKRequestStateCompleted;
+  }
 }
 
 - (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task
@@ -499,31 +1583,22 @@ didCompleteWithError:(NSError *)error {
 totalBytesExpectedToSend:(int64_t)totalBytesExpectedToSend {
   
   float progress = (float)(((float)totalBytesSent) / ((float)totalBytesExpectedToSend));
-  [self.activeTasks enumerateObjectsUsingBlock:^(MKNetworkRequest *request, NSUInteger idx, BOOL *stop) {
-    
-    if([request.task isEqual:task]) {
-      [request setProgressValue:progress];
-      *stop = YES;
-    }
-  }];
+  [[self requestForTask:task inSession:session] setProgressValue:progress];
 }
 
 - (void)URLSession:(NSURLSession *)session downloadTask:(NSURLSessionDownloadTask *)downloadTask
 didFinishDownloadingToURL:(NSURL *)location {
   
-  [self.activeTasks enumerateObjectsUsingBlock:^(MKNetworkRequest *request, NSUInteger idx, BOOL *stop) {
+  MKNetworkRequest *request = [self requestForTask:downloadTask inSession:session];
+  if(request) {
     
-    if([request.task.currentRequest.URL.absoluteString isEqualToString:downloadTask.currentRequest.URL.absoluteString]) {
+    NSError *error = nil;
+    [[NSFileManager defaultManager] removeItemAtPath:request.downloadPath error:nil];
+    if(![[NSFileManager defaultManager] moveItemAtPath:location.path toPath:request.downloadPath error:&error]) {
       
-      NSError *error = nil;
-      if(![[NSFileManager defaultManager] moveItemAtPath:location.path toPath:request.downloadPath error:&error]) {
-        
-        NSLog(@"Failed to save downloaded file at requested path [%@] with error %@", request.downloadPath, error);
-      }
-      
-      *stop = YES;
+      NSLog(@"Failed to save downloaded file at requested path [%@] with error %@", request.downloadPath, error);
     }
-  }];
+  }
   
   // call completion handler if the app was resumed and got connected again to our background session
   [self.backgroundSession getTasksWithCompletionHandler:^(NSArray *dataTasks, NSArray *uploadTasks, NSArray *downloadTasks) {
@@ -547,17 +1622,12 @@ didFinishDownloadingToURL:(NSURL *)location {
 totalBytesExpectedToWrite:(int64_t)totalBytesExpectedToWrite {
   
   float progress = (float)(((float)totalBytesWritten) / ((float)totalBytesExpectedToWrite));
-  [self.activeTasks enumerateObjectsUsingBlock:^(MKNetworkRequest *request, NSUInteger idx, BOOL *stop) {
-    
-    if([request.task.currentRequest.URL.absoluteString isEqualToString:downloadTask.currentRequest.URL.absoluteString]) {
-      [request setProgressValue:progress];
-    }
-  }];
+  [[self requestForTask:downloadTask inSession:session] setProgressValue:progress];
 }
 
 - (void)URLSession:(NSURLSession *)session didBecomeInvalidWithError:(NSError *)error {
   
-  if(session == self.backgroundSession) {
+  if([self isBackgroundSession:session]) {
     
     NSLog(@"Session became invalid with error: %@", error);
   }
@@ -0,0 +1,115 @@
+//
+//  MKNetworkMetrics.h
+//  MKNetworkKit
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+typedef enum {
+
+  MKNKCacheOutcomeNone = 0, // the cache wasn't consulted
+  MKNKCacheOutcomeMiss,
+  MKNKCacheOutcomeFreshHit, // served from the cache without touching the network
+  MKNKCacheOutcomeStaleHit, // served from the cache and reloaded, because it was stale or alwaysLoad is set
+  MKNKCacheOutcomeRevalidated, // reloaded and the server answered 304 Not Modified
+  MKNKCacheOutcomeStaleWhileRevalidate, // served stale without waiting, refreshed in the background
+  MKNKCacheOutcomeStaleIfError // the reload failed and the stale response was served instead
+} MKNKCacheOutcome;
+
+/*!
+ *  @abstract Timings, sizes and cache outcome of a single request
+ *
+ *  @discussion
+ *	Durations are in seconds and are -1 until they are known.
+ *  Connection timings and byte counts come from NSURLSessionTaskMetrics (iOS 10, OS X 10.12 and later).
+ *  Timings are those of the last attempt.
+ */
+@interface MKNetworkRequestMetrics : NSObject
+
+@property (readonly) NSTimeInterval cacheLookupDuration;
+@property (readonly) NSTimeInterval queueWaitDuration; // until the host sent the first attempt
+@property (readonly) NSTimeInterval domainLookupDuration;
+@property (readonly) NSTimeInterval connectDuration; // includes the TLS handshake
+@property (readonly) NSTimeInterval secureConnectionDuration;
+@property (readonly) NSTimeInterval timeToFirstByte; // from sending the request to the first byte of the response
+@property (readonly) NSTimeInterval transferDuration; // from the first to the last byte of the response
+@property (readonly) NSTimeInterval totalDuration; // from startRequest: to the response (or error) being available
+@property (readonly) NSTimeInterval completionDeliveryDuration; // until completion handlers started on the completionQueue
+@property (readonly) NSTimeInterval completionHandlerDuration; // time spent in completion handlers
+@property (readonly) BOOL reusedConnection;
+
+// body bytes of every attempt, including retries and hedges
+@property (readonly) int64_t countOfBytesSent;
+@property (readonly) int64_t countOfBytesReceived;
+
+@property (readonly) MKNKCacheOutcome cacheOutcome;
+@property (readonly) NSUInteger retryCount;
+@property (readonly) NSUInteger hedgeCount;
+
+// every MKNKRequestState the request went through, and when, in seconds since it was created
+@property (readonly) NSArray *states;
+@property (readonly) NSArray *stateTimestamps;
+
+// property list of the values above, keyed by property name, for logging or JSON export
+-(NSDictionary*) dictionaryRepresentation;
+
+@end
+
+/*!
+ *  @abstract Counters and latency histograms of the requests finished by a host
+ *
+ *  @discussion
+ *	A histogram has one count per bound in +latencyBucketBounds, followed by the count of slower requests.
+ */
+@interface MKNetworkHostMetrics : NSObject <NSCopying>
+
+// upper bounds of the histogram buckets, in seconds
++(NSArray*) latencyBucketBounds;
+
+@property (readonly) NSUInteger completedRequestCount; // including fresh cache hits
+@property (readonly) NSUInteger failedRequestCount;
+@property (readonly) NSUInteger cancelledRequestCount;
+@property (readonly) NSUInteger retryCount;
+@property (readonly) NSUInteger hedgeCount;
+
+@property (readonly) NSUInteger cacheMissCount;
+@property (readonly) NSUInteger freshCacheHitCount;
+@property (readonly) NSUInteger staleCacheHitCount; // including stale-while-revalidate
+@property (readonly) NSUInteger revalidatedCount;
+@property (readonly) NSUInteger staleIfErrorCount;
+
+@property (readonly) int64_t countOfBytesSent;
+@property (readonly) int64_t countOfBytesReceived;
+
+@property (readonly) NSArray *queueWaitHistogram;
+@property (readonly) NSArray *timeToFirstByteHistogram;
+@property (readonly) NSArray *totalDurationHistogram;
+@property (readonly) NSArray *completionDeliveryHistogram;
+
+// Upper bound of the bucket holding the given percentile (0.5 for p50, 0.99 for p99) of a histogram
+// -1 when the histogram is empty, DBL_MAX when it falls among the slower requests
++(NSTimeInterval) percentile:(double) percentile ofHistogram:(NSArray*) histogram;
+
+// property list of the counters, histograms and bucket bounds, keyed by property name, for tracking runs over time
+-(NSDictionary*) dictionaryRepresentation;
+
+@end
@@ -0,0 +1,517 @@
+//
+//  MKNetworkMetrics.m
+//  MKNetworkKit
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import "MKNetworkMetrics.h"
+
+#import "MKNetworkRequest.h"
+
+static NSTimeInterval const kMKNKLatencyBucketBounds[] = { 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+#define MKNK_LATENCY_BUCKET_COUNT (sizeof(kMKNKLatencyBucketBounds) / sizeof(kMKNKLatencyBucketBounds[0]) + 1)
+
+typedef struct {
+
+  NSUInteger counts[MKNK_LATENCY_BUCKET_COUNT];
+} MKNKLatencyHistogram;
+
+// monotonic, unaffected by changes to the wall clock
+static NSTimeInterval MKNKMetricsNow() {
+
+  return [NSProcessInfo processInfo].systemUptime;
+}
+
+static NSTimeInterval MKNKMetricsInterval(NSDate *startDate, NSDate *endDate) {
+
+  return startDate && endDate ? [endDate timeIntervalSinceDate:startDate] : -1;
+}
+
+@interface MKNetworkRequestMetrics (/*Private Methods*/)
+@property (readwrite) NSTimeInterval cacheLookupDuration;
+@property (readwrite) NSTimeInterval queueWaitDuration;
+@property (readwrite) NSTimeInterval domainLookupDuration;
+@property (readwrite) NSTimeInterval connectDuration;
+@property (readwrite) NSTimeInterval secureConnectionDuration;
+@property (readwrite) NSTimeInterval timeToFirstByte;
+@property (readwrite) NSTimeInterval transferDuration;
+@property (readwrite) NSTimeInterval totalDuration;
+@property (readwrite) NSTimeInterval completionDeliveryDuration;
+@property (readwrite) NSTimeInterval completionHandlerDuration;
+@property (readwrite) BOOL reusedConnection;
+@property (readwrite) int64_t countOfBytesSent;
+@property (readwrite) int64_t countOfBytesReceived;
+@property (readwrite) MKNKCacheOutcome cacheOutcome;
+@property (readwrite) NSUInteger retryCount;
+@property (readwrite) NSUInteger hedgeCount;
+
+@property NSMutableArray *recordedStates;
+@property NSMutableArray *recordedStateTimestamps;
+@property NSTimeInterval creationTime;
+@property NSTimeInterval startTime;
+@property NSTimeInterval lastStateTime;
+@property NSTimeInterval completionHandlersStartTime;
+@property NSUInteger attemptCount;
+@property BOOL finished;
+@end
+
+@implementation MKNetworkRequestMetrics
+
+-(instancetype) init {
+
+  if(self = [super init]) {
+
+    self.recordedStates = [NSMutableArray array];
+    self.recordedStateTimestamps = [NSMutableArray array];
+    self.creationTime = MKNKMetricsNow();
+    self.startTime = -1;
+
+    self.cacheLookupDuration = -1;
+    self.queueWaitDuration = -1;
+    self.domainLookupDuration = -1;
+    self.connectDuration = -1;
+    self.secureConnectionDuration = -1;
+    self.timeToFirstByte = -1;
+    self.transferDuration = -1;
+    self.totalDuration = -1;
+    self.completionDeliveryDuration = -1;
+    self.completionHandlerDuration = -1;
+  }
+
+  return self;
+}
+
+-(NSArray*) states {
+
+  @synchronized(self) {
+    return [self.recordedStates copy];
+  }
+}
+
+-(NSArray*) stateTimestamps {
+
+  @synchronized(self) {
+    return [self.recordedStateTimestamps copy];
+  }
+}
+
+-(void) recordStart {
+
+  NSTimeInterval now = MKNKMetricsNow();
+  @synchronized(self) {
+    if(self.startTime < 0) self.startTime = now;
+  }
+}
+
+// Every state after Started ends what the request was waiting for, the last one gives the total duration
+-(void) recordState:(MKNKRequestState) state {
+
+  NSTimeInterval now = MKNKMetricsNow();
+  @synchronized(self) {
+
+    [self.recordedStates addObject:@(state)];
+    [self.recordedStateTimestamps addObject:@(now - self.creationTime)];
+    self.lastStateTime = now;
+
+    if(state != MKNKRequestStateReady && state != MKNKRequestStateStarted && self.startTime >= 0) {
+      self.totalDuration = now - self.startTime;
+    }
+  }
+}
+
+-(void) recordCacheLookupStartedAt:(NSTimeInterval) lookupStartTime {
+
+  self.cacheLookupDuration = MKNKMetricsNow() - lookupStartTime;
+}
+
+-(void) recordAttempt {
+
+  NSTimeInterval now = MKNKMetricsNow();
+  @synchronized(self) {
+
+    self.attemptCount ++;
+    if(self.attemptCount == 1) {
+      self.queueWaitDuration = self.startTime >= 0 ? now - self.startTime : 0;
+    } else {
+      self.retryCount = self.attemptCount - 1;
+    }
+  }
+}
+
+// A preempted attempt is sent again once a slot frees up, that isn't a retry
+-(void) recordPreemption {
+
+  @synchronized(self) {
+
+    if(self.attemptCount > 0) self.attemptCount --;
+    self.retryCount = self.attemptCount > 1 ? self.attemptCount - 1 : 0;
+  }
+}
+
+-(void) recordHedge {
+
+  @synchronized(self) {
+    self.hedgeCount ++;
+  }
+}
+
+-(void) recordTaskMetrics:(NSURLSessionTaskMetrics*) taskMetrics ofTask:(NSURLSessionTask*) task {
+
+  // redirects add transactions, the last one fetched the response
+  NSURLSessionTaskTransactionMetrics *transaction = taskMetrics.transactionMetrics.lastObject;
+
+  @synchronized(self) {
+
+    self.countOfBytesSent += task.countOfBytesSent;
+    self.countOfBytesReceived += task.countOfBytesReceived;
+
+    if(!transaction) return;
+
+    self.domainLookupDuration = MKNKMetricsInterval(transaction.domainLookupStartDate, transaction.domainLookupEndDate);
+    self.connectDuration = MKNKMetricsInterval(transaction.connectStartDate, transaction.connectEndDate);
+    self.secureConnectionDuration = MKNKMetricsInterval(transaction.secureConnectionStartDate, transaction.secureConnectionEndDate);
+    self.timeToFirstByte = MKNKMetricsInterval(transaction.requestStartDate, transaction.responseStartDate);
+    self.transferDuration = MKNKMetricsInterval(transaction.responseStartDate, transaction.responseEndDate);
+    self.reusedConnection = transaction.reusedConnection;
+  }
+}
+
+-(void) recordCompletionHandlersStarted {
+
+  NSTimeInterval now = MKNKMetricsNow();
+  @synchronized(self) {
+
+    self.completionHandlersStartTime = now;
+    self.completionDeliveryDuration = now - self.lastStateTime;
+  }
+}
+
+-(void) recordCompletionHandlersFinished {
+
+  NSTimeInterval now = MKNKMetricsNow();
+  @synchronized(self) {
+    self.completionHandlerDuration = now - self.completionHandlersStartTime;
+  }
+}
+
+// Returns NO when the metrics were already finished, so that a request is reported only once
+-(BOOL) finish {
+
+  @synchronized(self) {
+
+    if(self.finished) return NO;
+    self.finished = YES;
+    return YES;
+  }
+}
+
+-(NSDictionary*) dictionaryRepresentation {
+
+  @synchronized(self) {
+
+    return @{@"cacheLookupDuration" : @(self.cacheLookupDuration),
+             @"queueWaitDuration" : @(self.queueWaitDuration),
+             @"domainLookupDuration" : @(self.domainLookupDuration),
+             @"connectDuration" : @(self.connectDuration),
+             @"secureConnectionDuration" : @(self.secureConnectionDuration),
+             @"timeToFirstByte" : @(self.timeToFirstByte),
+             @"transferDuration" : @(self.transferDuration),
+             @"totalDuration" : @(self.totalDuration),
+             @"completionDeliveryDuration" : @(self.completionDeliveryDuration),
+             @"completionHandlerDuration" : @(self.completionHandlerDuration),
+             @"reusedConnection" : @(self.reusedConnection),
+             @"countOfBytesSent" : @(self.countOfBytesSent),
+             @"countOfBytesReceived" : @(self.countOfBytesReceived),
+             @"cacheOutcome" : @(self.cacheOutcome),
+             @"retryCount" : @(self.retryCount),
+             @"hedgeCount" : @(self.hedgeCount),
+             @"states" : [self.recordedStates copy],
+             @"stateTimestamps" : [self.recordedStateTimestamps copy]};
+  }
+}
+
+-(NSString*) description {
+
+  NSString *cacheOutcomes[] = { @"none", @"miss", @"fresh hit", @"stale hit", @"revalidated",
+    @"stale while revalidate", @"stale if error" };
+
+  @synchronized(self) {
+
+    return [NSString stringWithFormat:@"<%@: %p> total %.3fs, cache %@ (lookup %.3fs), queue %.3fs, "
+            @"dns %.3fs, connect %.3fs, tls %.3fs, ttfb %.3fs, transfer %.3fs, delivery %.3fs, handlers %.3fs, "
+            @"%lld bytes sent, %lld bytes received, %lu retries, %lu hedges, states %@",
+            NSStringFromClass([self class]), self, self.totalDuration,
+            cacheOutcomes[self.cacheOutcome], self.cacheLookupDuration, self.queueWaitDuration,
+            self.domainLookupDuration, self.connectDuration, self.secureConnectionDuration,
+            self.timeToFirstByte, self.transferDuration, self.completionDeliveryDuration, self.completionHandlerDuration,
+            self.countOfBytesSent, self.countOfBytesReceived,
+            (unsigned long) self.retryCount, (unsigned long) self.hedgeCount,
+            [self.recordedStates componentsJoinedByString:@","]];
+  }
+}
+
+@end
+
+@interface MKNetworkHostMetrics (/*Private Methods*/)
+@property (readwrite) NSUInteger completedRequestCount;
+@property (readwrite) NSUInteger failedRequestCount;
+@property (readwrite) NSUInteger cancelledRequestCount;
+@property (readwrite) NSUInteger retryCount;
+@property (readwrite) NSUInteger hedgeCount;
+@property (readwrite) NSUInteger cacheMissCount;
+@property (readwrite) NSUInteger freshCacheHitCount;
+@property (readwrite) NSUInteger staleCacheHitCount;
+@property (readwrite) NSUInteger revalidatedCount;
+@property (readwrite) NSUInteger staleIfErrorCount;
+@property (readwrite) int64_t countOfBytesSent;
+@property (readwrite) int64_t countOfBytesReceived;
+@end
+
+@implementation MKNetworkHostMetrics {
+
+  MKNKLatencyHistogram _queueWaitHistogram;
+  MKNKLatencyHistogram _timeToFirstByteHistogram;
+  MKNKLatencyHistogram _totalDurationHistogram;
+  MKNKLatencyHistogram _completionDeliveryHistogram;
+}
+
++(NSArray*) latencyBucketBounds {
+
+  static NSArray *bounds;
+  static dispatch_once_t onceToken;
+  dispatch_once(&onceToken, ^{
+
+    NSMutableArray *boundValues = [NSMutableArray array];
+    for(NSUInteger index = 0; index < MKNK_LATENCY_BUCKET_COUNT - 1; index ++) {
+      [boundValues addObject:@(kMKNKLatencyBucketBounds[index])];
+    }
+    bounds = boundValues.copy;
+  });
+
+  return bounds;
+}
+
+// unknown durations (-1) aren't counted
+static void MKNKLatencyHistogramAdd(MKNKLatencyHistogram *histogram, NSTimeInterval duration) {
+
+  if(duration < 0) return;
+
+  NSUInteger bucket = 0;
+  while(bucket < MKNK_LATENCY_BUCKET_COUNT - 1 && duration > kMKNKLatencyBucketBounds[bucket]) bucket ++;
+  histogram->counts[bucket] ++;
+}
+
+static NSArray *MKNKLatencyHistogramArray(const MKNKLatencyHistogram *histogram) {
+
+  NSMutableArray *counts = [NSMutableArray arrayWithCapacity:MKNK_LATENCY_BUCKET_COUNT];
+  for(NSUInteger bucket = 0; bucket < MKNK_LATENCY_BUCKET_COUNT; bucket ++) {
+    [counts addObject:@(histogram->counts[bucket])];
+  }
+
+  return counts;
+}
+
++(NSTimeInterval) percentile:(double) percentile ofHistogram:(NSArray*) histogram {
+
+  NSUInteger total = [[histogram valueForKeyPath:@"@sum.unsignedIntegerValue"] unsignedIntegerValue];
+  if(total == 0) return -1;
+
+  // the rank of the percentile, counting from 1
+  NSUInteger rank = MAX(1, (NSUInteger) ceil(percentile * total));
+  NSUInteger seen = 0;
+  for(NSUInteger bucket = 0; bucket < histogram.count; bucket ++) {
+
+    seen += [histogram[bucket] unsignedIntegerValue];
+    if(seen >= rank) return bucket < MKNK_LATENCY_BUCKET_COUNT - 1 ? kMKNKLatencyBucketBounds[bucket] : DBL_MAX;
+  }
+
+  return DBL_MAX;
+}
+
+-(void) addRequestMetrics:(MKNetworkRequestMetrics*) requestMetrics {
+
+  MKNKRequestState finalState = [requestMetrics.states.lastObject intValue];
+
+  @synchronized(self) {
+
+    if(finalState == MKNKRequestStateCancelled) {
+      self.cancelledRequestCount ++;
+    } else if(finalState == MKNKRequestStateError) {
+      self.failedRequestCount ++;
+    } else {
+      self.completedRequestCount ++;
+    }
+
+    self.retryCount += requestMetrics.retryCount;
+    self.hedgeCount += requestMetrics.hedgeCount;
+
+    switch (requestMetrics.cacheOutcome) {
+      case MKNKCacheOutcomeMiss: self.cacheMissCount ++; break;
+      case MKNKCacheOutcomeFreshHit: self.freshCacheHitCount ++; break;
+      case MKNKCacheOutcomeStaleHit: self.staleCacheHitCount ++; break;
+      case MKNKCacheOutcomeStaleWhileRevalidate: self.staleCacheHitCount ++; break;
+      case MKNKCacheOutcomeRevalidated: self.revalidatedCount ++; break;
+      case MKNKCacheOutcomeStaleIfError: self.staleIfErrorCount ++; break;
+      default: break;
+    }
+
+    self.countOfBytesSent += requestMetrics.countOfBytesSent;
+    self.countOfBytesReceived += requestMetrics.countOfBytesReceived;
+
+    MKNKLatencyHistogramAdd(&_queueWaitHistogram, requestMetrics.queueWaitDuration);
+    MKNKLatencyHistogramAdd(&_timeToFirstByteHistogram, requestMetrics.timeToFirstByte);
+    MKNKLatencyHistogramAdd(&_totalDurationHistogram, requestMetrics.totalDuration);
+    MKNKLatencyHistogramAdd(&_completionDeliveryHistogram, requestMetrics.completionDeliveryDuration);
+  }
+}
+
+-(void) reset {
+
+  @synchronized(self) {
+
+    self.completedRequestCount = self.failedRequestCount = self.cancelledRequestCount = 0;
+    self.retryCount = self.hedgeCount = 0;
+    self.cacheMissCount = self.freshCacheHitCount = self.staleCacheHitCount = self.revalidatedCount = 0;
+    self.staleIfErrorCount = 0;
+    self.countOfBytesSent = self.countOfBytesReceived = 0;
+
+    memset(&_queueWaitHistogram, 0, sizeof(MKNKLatencyHistogram));
+    memset(&_timeToFirstByteHistogram, 0, sizeof(MKNKLatencyHistogram));
+    memset(&_totalDurationHistogram, 0, sizeof(MKNKLatencyHistogram));
+    memset(&_completionDeliveryHistogram, 0, sizeof(MKNKLatencyHistogram));
+  }
+}
+
+-(NSArray*) queueWaitHistogram {
+
+  @synchronized(self) {
+    return MKNKLatencyHistogramArray(&_queueWaitHistogram);
+  }
+}
+
+-(NSArray*) timeToFirstByteHistogram {
+
+  @synchronized(self) {
+    return MKNKLatencyHistogramArray(&_timeToFirstByteHistogram);
+  }
+}
+
+-(NSArray*) totalDurationHistogram {
+
+  @synchronized(self) {
+    return MKNKLatencyHistogramArray(&_totalDurationHistogram);
+  }
+}
+
+-(NSArray*) completionDeliveryHistogram {
+
+  @synchronized(self) {
+    return MKNKLatencyHistogramArray(&_completionDeliveryHistogram);
+  }
+}
+
+-(NSDictionary*) dictionaryRepresentation {
+
+  @synchronized(self) {
+
+    return @{@"completedRequestCount" : @(self.completedRequestCount),
+             @"failedRequestCount" : @(self.failedRequestCount),
+             @"cancelledRequestCount" : @(self.cancelledRequestCount),
+             @"retryCount" : @(self.retryCount),
+             @"hedgeCount" : @(self.hedgeCount),
+             @"cacheMissCount" : @(self.cacheMissCount),
+             @"freshCacheHitCount" : @(self.freshCacheHitCount),
+             @"staleCacheHitCount" : @(self.staleCacheHitCount),
+             @"revalidatedCount" : @(self.revalidatedCount),
+             @"staleIfErrorCount" : @(self.staleIfErrorCount),
+             @"countOfBytesSent" : @(self.countOfBytesSent),
+             @"countOfBytesReceived" : @(self.countOfBytesReceived),
+             @"latencyBucketBounds" : [[self class] latencyBucketBounds],
+             @"queueWaitHistogram" : self.queueWaitHistogram,
+             @"timeToFirstByteHistogram" : self.timeToFirstByteHistogram,
+             @"totalDurationHistogram" : self.totalDurationHistogram,
+             @"completionDeliveryHistogram" : self.completionDeliveryHistogram};
+  }
+}
+
+-(id) copyWithZone:(NSZone *)zone {
+
+  MKNetworkHostMetrics *copy = [[[self class] allocWithZone:zone] init];
+
+  @synchronized(self) {
+
+    copy.completedRequestCount = self.completedRequestCount;
+    copy.failedRequestCount = self.failedRequestCount;
+    copy.cancelledRequestCount = self.cancelledRequestCount;
+    copy.retryCount = self.retryCount;
+    copy.hedgeCount = self.hedgeCount;
+    copy.cacheMissCount = self.cacheMissCount;
+    copy.freshCacheHitCount = self.freshCacheHitCount;
+    copy.staleCacheHitCount = self.staleCacheHitCount;
+    copy.revalidatedCount = self.revalidatedCount;
+    copy.staleIfErrorCount = self.staleIfErrorCount;
+    copy.countOfBytesSent = self.countOfBytesSent;
+    copy.countOfBytesReceived = self.countOfBytesReceived;
+
+    copy->_queueWaitHistogram = _queueWaitHistogram;
+    copy->_timeToFirstByteHistogram = _timeToFirstByteHistogram;
+    copy->_totalDurationHistogram = _totalDurationHistogram;
+    copy->_completionDeliveryHistogram = _completionDeliveryHistogram;
+  }
+
+  return copy;
+}
+
+-(NSString*) description {
+
+  NSMutableString *bucketNames = [NSMutableString string];
+  for(NSUInteger bucket = 0; bucket < MKNK_LATENCY_BUCKET_COUNT - 1; bucket ++) {
+    [bucketNames appendFormat:@"<=%gms ", kMKNKLatencyBucketBounds[bucket] * 1000];
+  }
+  [bucketNames appendString:@"slower"];
+
+  @synchronized(self) {
+
+    return [NSString stringWithFormat:@"<%@: %p>\n"
+            @"requests: %lu completed, %lu failed, %lu cancelled, %lu retries, %lu hedges\n"
+            @"cache: %lu fresh hits, %lu stale hits, %lu revalidated, %lu stale on error, %lu misses\n"
+            @"bytes: %lld sent, %lld received\n"
+            @"buckets: %@\n"
+            @"queue wait: %@\n"
+            @"time to first byte: %@\n"
+            @"total: %@\n"
+            @"completion delivery: %@",
+            NSStringFromClass([self class]), self,
+            (unsigned long) self.completedRequestCount, (unsigned long) self.failedRequestCount,
+            (unsigned long) self.cancelledRequestCount, (unsigned long) self.retryCount, (unsigned long) self.hedgeCount,
+            (unsigned long) self.freshCacheHitCount, (unsigned long) self.staleCacheHitCount,
+            (unsigned long) self.revalidatedCount, (unsigned long) self.staleIfErrorCount,
+            (unsigned long) self.cacheMissCount,
+            self.countOfBytesSent, self.countOfBytesReceived,
+            bucketNames,
+            [self.queueWaitHistogram componentsJoinedByString:@" "],
+            [self.timeToFirstByteHistogram componentsJoinedByString:@" "],
+            [self.totalDurationHistogram componentsJoinedByString:@" "],
+            [self.completionDeliveryHistogram componentsJoinedByString:@" "]];
+  }
+}
+
+@end
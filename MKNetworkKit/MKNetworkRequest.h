@@ -26,17 +26,36 @@
 
 #import <Foundation/Foundation.h>
 
+#import "MKNetworkMetrics.h"
+
 #if TARGET_OS_IPHONE
 #import <UIKit/UIKit.h>
 #endif
 
+@class MKObject;
+
 typedef enum {
   
   MKNKParameterEncodingURL = 0, // default
   MKNKParameterEncodingJSON,
-  MKNKParameterEncodingPlist
+  MKNKParameterEncodingPlist,
+  MKNKParameterEncodingBinaryPlist // smaller and faster to parse than the XML format
 } MKNKParameterEncoding;
 
+typedef enum {
+  
+  MKNKBodyCompressionNone = 0, // default
+  MKNKBodyCompressionGZip,
+  MKNKBodyCompressionDeflate // zlib wrapped, as the HTTP deflate coding expects
+} MKNKBodyCompression;
+
+
+typedef enum {
+  
+  MKNKRequestPriorityLow = -1, // prefetches, preempted by higher priority requests when the host is busy
+  MKNKRequestPriorityNormal = 0, // default
+  MKNKRequestPriorityHigh = 1 // interactive
+} MKNKRequestPriority;
 
 typedef enum {
   
@@ -54,7 +73,7 @@ typedef enum {
   MKNKRequestState _state;
 }
 
-@property (readonly) NSMutableURLRequest *request;
+@property (readonly) NSMutableURLRequest *request; // a copy, changing it doesn't change what the host sends
 @property (readonly) NSHTTPURLResponse *response;
 
 @property MKNKParameterEncoding parameterEncoding;
@@ -69,6 +88,24 @@ typedef enum {
 
 @property NSString *downloadPath;
 
+// Downloads are resumed from where they stopped when they are started again after failing or being cancelled
+// With more than one segment, startDownloadRequest: fetches byte ranges of the file in parallel in the foreground
+// and writes them in place at downloadPath. Servers without range support get a single background download
+@property NSUInteger downloadSegmentCount;
+
+// Bodies of at least bodyCompressionThreshold bytes (defaults to 1024) are compressed and sent with a Content-Encoding
+// Only for servers known to accept compressed requests. Compression runs off the thread that starts the request
+@property MKNKBodyCompression bodyCompression;
+@property NSUInteger bodyCompressionThreshold;
+
+// Written directly as the JSON body in place of the parameters, without building a dictionary first
+@property MKObject *jsonBodyObject;
+
+// Delivers the response body to chunk handlers as it arrives instead of buffering it until the request completes
+// With a downloadPath, a successful body is written to that file as it arrives and responseData maps the file
+// Responses served from the cache are delivered to completion handlers only
+@property BOOL streamsResponse;
+
 @property (readonly) BOOL requiresAuthentication;
 @property (readonly) BOOL isSSL;
 
@@ -78,6 +115,12 @@ typedef enum {
 @property BOOL ignoreCache;
 @property BOOL alwaysLoad;
 
+@property MKNKRequestPriority priority;
+@property NSUInteger maximumAttempts; // 0 uses the host's maximumAttempts
+@property BOOL hedged; // GET only, see -[MKNetworkHost defaultHedgingDelay]
+// Requests still queued at their deadline fail with NSURLErrorTimedOut instead of starting. Earlier deadlines run first
+@property NSDate *deadline;
+
 @property NSString *httpMethod;
 
 @property (readonly) BOOL isCachedResponse;
@@ -88,7 +131,12 @@ typedef enum {
 @property (readonly) NSError *error;
 @property (readonly) NSURLSessionTask *task;
 @property (readonly) CGFloat progress;
-@property (readonly) id responseAsJSON;
+@property (readonly) MKNetworkRequestMetrics *metrics; // complete once the completion handlers have run
+@property (readonly) id responseAsJSON; // parsed once, JSON responses are parsed before completion handlers run
+
+// Completion and progress handlers are called on this queue, defaults to the main queue
+// Chunk handlers are called on the host's callback queue, in the order the chunks arrive
+@property dispatch_queue_t completionQueue;
 
 #if TARGET_OS_IPHONE
 -(UIImage*) decompressedResponseImageOfSize:(CGSize) size;
@@ -101,12 +149,19 @@ typedef enum {
 
 @property (readonly) BOOL cacheable;
 
+// SHA-256 of the method, normalized URL, credentials and varying headers. nil for POST and PATCH requests
+@property (readonly) NSString *cacheKey;
+
+// Names of request headers whose values are part of the cache key, like the response's Vary header
+@property NSArray *varyingHeaders;
+
 - (instancetype)initWithURLString:(NSString *)aURLString
                            params:(NSDictionary *)params
                          bodyData:(NSData *)bodyData
                        httpMethod:(NSString *)method;
 
 typedef void (^MKNKHandler)(MKNetworkRequest* completedRequest);
+typedef void (^MKNKChunkHandler)(MKNetworkRequest* request, NSData *chunk);
 
 -(void) addParameters:(NSDictionary*) paramsDictionary;
 -(void) addHeaders:(NSDictionary*) headersDictionary;
@@ -118,5 +173,6 @@ typedef void (^MKNKHandler)(MKNetworkRequest* completedRequest);
 -(void) addCompletionHandler:(MKNKHandler) completionHandler;
 -(void) addUploadProgressChangedHandler:(MKNKHandler) uploadProgressChangedHandler;
 -(void) addDownloadProgressChangedHandler:(MKNKHandler) downloadProgressChangedHandler;
+-(void) addResponseChunkHandler:(MKNKChunkHandler) responseChunkHandler;
 -(void) cancel;
 @end
@@ -25,37 +25,89 @@
 
 #import "MKNetworkRequest.h"
 
+#import "MKObject.h"
+
 #import "NSDictionary+MKNKAdditions.h"
 
+#import "NSString+MKNKAdditions.h"
+
+#import <pthread.h>
+#import <zlib.h>
+
 @import CoreImage;
 @import ImageIO;
 
 static NSInteger numberOfRunningOperations;
 static NSString * kBoundary = @"0xKhTmLbOuNdArY";
+static NSUInteger const kMKNKStreamBufferSize = 64 * 1024;
+static NSUInteger const kMKNKDefaultBodyCompressionThreshold = 1024;
+
+@class MKCachedResponse;
+
+@interface MKNetworkRequestMetrics (/*Private Methods*/)
+-(void) recordState:(MKNKRequestState) state;
+-(void) recordCompletionHandlersStarted;
+-(void) recordCompletionHandlersFinished;
+-(BOOL) finish;
+@end
 
 @interface MKNetworkRequest (/*Private Methods*/)
-@property NSMutableArray *stateArray;
+@property (readwrite) MKNetworkRequestMetrics *metrics;
 @property NSString *urlString;
 @property NSData *bodyData;
 
 @property (readwrite) NSHTTPURLResponse *response;
 @property (readwrite) NSData *responseData;
+@property id decodedResponseJSON;
+@property NSString *decodedResponseString;
 @property (readwrite) NSError *error;
 @property (readwrite) NSURLSessionTask *task;
 @property (readwrite) CGFloat progress;
+@property (copy) void (^cancellationHandler)(MKNetworkRequest *cancelledRequest);
+@property (copy) void (^metricsHandler)(MKNetworkRequest *finishedRequest);
 
 @property NSMutableDictionary *parameters;
 @property NSMutableDictionary *headers;
 
 @property NSMutableArray *attachedFiles;
 @property NSMutableArray *attachedData;
+@property NSString *uploadBodyFilePath;
+@property NSUInteger attemptCount;
+@property NSDate *attemptStartDate;
+@property MKCachedResponse *cachedRecord; // the entry this request revalidates
+
+// memoized request and hash, reset whenever something they depend on changes
+// guarded by the built request lock, the built request is immutable and shared by every thread
+@property NSURLRequest *builtRequest;
+@property NSString *memoizedCacheKey;
+@property NSURLRequest *compressedRequest; // builtRequest with its body compressed, set by the host before it is sent
 
 @property NSMutableArray *completionHandlers;
+@property dispatch_group_t completionHandlersGroup; // entered from dispatching the handlers until they have returned
 @property NSMutableArray *uploadProgressChangedHandlers;
 @property NSMutableArray *downloadProgressChangedHandlers;
+@property NSMutableArray *responseChunkHandlers;
+
+// sinks for streamed responses, either the file at downloadPath or an in memory buffer
+@property NSOutputStream *responseOutputStream;
+@property NSMutableData *streamedResponseData;
+@property NSError *responseStreamError;
+@property long long streamedResponseLength;
 @end
 
-@implementation MKNetworkRequest
+@implementation MKNetworkRequest {
+  
+  MKNKParameterEncoding _parameterEncoding;
+  NSString *_httpMethod;
+  NSString *_username;
+  NSString *_password;
+  NSString *_clientCertificate;
+  NSString *_clientCertificatePassword;
+  NSArray *_varyingHeaders;
+  MKObject *_jsonBodyObject;
+  NSData *_responseData;
+  pthread_mutex_t _builtRequestLock; // recursive, cacheKey builds the request while holding it
+}
 
 #pragma mark -
 #pragma mark Designated Initializer
@@ -67,7 +119,13 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
   
   if(self = [super init]) {
     
-    self.stateArray = [NSMutableArray array];
+    pthread_mutexattr_t lockAttributes;
+    pthread_mutexattr_init(&lockAttributes);
+    pthread_mutexattr_settype(&lockAttributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&_builtRequestLock, &lockAttributes);
+    pthread_mutexattr_destroy(&lockAttributes);
+    
+    self.metrics = [[MKNetworkRequestMetrics alloc] init];
     self.urlString = aURLString;
     if(params) {
       self.parameters = params.mutableCopy;
@@ -81,26 +139,242 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
     self.headers = [NSMutableDictionary dictionary];
     
     self.completionHandlers = [NSMutableArray array];
+    self.completionHandlersGroup = dispatch_group_create();
     self.uploadProgressChangedHandlers = [NSMutableArray array];
     self.downloadProgressChangedHandlers = [NSMutableArray array];
+    self.responseChunkHandlers = [NSMutableArray array];
     
     self.attachedData = [NSMutableArray array];
     self.attachedFiles = [NSMutableArray array];
+    
+    self.bodyCompressionThreshold = kMKNKDefaultBodyCompressionThreshold;
   }
   
   return self;
 }
 
+-(void) dealloc {
+  
+  pthread_mutex_destroy(&_builtRequestLock);
+}
+
+#pragma mark -
+#pragma mark Accessors that invalidate the built request and cache key
+
+// Changes what the request is built from and drops the memoized request (and cache key) in one step
+// A build running on another thread never stores a request built from the previous values
+-(void) changeRequestInputs:(dispatch_block_t) changes resettingCacheKey:(BOOL) resetsCacheKey {
+  
+  pthread_mutex_lock(&_builtRequestLock);
+  if(changes) changes();
+  self.builtRequest = nil;
+  self.compressedRequest = nil;
+  if(resetsCacheKey) self.memoizedCacheKey = nil;
+  pthread_mutex_unlock(&_builtRequestLock);
+}
+
+// The cache key depends only on the method, URL (including query parameters), credentials and varying headers
+-(void) invalidateBuiltRequest {
+  
+  [self changeRequestInputs:nil resettingCacheKey:YES];
+}
+
+-(void) invalidateCacheKey {
+  
+  pthread_mutex_lock(&_builtRequestLock);
+  self.memoizedCacheKey = nil;
+  pthread_mutex_unlock(&_builtRequestLock);
+}
+
+-(MKNKParameterEncoding) parameterEncoding {
+  
+  return _parameterEncoding;
+}
+
+-(void) setParameterEncoding:(MKNKParameterEncoding) parameterEncoding {
+  
+  [self changeRequestInputs:^{
+    self->_parameterEncoding = parameterEncoding;
+  } resettingCacheKey:YES];
+}
+
+-(NSString*) httpMethod {
+  
+  return _httpMethod;
+}
+
+-(void) setHttpMethod:(NSString*) httpMethod {
+  
+  [self changeRequestInputs:^{
+    self->_httpMethod = httpMethod;
+  } resettingCacheKey:YES];
+}
+
+-(NSString*) username {
+  
+  return _username;
+}
+
+-(void) setUsername:(NSString*) username {
+  
+  _username = username;
+  [self invalidateCacheKey];
+}
+
+-(NSString*) password {
+  
+  return _password;
+}
+
+-(void) setPassword:(NSString*) password {
+  
+  _password = password;
+  [self invalidateCacheKey];
+}
+
+-(NSString*) clientCertificate {
+  
+  return _clientCertificate;
+}
+
+-(void) setClientCertificate:(NSString*) clientCertificate {
+  
+  _clientCertificate = clientCertificate;
+  [self invalidateCacheKey];
+}
+
+-(NSString*) clientCertificatePassword {
+  
+  return _clientCertificatePassword;
+}
+
+-(void) setClientCertificatePassword:(NSString*) clientCertificatePassword {
+  
+  _clientCertificatePassword = clientCertificatePassword;
+  [self invalidateCacheKey];
+}
+
+-(NSArray*) varyingHeaders {
+  
+  return _varyingHeaders;
+}
+
+-(void) setVaryingHeaders:(NSArray*) varyingHeaders {
+  
+  _varyingHeaders = [varyingHeaders copy];
+  [self invalidateCacheKey];
+}
+
+-(MKObject*) jsonBodyObject {
+  
+  return _jsonBodyObject;
+}
+
+-(void) setJsonBodyObject:(MKObject*) jsonBodyObject {
+  
+  [self changeRequestInputs:^{
+    self->_jsonBodyObject = jsonBodyObject;
+  } resettingCacheKey:NO];
+}
+
+-(NSData*) responseData {
+  
+  @synchronized(self) {
+    return _responseData;
+  }
+}
+
+// decoded representations belong to the body they were decoded from
+-(void) setResponseData:(NSData*) responseData {
+  
+  @synchronized(self) {
+    
+    if(responseData == _responseData) return;
+    _responseData = responseData;
+    self.decodedResponseJSON = nil;
+    self.decodedResponseString = nil;
+  }
+}
+
+// Requests coalesced onto one response get the same body, it is decoded by the first of them only
+-(void) adoptDecodedResponseOfRequest:(MKNetworkRequest*) decodedRequest {
+  
+  NSData *decodedData = nil;
+  id decodedJSON = nil;
+  @synchronized(decodedRequest) {
+    
+    decodedData = decodedRequest->_responseData;
+    decodedJSON = decodedRequest.decodedResponseJSON;
+  }
+  
+  if(!decodedJSON || [self hasPendingCompletionHandlers]) return;
+  
+  @synchronized(self) {
+    
+    if(_responseData != decodedData) {
+      
+      _responseData = decodedData;
+      self.decodedResponseString = nil;
+    }
+    self.decodedResponseJSON = decodedJSON;
+  }
+}
+
 #pragma mark -
 #pragma mark Lazy request creator
 
+// Built once and reused by hash, isSSL, cacheable and the host until the request is modified
+// Immutable, so that it can be read from any thread while the host sends it
+-(NSURLRequest*) urlRequest {
+  
+  pthread_mutex_lock(&_builtRequestLock);
+  NSURLRequest *builtRequest = self.builtRequest;
+  if(!builtRequest) {
+    
+    builtRequest = [[self buildRequest] copy];
+    self.builtRequest = builtRequest;
+  }
+  pthread_mutex_unlock(&_builtRequestLock);
+  
+  return builtRequest;
+}
+
+// Keeps a compressed copy of the built request, unless the request was rebuilt in the meantime
+-(void) setCompressedRequest:(NSURLRequest*) compressedRequest ofRequest:(NSURLRequest*) builtRequest {
+  
+  pthread_mutex_lock(&_builtRequestLock);
+  if(self.builtRequest == builtRequest) self.compressedRequest = compressedRequest;
+  pthread_mutex_unlock(&_builtRequestLock);
+}
+
+// What the host sends, the compressed copy when there is one
+-(NSURLRequest*) requestToSend {
+  
+  pthread_mutex_lock(&_builtRequestLock);
+  NSURLRequest *compressedRequest = self.compressedRequest;
+  pthread_mutex_unlock(&_builtRequestLock);
+  
+  return compressedRequest ? compressedRequest : [self urlRequest];
+}
+
+// Callers get their own copy, changing it doesn't change what the host sends
 -(NSMutableURLRequest*) request {
   
+  return [[self urlRequest] mutableCopy];
+}
+
+-(NSMutableURLRequest*) buildRequest {
+  
+  NSString *requestMethod = self.httpMethod.uppercaseString;
+  BOOL parametersInURL = ([requestMethod isEqualToString:@"GET"] ||
+                          [requestMethod isEqualToString:@"DELETE"] ||
+                          [requestMethod isEqualToString:@"HEAD"]);
+  
+  // the parameters are encoded once, into the URL or into the body
+  BOOL parametersInBody = !parametersInURL && !self.bodyData;
+  
   NSURL *url = nil;
-  if (([self.httpMethod.uppercaseString isEqualToString:@"GET"] ||
-       [self.httpMethod.uppercaseString isEqualToString:@"DELETE"] ||
-       [self.httpMethod.uppercaseString isEqualToString:@"HEAD"]) &&
-      (self.parameters.count > 0)) {
+  if (parametersInURL && (self.parameters.count > 0)) {
     
     url = [NSURL URLWithString:[NSString stringWithFormat:@"%@?%@", self.urlString,
                                 [self.parameters urlEncodedKeyValueString]]];
@@ -120,38 +394,53 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
   [createdRequest setHTTPMethod:self.httpMethod];
   
   NSString *bodyStringFromParameters = nil;
+  NSData *bodyDataFromParameters = nil;
+  NSData *bodyDataFromObject = nil;
   NSString *charset = (__bridge NSString *)CFStringConvertEncodingToIANACharSetName(CFStringConvertNSStringEncodingToEncoding(NSUTF8StringEncoding));
   
-  switch (self.parameterEncoding) {
+  switch (self.jsonBodyObject ? MKNKParameterEncodingJSON : self.parameterEncoding) {
       
     case MKNKParameterEncodingURL: {
       [createdRequest setValue:
        [NSString stringWithFormat:@"application/x-www-form-urlencoded; charset=%@", charset]
             forHTTPHeaderField:@"Content-Type"];
-      bodyStringFromParameters = [self.parameters urlEncodedKeyValueString];
+      if(parametersInBody) bodyDataFromParameters = [self.parameters urlEncodedKeyValueData];
     }
       break;
     case MKNKParameterEncodingJSON: {
       [createdRequest setValue:
        [NSString stringWithFormat:@"application/json; charset=%@", charset]
             forHTTPHeaderField:@"Content-Type"];
-      bodyStringFromParameters = [self.parameters jsonEncodedKeyValueString];
+      if(parametersInBody && self.jsonBodyObject) {
+        bodyDataFromObject = [self.jsonBodyObject jsonData];
+      } else if(parametersInBody) {
+        bodyStringFromParameters = [self.parameters jsonEncodedKeyValueString];
+      }
     }
       break;
     case MKNKParameterEncodingPlist: {
       [createdRequest setValue:
        [NSString stringWithFormat:@"application/x-plist; charset=%@", charset]
             forHTTPHeaderField:@"Content-Type"];
-      bodyStringFromParameters = [self.parameters plistEncodedKeyValueString];
+      if(parametersInBody) bodyStringFromParameters = [self.parameters plistEncodedKeyValueString];
+    }
+      break;
+    case MKNKParameterEncodingBinaryPlist: {
+      [createdRequest setValue:@"application/x-plist" forHTTPHeaderField:@"Content-Type"];
+      if(parametersInBody) bodyDataFromParameters = [self.parameters binaryPlistEncodedKeyValueData];
     }
   }
   
   
-  if (!([self.httpMethod.uppercaseString isEqualToString:@"GET"] ||
-        [self.httpMethod.uppercaseString isEqualToString:@"DELETE"] ||
-        [self.httpMethod.uppercaseString isEqualToString:@"HEAD"])) {
+  if (parametersInBody) {
     
-    [createdRequest setHTTPBody:[bodyStringFromParameters dataUsingEncoding:NSUTF8StringEncoding]];
+    if(bodyDataFromObject) {
+      [createdRequest setHTTPBody:bodyDataFromObject];
+    } else if(bodyDataFromParameters) {
+      [createdRequest setHTTPBody:bodyDataFromParameters];
+    } else {
+      [createdRequest setHTTPBody:[bodyStringFromParameters dataUsingEncoding:NSUTF8StringEncoding]];
+    }
   }
   
   if(self.bodyData) {
@@ -168,10 +457,9 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
       charset, kBoundary]
           forHTTPHeaderField:@"Content-Type"];
     
-    // HEAVY OPERATION!
-    
+    // attached files are not read, only their sizes are looked up
     [createdRequest setValue:
-     [NSString stringWithFormat:@"%lu", (unsigned long) [self.multipartFormData length]]
+     [NSString stringWithFormat:@"%llu", self.multipartFormDataLength]
           forHTTPHeaderField:@"Content-Length"];
     
   }
@@ -179,26 +467,120 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
   return createdRequest;
 }
 
+#pragma mark -
+#pragma mark Request body compression
+
+static BOOL MKNKDeflateInit(z_stream *stream, MKNKBodyCompression compression) {
+  
+  memset(stream, 0, sizeof(z_stream));
+  
+  // 16 added to the window bits writes a gzip header and trailer instead of the zlib ones
+  int windowBits = (compression == MKNKBodyCompressionGZip) ? MAX_WBITS + 16 : MAX_WBITS;
+  return deflateInit2(stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+}
+
+// Compresses the bytes through a buffer, handing every filled part of it to the sink
+// Finishing with no bytes flushes what is left and ends the stream
+static BOOL MKNKDeflate(z_stream *stream, const uint8_t *bytes, NSUInteger length, BOOL finish,
+                        NSMutableData *buffer, BOOL (^sink)(const uint8_t *bytes, NSUInteger length)) {
+  
+  NSUInteger offset = 0;
+  do {
+    
+    // avail_in is 32 bit, larger bodies go through in chunks
+    NSUInteger chunkLength = MIN(length - offset, (NSUInteger) UINT32_MAX);
+    BOOL lastChunk = (offset + chunkLength == length);
+    stream->next_in = (Bytef*) (bytes + offset);
+    stream->avail_in = (uInt) chunkLength;
+    offset += chunkLength;
+    
+    int flush = (finish && lastChunk) ? Z_FINISH : Z_NO_FLUSH;
+    int result = Z_OK;
+    do {
+      
+      stream->next_out = buffer.mutableBytes;
+      stream->avail_out = (uInt) buffer.length;
+      result = deflate(stream, flush);
+      if(result == Z_STREAM_ERROR) return NO;
+      
+      NSUInteger producedLength = buffer.length - stream->avail_out;
+      if(producedLength > 0 && !sink(buffer.mutableBytes, producedLength)) return NO;
+    } while(flush == Z_FINISH ? result != Z_STREAM_END : stream->avail_out == 0);
+  } while(offset < length);
+  
+  return YES;
+}
+
+-(NSString*) contentEncodingOfBodyCompression {
+  
+  return (self.bodyCompression == MKNKBodyCompressionGZip) ? @"gzip" : @"deflate";
+}
+
+-(BOOL) compressesBodyOfLength:(unsigned long long) length {
+  
+  return (self.bodyCompression != MKNKBodyCompressionNone &&
+          length >= self.bodyCompressionThreshold &&
+          ![self.urlRequest valueForHTTPHeaderField:@"Content-Encoding"]);
+}
+
+// Bodies already compressed (by an earlier attempt or by the caller) have a Content-Encoding and are left alone
+-(BOOL) needsBodyCompression {
+  
+  pthread_mutex_lock(&_builtRequestLock);
+  BOOL compressed = self.compressedRequest != nil;
+  pthread_mutex_unlock(&_builtRequestLock);
+  
+  return !compressed && [self compressesBodyOfLength:self.urlRequest.HTTPBody.length];
+}
+
+// A copy of the built request with its body compressed, the request itself isn't changed
+// nil when compressing fails or doesn't make the body smaller, the uncompressed body is sent then
+-(NSURLRequest*) compressedCopyOfRequest:(NSURLRequest*) request {
+  
+  NSData *body = request.HTTPBody;
+  
+  z_stream stream;
+  if(!MKNKDeflateInit(&stream, self.bodyCompression)) return nil;
+  
+  NSMutableData *compressedBody = [NSMutableData dataWithCapacity:body.length / 2];
+  NSMutableData *buffer = [NSMutableData dataWithLength:kMKNKStreamBufferSize];
+  BOOL succeeded = MKNKDeflate(&stream, body.bytes, body.length, YES, buffer, ^BOOL(const uint8_t *bytes, NSUInteger length) {
+    
+    [compressedBody appendBytes:bytes length:length];
+    return YES;
+  });
+  deflateEnd(&stream);
+  
+  if(!succeeded || compressedBody.length >= body.length) return nil;
+  
+  NSMutableURLRequest *compressedRequest = [request mutableCopy];
+  compressedRequest.HTTPBody = compressedBody;
+  [compressedRequest setValue:[self contentEncodingOfBodyCompression] forHTTPHeaderField:@"Content-Encoding"];
+  [compressedRequest setValue:[NSString stringWithFormat:@"%lu", (unsigned long) compressedBody.length] forHTTPHeaderField:@"Content-Length"];
+  return [compressedRequest copy];
+}
+
 #pragma mark -
 #pragma mark Multipart form data
 
--(NSData*) multipartFormData {
+// Each part is either an NSData or the path (NSString) of an attached file that is read only when the body is written
+-(NSArray*) multipartFormParts {
   
   if(self.attachedData.count == 0 && self.attachedFiles.count == 0) {
     
     return nil;
   }
   
-  NSMutableData *formData = [NSMutableData data];
+  NSMutableArray *parts = [NSMutableArray array];
+  NSData *lineBreak = [@"\r\n" dataUsingEncoding:NSUTF8StringEncoding];
   
   [self.parameters enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
     
     NSString *thisFieldString = [NSString stringWithFormat:
-                                 @"--%@\r\nContent-Disposition: form-data; name=\"%@\"\r\n\r\n%@",
+                                 @"--%@\r\nContent-Disposition: form-data; name=\"%@\"\r\n\r\n%@\r\n",
                                  kBoundary, key, obj];
     
-    [formData appendData:[thisFieldString dataUsingEncoding:NSUTF8StringEncoding]];
-    [formData appendData:[@"\r\n" dataUsingEncoding:NSUTF8StringEncoding]];
+    [parts addObject:[thisFieldString dataUsingEncoding:NSUTF8StringEncoding]];
   }];
   
   [self.attachedFiles enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
@@ -211,9 +593,9 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
                                  [thisFile[@"filepath"] lastPathComponent],
                                  thisFile[@"mimetype"]];
     
-    [formData appendData:[thisFieldString dataUsingEncoding:NSUTF8StringEncoding]];
-    [formData appendData: [NSData dataWithContentsOfFile:thisFile[@"filepath"]]];
-    [formData appendData:[@"\r\n" dataUsingEncoding:NSUTF8StringEncoding]];
+    [parts addObject:[thisFieldString dataUsingEncoding:NSUTF8StringEncoding]];
+    [parts addObject:thisFile[@"filepath"]];
+    [parts addObject:lineBreak];
   }];
   
   [self.attachedData enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
@@ -226,23 +608,260 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
                                  thisDataObject[@"filename"],
                                  thisDataObject[@"mimetype"]];
     
-    [formData appendData:[thisFieldString dataUsingEncoding:NSUTF8StringEncoding]];
-    [formData appendData:thisDataObject[@"data"]];
-    [formData appendData:[@"\r\n" dataUsingEncoding:NSUTF8StringEncoding]];
+    [parts addObject:[thisFieldString dataUsingEncoding:NSUTF8StringEncoding]];
+    [parts addObject:thisDataObject[@"data"]];
+    [parts addObject:lineBreak];
   }];
   
-  [formData appendData: [[NSString stringWithFormat:@"--%@--\r\n", kBoundary] dataUsingEncoding:NSUTF8StringEncoding]];
+  [parts addObject:[[NSString stringWithFormat:@"--%@--\r\n", kBoundary] dataUsingEncoding:NSUTF8StringEncoding]];
+  
+  return parts;
+}
+
+-(unsigned long long) multipartFormDataLength {
+  
+  unsigned long long length = 0;
+  for(id part in [self multipartFormParts]) {
+    
+    if([part isKindOfClass:[NSData class]]) {
+      
+      length += [part length];
+    } else {
+      
+      length += [[[NSFileManager defaultManager] attributesOfItemAtPath:part error:nil] fileSize];
+    }
+  }
+  
+  return length;
+}
+
+// Builds the whole body in memory, prefer writeUploadBodyToFile:error: for large attachments
+-(NSData*) multipartFormData {
+  
+  NSArray *parts = [self multipartFormParts];
+  if(!parts) return nil;
+  
+  NSMutableData *formData = [NSMutableData data];
+  for(id part in parts) {
+    
+    if([part isKindOfClass:[NSData class]]) {
+      
+      [formData appendData:part];
+    } else {
+      
+      [formData appendData:[NSData dataWithContentsOfFile:part options:NSDataReadingMappedIfSafe error:nil]];
+    }
+  }
   
   return formData;
 }
 
+static BOOL MKNKWriteBytesToStream(NSOutputStream *outputStream, const uint8_t *bytes, NSUInteger length) {
+  
+  NSUInteger bytesWritten = 0;
+  while(bytesWritten < length) {
+    
+    NSInteger result = [outputStream write:bytes + bytesWritten maxLength:length - bytesWritten];
+    if(result <= 0) return NO;
+    bytesWritten += result;
+  }
+  
+  return YES;
+}
+
+// Writes the upload body to a file, streaming attached files through a fixed size buffer
+// Memory usage doesn't grow with the size of the attachments
+// Returns the request to upload the file with, its headers describe the body as written. nil if writing failed
+-(NSURLRequest*) writeUploadBodyToFile:(NSString*) filePath error:(NSError**) error {
+  
+  NSURLRequest *request = self.urlRequest;
+  NSArray *parts = [self multipartFormParts];
+  if(!parts) {
+    
+    NSURLRequest *compressedRequest = [self needsBodyCompression] ? [self compressedCopyOfRequest:request] : nil;
+    if(compressedRequest) request = compressedRequest;
+    NSData *body = request.HTTPBody;
+    return [(body ? body : [NSData data]) writeToFile:filePath options:NSDataWritingAtomic error:error] ? request : nil;
+  }
+  
+  NSOutputStream *outputStream = [NSOutputStream outputStreamToFileAtPath:filePath append:NO];
+  [outputStream open];
+  
+  NSMutableData *buffer = [NSMutableData dataWithLength:kMKNKStreamBufferSize];
+  BOOL succeeded = YES;
+  NSError *streamError = nil;
+  
+  // the parts are compressed as they are written, the body is never in memory as a whole
+  BOOL compressed = [self compressesBodyOfLength:[self multipartFormDataLength]];
+  NSMutableData *compressedBuffer = compressed ? [NSMutableData dataWithLength:kMKNKStreamBufferSize] : nil;
+  z_stream stream;
+  z_stream *deflateStream = &stream; // blocks capture the stream by address, zlib's state points back to it
+  if(compressed && !MKNKDeflateInit(deflateStream, self.bodyCompression)) compressed = NO;
+  
+  BOOL (^writeBody)(const uint8_t*, NSUInteger) = ^BOOL(const uint8_t *bytes, NSUInteger length) {
+    
+    if(!compressed) return MKNKWriteBytesToStream(outputStream, bytes, length);
+    return MKNKDeflate(deflateStream, bytes, length, NO, compressedBuffer, ^BOOL(const uint8_t *compressedBytes, NSUInteger compressedLength) {
+      return MKNKWriteBytesToStream(outputStream, compressedBytes, compressedLength);
+    });
+  };
+  
+  for(id part in parts) {
+    
+    if([part isKindOfClass:[NSData class]]) {
+      
+      succeeded = writeBody([part bytes], [part length]);
+    } else {
+      
+      NSInputStream *inputStream = [NSInputStream inputStreamWithFileAtPath:part];
+      [inputStream open];
+      
+      NSInteger bytesRead = 0;
+      while(succeeded && (bytesRead = [inputStream read:buffer.mutableBytes maxLength:buffer.length]) > 0) {
+        
+        succeeded = writeBody(buffer.mutableBytes, bytesRead);
+      }
+      
+      if(bytesRead < 0 || !inputStream) {
+        
+        succeeded = NO;
+        streamError = inputStream.streamError;
+      }
+      [inputStream close];
+    }
+    
+    if(!succeeded) break;
+  }
+  
+  if(compressed) {
+    
+    if(succeeded) {
+      succeeded = MKNKDeflate(deflateStream, NULL, 0, YES, compressedBuffer, ^BOOL(const uint8_t *compressedBytes, NSUInteger compressedLength) {
+        return MKNKWriteBytesToStream(outputStream, compressedBytes, compressedLength);
+      });
+    }
+    deflateEnd(deflateStream);
+  }
+  
+  if(!succeeded && !streamError) {
+    streamError = outputStream.streamError;
+  }
+  [outputStream close];
+  
+  if(succeeded && compressed) {
+    
+    // Content-Length was set from the uncompressed parts when the request was built
+    unsigned long long compressedLength = [[[NSFileManager defaultManager] attributesOfItemAtPath:filePath error:nil] fileSize];
+    NSMutableURLRequest *compressedRequest = [request mutableCopy];
+    [compressedRequest setValue:[self contentEncodingOfBodyCompression] forHTTPHeaderField:@"Content-Encoding"];
+    [compressedRequest setValue:[NSString stringWithFormat:@"%llu", compressedLength] forHTTPHeaderField:@"Content-Length"];
+    request = [compressedRequest copy];
+  }
+  
+  if(!succeeded && error) {
+    *error = streamError ? streamError : [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:nil];
+  }
+  
+  return succeeded ? request : nil;
+}
+
+#pragma mark -
+#pragma mark Streamed responses
+
+// Only successful bodies go to the download path, error bodies are small and are kept in memory
+-(BOOL) beginStreamingResponse:(NSHTTPURLResponse*) response {
+  
+  // handlers still reading a cached response get the streamed one when the host completes the request
+  if(![self hasPendingCompletionHandlers]) self.response = response;
+  self.streamedResponseLength = 0;
+  self.streamedResponseData = nil;
+  self.responseStreamError = nil;
+  
+  if(self.downloadPath && response.statusCode >= 200 && response.statusCode < 300) {
+    
+    self.responseOutputStream = [NSOutputStream outputStreamToFileAtPath:self.downloadPath append:NO];
+    [self.responseOutputStream open];
+    
+    if(self.responseOutputStream.streamStatus == NSStreamStatusError) {
+      
+      NSLog(@"Failed to open requested download path [%@] with error %@", self.downloadPath, self.responseOutputStream.streamError);
+      self.responseStreamError = self.responseOutputStream.streamError;
+      self.responseOutputStream = nil;
+      return NO;
+    }
+  } else {
+    
+    long long expectedLength = response.expectedContentLength;
+    self.streamedResponseData = [NSMutableData dataWithCapacity:
+                                 (expectedLength > 0 && expectedLength < NSUIntegerMax) ? (NSUInteger) expectedLength : 0];
+  }
+  
+  return YES;
+}
+
+-(BOOL) appendResponseChunk:(NSData*) chunk {
+  
+  if(self.responseOutputStream) {
+    
+    __block BOOL written = YES;
+    [chunk enumerateByteRangesUsingBlock:^(const void *bytes, NSRange byteRange, BOOL *stop) {
+      
+      written = MKNKWriteBytesToStream(self.responseOutputStream, bytes, byteRange.length);
+      *stop = !written;
+    }];
+    
+    if(!written) {
+      
+      self.responseStreamError = self.responseOutputStream.streamError ? self.responseOutputStream.streamError :
+      [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:nil];
+      return NO;
+    }
+  } else {
+    
+    [self.streamedResponseData appendData:chunk];
+  }
+  
+  self.streamedResponseLength += chunk.length;
+  
+  [self.responseChunkHandlers enumerateObjectsUsingBlock:^(MKNKChunkHandler handler, NSUInteger idx, BOOL *stop) {
+    
+    handler(self, chunk);
+  }];
+  
+  long long expectedLength = self.response.expectedContentLength;
+  if(expectedLength > 0) {
+    [self setProgressValue:(CGFloat) self.streamedResponseLength / expectedLength];
+  }
+  
+  return YES;
+}
+
+// Returns the complete body, the downloaded file is memory mapped instead of read
+-(NSData*) finishStreamingResponse:(NSError**) error {
+  
+  NSData *body = self.streamedResponseData;
+  if(self.responseOutputStream) {
+    
+    [self.responseOutputStream close];
+    self.responseOutputStream = nil;
+    if(!self.responseStreamError) {
+      body = [NSData dataWithContentsOfFile:self.downloadPath options:NSDataReadingMappedIfSafe error:nil];
+    }
+  }
+  
+  if(error) *error = self.responseStreamError;
+  
+  self.streamedResponseData = nil;
+  self.responseStreamError = nil;
+  return body;
+}
 
 #pragma mark -
 #pragma mark Network response caching related helper methods
 
 -(BOOL) isSSL {
   
-  return [self.request.URL.scheme.lowercaseString isEqualToString:@"https"];
+  return [self.urlRequest.URL.scheme.lowercaseString isEqualToString:@"https"];
 }
 
 -(BOOL) requiresAuthentication {
@@ -269,7 +888,8 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
 
 -(BOOL) isEqualToRequest:(MKNetworkRequest*) request {
   
-  return [self hash] == [request hash];
+  NSString *cacheKey = self.cacheKey;
+  return cacheKey != nil && [cacheKey isEqualToString:request.cacheKey];
 }
 
 - (BOOL)isEqual:(id)object {
@@ -287,22 +907,110 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
 
 -(NSUInteger) hash {
   
-  if(!([self.httpMethod.uppercaseString isEqualToString:@"POST"] ||
-       [self.httpMethod.uppercaseString isEqualToString:@"PATCH"])) {
+  NSString *cacheKey = self.cacheKey;
+  return cacheKey ? [cacheKey hash] : arc4random();
+}
+
+static NSString *MKNKQueryItemKey(NSString *queryItem) {
+  
+  NSRange separatorRange = [queryItem rangeOfString:@"="];
+  return separatorRange.location == NSNotFound ? queryItem : [queryItem substringToIndex:separatorRange.location];
+}
+
+// Scheme and host are lower cased, default ports and fragments are dropped and query items are sorted
+-(NSString*) normalizedURLString {
+  
+  NSURLComponents *components = [NSURLComponents componentsWithURL:self.urlRequest.URL resolvingAgainstBaseURL:NO];
+  components.scheme = components.scheme.lowercaseString;
+  components.host = components.host.lowercaseString;
+  components.fragment = nil;
+  
+  if(([components.scheme isEqualToString:@"http"] && components.port.integerValue == 80) ||
+     ([components.scheme isEqualToString:@"https"] && components.port.integerValue == 443)) {
+    components.port = nil;
+  }
+  
+  if(components.percentEncodedPath.length == 0) {
+    components.percentEncodedPath = @"/";
+  }
+  
+  if(components.percentEncodedQuery.length > 0) {
     
-    NSMutableString *str = [NSMutableString stringWithFormat:@"%@ %@",
-                            self.httpMethod.uppercaseString,
-                            self.request.URL.absoluteString];
+    // sorted by key only and stably, the values of a repeated key keep their order (?a=2&a=1 isn't ?a=1&a=2)
+    NSArray *queryItems = [components.percentEncodedQuery componentsSeparatedByString:@"&"];
+    NSArray *sortedQueryItems = [queryItems sortedArrayWithOptions:NSSortStable
+                                                   usingComparator:^NSComparisonResult(NSString *item1, NSString *item2) {
+                                                     
+                                                     return [MKNKQueryItemKey(item1) compare:MKNKQueryItemKey(item2)];
+                                                   }];
+    components.percentEncodedQuery = [sortedQueryItems componentsJoinedByString:@"&"];
+  }
+  
+  return components.string;
+}
+
+-(NSString*) cacheKey {
+  
+  if([self.httpMethod.uppercaseString isEqualToString:@"POST"] ||
+     [self.httpMethod.uppercaseString isEqualToString:@"PATCH"]) {
     
-    if(self.username) [str appendString:self.username];
-    if(self.password) [str appendString:self.password];
-    if(self.clientCertificate) [str appendString:self.clientCertificate];
-    if(self.clientCertificatePassword) [str appendString:self.clientCertificatePassword];
+    return nil;
+  }
+  
+  // computed under the built request lock, so that a key is never stored after the request it came from changed
+  pthread_mutex_lock(&_builtRequestLock);
+  NSString *memoizedCacheKey = self.memoizedCacheKey;
+  if(!memoizedCacheKey) {
     
-    return [str hash];
-  } else {
-    return arc4random();
+    memoizedCacheKey = [self computeCacheKey];
+    self.memoizedCacheKey = memoizedCacheKey;
   }
+  pthread_mutex_unlock(&_builtRequestLock);
+  
+  return memoizedCacheKey;
+}
+
+-(NSString*) computeCacheKey {
+  
+  NSString *normalizedURLString = [self normalizedURLString];
+  if(!normalizedURLString) return nil;
+  
+  // every component is on its own line so that adjacent values can't run into each other
+  NSMutableString *str = [NSMutableString stringWithFormat:@"%@\n%@\n",
+                          self.httpMethod.uppercaseString,
+                          normalizedURLString];
+  
+  [str appendFormat:@"%@\n", self.username ? self.username : @""];
+  [str appendFormat:@"%@\n", self.password ? self.password : @""];
+  [str appendFormat:@"%@\n", self.clientCertificate ? self.clientCertificate : @""];
+  [str appendFormat:@"%@\n", self.clientCertificatePassword ? self.clientCertificatePassword : @""];
+  
+  for(NSString *headerName in [self.varyingHeaders sortedArrayUsingSelector:@selector(caseInsensitiveCompare:)]) {
+    
+    NSString *headerValue = [self.urlRequest valueForHTTPHeaderField:headerName];
+    [str appendFormat:@"%@:%@\n", headerName.lowercaseString, headerValue ? headerValue : @""];
+  }
+  
+  return [NSString sha256StringFromData:[str dataUsingEncoding:NSUTF8StringEncoding]];
+}
+
+// Fetches the same resource without the caller's handlers, used to refresh a cached response in the background
+-(MKNetworkRequest*) revalidationRequest {
+  
+  MKNetworkRequest *request = [[MKNetworkRequest alloc] initWithURLString:self.urlString
+                                                                   params:self.parameters
+                                                                 bodyData:self.bodyData
+                                                               httpMethod:self.httpMethod];
+  request.parameterEncoding = self.parameterEncoding;
+  [request addHeaders:self.headers];
+  request.username = self.username;
+  request.password = self.password;
+  request.clientCertificate = self.clientCertificate;
+  request.clientCertificatePassword = self.clientCertificatePassword;
+  request.varyingHeaders = self.varyingHeaders;
+  request.alwaysCache = self.alwaysCache;
+  request.priority = MKNKRequestPriorityLow;
+  return request;
 }
 
 #pragma mark -
@@ -323,14 +1031,23 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
   [self.downloadProgressChangedHandlers addObject:downloadProgressChangedHandler];
 }
 
+-(void) addResponseChunkHandler:(MKNKChunkHandler) responseChunkHandler {
+  
+  [self.responseChunkHandlers addObject:responseChunkHandler];
+}
+
 -(void) addParameters:(NSDictionary*) paramsDictionary {
   
-  [self.parameters addEntriesFromDictionary:paramsDictionary];
+  [self changeRequestInputs:^{
+    [self.parameters addEntriesFromDictionary:paramsDictionary];
+  } resettingCacheKey:YES];
 }
 
 -(void) addHeaders:(NSDictionary*) headersDictionary {
   
-  [self.headers addEntriesFromDictionary:headersDictionary];
+  [self changeRequestInputs:^{
+    [self.headers addEntriesFromDictionary:headersDictionary];
+  } resettingCacheKey:self.varyingHeaders.count > 0];
 }
 
 -(void) attachFile:(NSString*) filePath forKey:(NSString*) key mimeType:(NSString*) mimeType {
@@ -339,7 +1056,9 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
                          @"name": key,
                          @"mimetype": mimeType};
   
-  [self.attachedFiles addObject:dict];
+  [self changeRequestInputs:^{
+    [self.attachedFiles addObject:dict];
+  } resettingCacheKey:NO];
 }
 
 -(void) attachData:(NSData*) data forKey:(NSString*) key mimeType:(NSString*) mimeType suggestedFileName:(NSString*) fileName {
@@ -351,12 +1070,16 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
                          @"mimetype": mimeType,
                          @"filename": fileName};
   
-  [self.attachedData addObject:dict];
+  [self changeRequestInputs:^{
+    [self.attachedData addObject:dict];
+  } resettingCacheKey:NO];
 }
 
 -(void) setAuthorizationHeaderValue:(NSString*) value forAuthType:(NSString*) authType {
   
-  self.headers[@"Authorization"] = [NSString stringWithFormat:@"%@ %@", authType, value];
+  [self changeRequestInputs:^{
+    self.headers[@"Authorization"] = [NSString stringWithFormat:@"%@ %@", authType, value];
+  } resettingCacheKey:self.varyingHeaders.count > 0];
 }
 
 #pragma mark -
@@ -378,7 +1101,7 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
 
 -(NSString*) curlCommandLineString
 {
-  NSMutableURLRequest *request = self.request;
+  NSURLRequest *request = self.urlRequest;
   
   __block NSMutableString *displayString = [NSMutableString stringWithFormat:@"curl -X %@", request.HTTPMethod];
   
@@ -443,12 +1166,12 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
 #ifdef TARGET_OS_IPHONE
   dispatch_async(dispatch_get_main_queue(), ^{
     
-    //NSLog(@"%@", self.stateArray);
+    //NSLog(@"%@", self.metrics);
     numberOfRunningOperations --;
     if(numberOfRunningOperations == 0)
       [UIApplication sharedApplication].networkActivityIndicatorVisible = NO;
     if(numberOfRunningOperations < 0) {
-      NSLog(@"Number of operations is below zero. State Changes [%@]", self.stateArray); // FIX ME
+      NSLog(@"Number of operations is below zero. State Changes [%@]", self.metrics.states); // FIX ME
     }
     
   });
@@ -472,19 +1195,81 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
   
   if(self.state == MKNKRequestStateStarted) {
 
-    [self.task cancel];
     self.state = MKNKRequestStateCancelled;
+    
+    // the task might be shared with other requests, let the host decide whether to cancel it
+    if(self.cancellationHandler) {
+      self.cancellationHandler(self);
+    } else {
+      [self.task cancel];
+    }
   }
 }
 
+// Handlers are called right away when the request is already on the main thread and delivers to the main queue
+-(void) performOnCompletionQueue:(dispatch_block_t) block {
+  
+  dispatch_queue_t queue = self.completionQueue ? self.completionQueue : dispatch_get_main_queue();
+  if(queue == dispatch_get_main_queue() && [NSThread isMainThread]) {
+    block();
+  } else {
+    dispatch_async(queue, block);
+  }
+}
+
+// The host is told about the request's metrics once, after its final completion handlers have run
+-(void) finishMetrics {
+  
+  if([self.metrics finish] && self.metricsHandler) {
+    self.metricsHandler(self);
+  }
+}
+
+-(void) performCompletionHandlersFinishingMetrics:(BOOL) finishesMetrics {
+  
+  dispatch_group_enter(self.completionHandlersGroup);
+  [self performOnCompletionQueue:^{
+    
+    if(finishesMetrics) [self.metrics recordCompletionHandlersStarted];
+    
+    [self.completionHandlers enumerateObjectsUsingBlock:^(MKNKHandler handler, NSUInteger idx, BOOL *stop) {
+      
+      handler(self);
+    }];
+    
+    if(finishesMetrics) {
+      
+      [self.metrics recordCompletionHandlersFinished];
+      [self finishMetrics];
+    }
+    
+    dispatch_group_leave(self.completionHandlersGroup);
+  }];
+}
+
+-(BOOL) hasPendingCompletionHandlers {
+  
+  return dispatch_group_wait(self.completionHandlersGroup, DISPATCH_TIME_NOW) != 0;
+}
+
+// A cached response is followed by the network response when the entry is stale or alwaysLoad is set
+// The host hands the network response over through here, handlers told about the cached one keep reading it until they return
+-(BOOL) performAfterPendingCompletionHandlers:(dispatch_block_t) block {
+  
+  if(![self hasPendingCompletionHandlers]) return NO;
+  
+  dispatch_group_notify(self.completionHandlersGroup, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), block);
+  return YES;
+}
+
 -(void) setState:(MKNKRequestState)state {
   
   _state = state;
-  [self.stateArray addObject:@(state)];
+  [self.metrics recordState:state];
   
   if(state == MKNKRequestStateStarted) {
     
-    NSAssert(self.task, @"Task missing");
+    // queued requests don't have a task yet, the host resumes it when it runs them
     [self.task resume];
     [self incrementRunningOperations];
   }
@@ -492,21 +1277,19 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
   else if(state == MKNKRequestStateResponseAvailableFromCache ||
      state == MKNKRequestStateStaleResponseAvailableFromCache) {
     
-    [self.completionHandlers enumerateObjectsUsingBlock:^(MKNKHandler handler, NSUInteger idx, BOOL *stop) {
-      
-      handler(self);
-    }];
+    // fresh hits and stale-while-revalidate hits aren't followed by a network response
+    MKNKCacheOutcome cacheOutcome = self.metrics.cacheOutcome;
+    [self performCompletionHandlersFinishingMetrics:cacheOutcome == MKNKCacheOutcomeFreshHit ||
+     cacheOutcome == MKNKCacheOutcomeStaleWhileRevalidate];
   } else if(state == MKNKRequestStateCompleted ||
             state == MKNKRequestStateError) {
 
     [self decrementRunningOperations];
-    [self.completionHandlers enumerateObjectsUsingBlock:^(MKNKHandler handler, NSUInteger idx, BOOL *stop) {
-      
-      handler(self);
-    }];
+    [self performCompletionHandlersFinishingMetrics:YES];
   } else if(state == MKNKRequestStateCancelled) {
     
     [self decrementRunningOperations];
+    [self finishMetrics];
   }
 }
 
@@ -551,31 +1334,58 @@ static NSString * kBoundary = @"0xKhTmLbOuNdArY";
 
 -(id) responseAsJSON {
   
-  if(self.responseData == nil) return nil;
-  NSError *error = nil;
-  id returnValue = [NSJSONSerialization JSONObjectWithData:self.responseData options:0 error:&error];
-  if(!returnValue) NSLog(@"JSON Parsing Error: %@", error);
-  return returnValue;
+  @synchronized(self) {
+    
+    if(self.decodedResponseJSON) return self.decodedResponseJSON;
+    if(self.responseData == nil) return nil;
+    
+    NSError *error = nil;
+    id returnValue = [NSJSONSerialization JSONObjectWithData:self.responseData options:0 error:&error];
+    if(!returnValue) NSLog(@"JSON Parsing Error: %@", error);
+    self.decodedResponseJSON = returnValue;
+    return returnValue;
+  }
 }
 
 -(NSString*) responseAsString {
   
-  NSString *string = [[NSString alloc] initWithData:self.responseData encoding:NSUTF8StringEncoding];
-  if(self.responseData.length > 0 && !string) {
-    string = [[NSString alloc] initWithData:self.responseData encoding:NSASCIIStringEncoding];
+  @synchronized(self) {
+    
+    if(self.decodedResponseString) return self.decodedResponseString;
+    
+    NSString *string = [[NSString alloc] initWithData:self.responseData encoding:NSUTF8StringEncoding];
+    if(self.responseData.length > 0 && !string) {
+      string = [[NSString alloc] initWithData:self.responseData encoding:NSASCIIStringEncoding];
+    }
+    
+    self.decodedResponseString = string;
+    return string;
   }
+}
+
+// Called by the host on its callback queue, so that JSON bodies are never parsed on the main thread
+-(void) decodeResponse {
+  
+  if(self.responseData.length == 0) return;
   
-  return string;
+  NSString *contentType = [self.response.allHeaderFields objectForCaseInsensitiveKey:@"Content-Type"];
+  if([contentType.lowercaseString rangeOfString:@"json"].location != NSNotFound) {
+    
+    [self responseAsJSON];
+  }
 }
 
 -(void) setProgressValue:(CGFloat) progressValue {
   
   self.progress = progressValue;
   
-  [self.downloadProgressChangedHandlers enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
+  [self performOnCompletionQueue:^{
     
-    MKNKHandler handler = obj;
-    handler(self);
+    [self.downloadProgressChangedHandlers enumerateObjectsUsingBlock:^(id obj, NSUInteger idx, BOOL *stop) {
+      
+      MKNKHandler handler = obj;
+      handler(self);
+    }];
   }];
 }
 
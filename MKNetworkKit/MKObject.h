@@ -29,9 +29,18 @@
 
 + (id)map:(id)data usingClass:(Class) klass;
 
+// Maps arrays with at least threshold elements in chunks across all cores, keeping their order
+// Smaller arrays and dictionaries are mapped serially. initWithDictionary: must be safe to call concurrently
++ (id)map:(id)data usingClass:(Class) klass parallelThreshold:(NSUInteger) threshold;
+// Splits the array into workerCount chunks mapped concurrently, up to one per core. 0 for a few chunks per core
++ (id)map:(id)data usingClass:(Class) klass parallelThreshold:(NSUInteger) threshold workerCount:(NSUInteger) workerCount;
+
 @property NSMutableDictionary *unmappedEntries;
 - (id)initWithDictionary:(NSDictionary *)jsonObject;
 - (NSString *)jsonString;
+
+// UTF-8 JSON written directly from the properties, without building a dictionary first
+-(NSData*) jsonData;
 -(NSDictionary*) classesForMapping;
 -(NSDictionary*) equivalentKeys;
 
@@ -25,6 +25,271 @@
 
 #import "MKObject.h"
 #import <objc/runtime.h>
+#import <objc/message.h>
+#import <pthread.h>
+
+// How a JSON value is stored into one property
+@interface MKObjectPropertyMapping : NSObject
+@property NSString *name;
+@property Class mappedClass; // from classesForMapping
+@property (assign) Ivar ivar; // NULL when the property isn't backed by an instance variable
+@property char type; // first character of the property's type encoding
+@property char ownership; // 'C' copy, 'W' weak, anything else is stored strong
+@property SEL getter;
+@property SEL setter; // NULL for readonly properties, their instance variable is written like KVC does
+@property NSData *jsonKey; // "name": in UTF-8
+@end
+
+@implementation MKObjectPropertyMapping
+@end
+
+// Built once per class from the runtime property list, equivalentKeys and classesForMapping
+// Immutable once built, so it is shared by every thread decoding that class
+@interface MKObjectMappingPlan : NSObject
+@property NSDictionary *mappingsForKeys; // JSON key -> MKObjectPropertyMapping
+@property NSDictionary *keyPathMappingsForKeys; // first key path component -> @[@[remaining components, mapping]]
+@property BOOL usesKeyValueCoding; // subclasses that customize KVC are decoded the old way
+@property NSArray *serializedMappings; // properties declared by the class itself, in declaration order
+@end
+
+@implementation MKObjectMappingPlan
+@end
+
+static pthread_rwlock_t MKObjectMappingPlansLock = PTHREAD_RWLOCK_INITIALIZER;
+static NSMapTable *MKObjectMappingPlans;
+
+// JSON keys differ from property names only in the case of their first character
+static void MKObjectAddKeyVariants(NSMutableDictionary *dictionary, NSString *key, id object) {
+  
+  if(key.length == 0) return;
+  dictionary[key] = object;
+  
+  NSString *capitalizedKey = [key stringByReplacingCharactersInRange:NSMakeRange(0, 1)
+                                                           withString:[[key substringToIndex:1] uppercaseString]];
+  if(!dictionary[capitalizedKey]) dictionary[capitalizedKey] = object;
+}
+
+static id MKObjectValueForKeyVariants(id container, NSString *key) {
+  
+  if(![container isKindOfClass:[NSDictionary class]]) return [container valueForKey:key];
+  
+  id value = container[key];
+  if(!value && key.length > 0) {
+    
+    value = container[[key stringByReplacingCharactersInRange:NSMakeRange(0, 1)
+                                                   withString:[[key substringToIndex:1] uppercaseString]]];
+  }
+  
+  return value;
+}
+
+@class MKObjectJSONWriter;
+
+@interface MKObject (/*Private Methods*/)
+-(NSDictionary*) objectAsDictionary;
+-(void) writeJSONWithWriter:(MKObjectJSONWriter*) writer;
+@end
+
+// Writes UTF-8 JSON into a growing buffer
+@interface MKObjectJSONWriter : NSObject
+@property NSMutableData *buffer;
+@end
+
+@implementation MKObjectJSONWriter
+
+-(instancetype) init {
+  
+  if(self = [super init]) {
+    
+    self.buffer = [NSMutableData dataWithCapacity:4096];
+  }
+  
+  return self;
+}
+
+-(void) appendBytes:(const void*) bytes length:(NSUInteger) length {
+  
+  [self.buffer appendBytes:bytes length:length];
+}
+
+-(void) writeString:(NSString*) string {
+  
+  static const char hexDigits[] = "0123456789abcdef";
+  
+  [self appendBytes:"\"" length:1];
+  
+  uint8_t chunk[1024];
+  NSRange remainingRange = NSMakeRange(0, string.length);
+  while(remainingRange.length > 0) {
+    
+    NSUInteger usedLength = 0;
+    if(![string getBytes:chunk maxLength:sizeof(chunk) usedLength:&usedLength encoding:NSUTF8StringEncoding
+                 options:0 range:remainingRange remainingRange:&remainingRange] || usedLength == 0) {
+      break;
+    }
+    
+    // copies runs of characters that need no escaping in one go
+    NSUInteger runStart = 0;
+    for(NSUInteger index = 0; index < usedLength; index ++) {
+      
+      uint8_t byte = chunk[index];
+      if(byte >= 0x20 && byte != '"' && byte != '\\') continue;
+      
+      if(index > runStart) [self appendBytes:chunk + runStart length:index - runStart];
+      runStart = index + 1;
+      
+      switch (byte) {
+        case '"': [self appendBytes:"\\\"" length:2]; break;
+        case '\\': [self appendBytes:"\\\\" length:2]; break;
+        case '\n': [self appendBytes:"\\n" length:2]; break;
+        case '\r': [self appendBytes:"\\r" length:2]; break;
+        case '\t': [self appendBytes:"\\t" length:2]; break;
+        case '\b': [self appendBytes:"\\b" length:2]; break;
+        case '\f': [self appendBytes:"\\f" length:2]; break;
+        default: {
+          char escaped[6] = {'\\', 'u', '0', '0', hexDigits[byte >> 4], hexDigits[byte & 0xF]};
+          [self appendBytes:escaped length:sizeof(escaped)];
+        }
+      }
+    }
+    
+    if(usedLength > runStart) [self appendBytes:chunk + runStart length:usedLength - runStart];
+  }
+  
+  [self appendBytes:"\"" length:1];
+}
+
+-(void) writeBool:(BOOL) value {
+  
+  if(value) [self appendBytes:"true" length:4];
+  else [self appendBytes:"false" length:5];
+}
+
+-(void) writeInteger:(long long) value {
+  
+  char digits[24];
+  int length = snprintf(digits, sizeof(digits), "%lld", value);
+  [self appendBytes:digits length:length];
+}
+
+-(void) writeUnsignedInteger:(unsigned long long) value {
+  
+  char digits[24];
+  int length = snprintf(digits, sizeof(digits), "%llu", value);
+  [self appendBytes:digits length:length];
+}
+
+// shortest of the usual precisions that reads back as the same value. JSON has no NaN or infinity
+-(void) writeDouble:(double) value {
+  
+  if(isnan(value) || isinf(value)) {
+    
+    [self appendBytes:"null" length:4];
+    return;
+  }
+  
+  char digits[32];
+  int length = snprintf(digits, sizeof(digits), "%.15g", value);
+  if(strtod(digits, NULL) != value) length = snprintf(digits, sizeof(digits), "%.17g", value);
+  [self appendBytes:digits length:length];
+}
+
+-(void) writeFloat:(float) value {
+  
+  if(isnan(value) || isinf(value)) {
+    
+    [self appendBytes:"null" length:4];
+    return;
+  }
+  
+  char digits[32];
+  int length = snprintf(digits, sizeof(digits), "%.7g", value);
+  if(strtof(digits, NULL) != value) length = snprintf(digits, sizeof(digits), "%.9g", value);
+  [self appendBytes:digits length:length];
+}
+
+-(void) writeNumber:(NSNumber*) number {
+  
+  if(number == (id) kCFBooleanTrue || number == (id) kCFBooleanFalse) {
+    
+    [self writeBool:number.boolValue];
+  } else if(CFNumberIsFloatType((__bridge CFNumberRef) number)) {
+    
+    if(number.objCType[0] == 'f') [self writeFloat:number.floatValue];
+    else [self writeDouble:number.doubleValue];
+  } else if(number.objCType[0] == 'Q') {
+    
+    [self writeUnsignedInteger:number.unsignedLongLongValue];
+  } else {
+    
+    [self writeInteger:number.longLongValue];
+  }
+}
+
++(BOOL) canWriteValue:(id) value {
+  
+  return [value isKindOfClass:[NSString class]] || [value isKindOfClass:[NSNumber class]] ||
+  [value isKindOfClass:[NSNull class]] || [value isKindOfClass:[NSArray class]] ||
+  [value isKindOfClass:[NSDictionary class]] || [value isKindOfClass:[MKObject class]] ||
+  [value respondsToSelector:@selector(objectAsDictionary)];
+}
+
+// values that can't be represented are left out and logged, like objectAsDictionary does
+-(void) writeValue:(id) value {
+  
+  if([value isKindOfClass:[NSString class]]) {
+    
+    [self writeString:value];
+  } else if([value isKindOfClass:[NSNumber class]]) {
+    
+    [self writeNumber:value];
+  } else if([value isKindOfClass:[MKObject class]]) {
+    
+    [value writeJSONWithWriter:self];
+  } else if([value isKindOfClass:[NSArray class]]) {
+    
+    [self appendBytes:"[" length:1];
+    BOOL first = YES;
+    for(id element in value) {
+      
+      if(![MKObjectJSONWriter canWriteValue:element]) {
+        
+        NSLog(@"Array element of type %@ which is unknown", NSStringFromClass([element class]));
+        continue;
+      }
+      if(!first) [self appendBytes:"," length:1];
+      [self writeValue:element];
+      first = NO;
+    }
+    [self appendBytes:"]" length:1];
+  } else if([value isKindOfClass:[NSDictionary class]]) {
+    
+    [self appendBytes:"{" length:1];
+    __block BOOL first = YES;
+    [value enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
+      
+      if(![MKObjectJSONWriter canWriteValue:obj]) {
+        
+        NSLog(@"Dictionary value for key %@ is of type %@ which is unknown", key, NSStringFromClass([obj class]));
+        return;
+      }
+      if(!first) [self appendBytes:"," length:1];
+      [self writeString:[key description]];
+      [self appendBytes:":" length:1];
+      [self writeValue:obj];
+      first = NO;
+    }];
+    [self appendBytes:"}" length:1];
+  } else if([value respondsToSelector:@selector(objectAsDictionary)]) {
+    
+    [self writeValue:[value objectAsDictionary]];
+  } else {
+    
+    [self appendBytes:"null" length:4];
+  }
+}
+
+@end
 
 @implementation MKObject
 
@@ -92,6 +357,50 @@
   }
 }
 
++ (id)map:(id)data usingClass:(Class) class parallelThreshold:(NSUInteger) threshold {
+  
+  return [self map:data usingClass:class parallelThreshold:threshold workerCount:0];
+}
+
++ (id)map:(id)data usingClass:(Class) class parallelThreshold:(NSUInteger) threshold workerCount:(NSUInteger) workerCount {
+  
+  if(![data isKindOfClass:[NSArray class]] || [data count] < MAX(threshold, 2) || workerCount == 1) {
+    return [self map:data usingClass:class];
+  }
+  
+  NSArray *elements = data;
+  NSUInteger count = elements.count;
+  
+  // a few chunks per core keeps every core busy when elements take uneven time to map
+  // with a worker count, each worker maps one chunk
+  NSUInteger chunkCount = MIN(count, workerCount ? workerCount : [NSProcessInfo processInfo].activeProcessorCount * 4);
+  NSUInteger chunkSize = (count + chunkCount - 1) / chunkCount;
+  chunkCount = (count + chunkSize - 1) / chunkSize;
+  
+  // every chunk writes to its own slots, so no locking is needed
+  __strong id *mappedObjects = (__strong id *) calloc(count, sizeof(id));
+  dispatch_apply(chunkCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t chunk) {
+    
+    @autoreleasepool {
+      
+      NSUInteger end = MIN((chunk + 1) * chunkSize, count);
+      for(NSUInteger index = chunk * chunkSize; index < end; index ++) {
+        mappedObjects[index] = [[class alloc] initWithDictionary:elements[index]];
+      }
+    }
+  });
+  
+  NSMutableArray *returnArray = [NSMutableArray arrayWithCapacity:count];
+  for(NSUInteger index = 0; index < count; index ++) {
+    
+    if(mappedObjects[index]) [returnArray addObject:mappedObjects[index]];
+    mappedObjects[index] = nil;
+  }
+  free(mappedObjects);
+  
+  return returnArray;
+}
+
 - (NSDictionary *)objectAsDictionary {
   
   NSMutableDictionary *dict = [[NSMutableDictionary alloc] initWithCapacity:0];
@@ -140,12 +449,12 @@
           [toMapDict
            enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
              
-             if ([value isKindOfClass:[NSString class]] ||
-                 [value isKindOfClass:[NSNumber class]]) {
-               [toMapDict setValue:obj forKey:key];
+             if ([obj isKindOfClass:[NSString class]] ||
+                 [obj isKindOfClass:[NSNumber class]]) {
+               [mappedDict setValue:obj forKey:key];
              } else if ([obj isKindOfClass:[MKObject class]]) {
-               [toMapDict setValue:[(MKObject *)value objectAsDictionary]
-                            forKey:key];
+               [mappedDict setValue:[(MKObject *)obj objectAsDictionary]
+                             forKey:key];
              } else {
                
                NSLog(@"Property %@ is of type %@ which is unknown",
@@ -215,6 +524,257 @@
     return nil;
 }
 
+#pragma--
+#pragma Mapping plans
+
+-(MKObjectMappingPlan*) mappingPlan {
+  
+  Class class = [self class];
+  
+  pthread_rwlock_rdlock(&MKObjectMappingPlansLock);
+  MKObjectMappingPlan *plan = [MKObjectMappingPlans objectForKey:class];
+  pthread_rwlock_unlock(&MKObjectMappingPlansLock);
+  if(plan) return plan;
+  
+  plan = [self buildMappingPlan];
+  
+  pthread_rwlock_wrlock(&MKObjectMappingPlansLock);
+  if(!MKObjectMappingPlans) {
+    MKObjectMappingPlans = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsOpaqueMemory | NSPointerFunctionsOpaquePersonality
+                                                 valueOptions:NSPointerFunctionsStrongMemory];
+  }
+  [MKObjectMappingPlans setObject:plan forKey:class];
+  pthread_rwlock_unlock(&MKObjectMappingPlansLock);
+  
+  return plan;
+}
+
+-(MKObjectMappingPlan*) buildMappingPlan {
+  
+  MKObjectMappingPlan *plan = [[MKObjectMappingPlan alloc] init];
+  Class class = [self class];
+  
+  NSDictionary *classesForMapping = [self classesForMapping];
+  NSMutableDictionary *mappingsForProperties = [NSMutableDictionary dictionary];
+  NSMutableArray *serializedMappings = [NSMutableArray array];
+  
+  // subclasses first, so that redeclared properties use the most specific declaration
+  for(Class currentClass = class; currentClass && currentClass != [NSObject class]; currentClass = class_getSuperclass(currentClass)) {
+    
+    unsigned int propertyCount = 0;
+    objc_property_t *properties = class_copyPropertyList(currentClass, &propertyCount);
+    for(unsigned int index = 0; index < propertyCount; index ++) {
+      
+      NSString *name = @(property_getName(properties[index]));
+      if(mappingsForProperties[name]) continue;
+      
+      MKObjectPropertyMapping *mapping = [[MKObjectPropertyMapping alloc] init];
+      mapping.name = name;
+      
+      NSString *mappedClassName = classesForMapping[name];
+      if(mappedClassName) mapping.mappedClass = NSClassFromString(mappedClassName);
+      
+      char *ivarName = property_copyAttributeValue(properties[index], "V");
+      if(ivarName) {
+        
+        mapping.ivar = class_getInstanceVariable(currentClass, ivarName);
+        free(ivarName);
+      }
+      
+      char *type = property_copyAttributeValue(properties[index], "T");
+      mapping.type = type ? type[0] : 0;
+      free(type);
+      
+      char *getterName = property_copyAttributeValue(properties[index], "G");
+      mapping.getter = getterName ? sel_registerName(getterName) : NSSelectorFromString(name);
+      free(getterName);
+      
+      char *setterName = property_copyAttributeValue(properties[index], "S");
+      char *readonly = property_copyAttributeValue(properties[index], "R");
+      if(setterName) {
+        mapping.setter = sel_registerName(setterName);
+      } else if(!readonly) {
+        mapping.setter = NSSelectorFromString([NSString stringWithFormat:@"set%@%@:",
+                                               [[name substringToIndex:1] uppercaseString], [name substringFromIndex:1]]);
+      }
+      free(setterName);
+      free(readonly);
+      
+      NSMutableData *jsonKey = [NSMutableData data];
+      [jsonKey appendBytes:"\"" length:1];
+      [jsonKey appendData:[name dataUsingEncoding:NSUTF8StringEncoding]];
+      [jsonKey appendBytes:"\":" length:2];
+      mapping.jsonKey = jsonKey;
+      
+      char *attribute = NULL;
+      if((attribute = property_copyAttributeValue(properties[index], "C"))) {
+        mapping.ownership = 'C';
+      } else if((attribute = property_copyAttributeValue(properties[index], "W"))) {
+        mapping.ownership = 'W';
+      }
+      free(attribute);
+      
+      mappingsForProperties[name] = mapping;
+      if(currentClass == class) [serializedMappings addObject:mapping];
+    }
+    free(properties);
+  }
+  
+  plan.serializedMappings = serializedMappings;
+  
+  SEL kvcSelectors[] = {@selector(setValue:forKey:), @selector(setValue:forUndefinedKey:), @selector(setValuesForKeysWithDictionary:)};
+  for(size_t index = 0; index < sizeof(kvcSelectors) / sizeof(kvcSelectors[0]); index ++) {
+    
+    if([class instanceMethodForSelector:kvcSelectors[index]] != [MKObject instanceMethodForSelector:kvcSelectors[index]]) {
+      
+      plan.usesKeyValueCoding = YES;
+      return plan;
+    }
+  }
+  
+  NSMutableDictionary *mappingsForKeys = [NSMutableDictionary dictionary];
+  [mappingsForProperties enumerateKeysAndObjectsUsingBlock:^(NSString *name, MKObjectPropertyMapping *mapping, BOOL *stop) {
+    
+    MKObjectAddKeyVariants(mappingsForKeys, name, mapping);
+  }];
+  
+  // equivalent keys win over properties of the same name
+  NSMutableDictionary *keyPathMappingsForKeys = [NSMutableDictionary dictionary];
+  [[self equivalentKeys] enumerateKeysAndObjectsUsingBlock:^(NSString *equivalentKey, NSString *propertyName, BOOL *stop) {
+    
+    MKObjectPropertyMapping *mapping = mappingsForProperties[propertyName];
+    if(!mapping) {
+      
+      // not a declared property, KVC decides what to do with it
+      mapping = [[MKObjectPropertyMapping alloc] init];
+      mapping.name = propertyName;
+      NSString *mappedClassName = classesForMapping[propertyName];
+      if(mappedClassName) mapping.mappedClass = NSClassFromString(mappedClassName);
+    }
+    
+    NSMutableArray *components = [[equivalentKey componentsSeparatedByString:@"."] mutableCopy];
+    if(components.count == 1) {
+      
+      [mappingsForKeys removeObjectForKey:equivalentKey];
+      MKObjectAddKeyVariants(mappingsForKeys, equivalentKey, mapping);
+    } else {
+      
+      NSString *firstComponent = components.firstObject;
+      [components removeObjectAtIndex:0];
+      
+      NSMutableArray *keyPathMappings = keyPathMappingsForKeys[firstComponent];
+      if(!keyPathMappings) {
+        
+        keyPathMappings = [NSMutableArray array];
+        MKObjectAddKeyVariants(keyPathMappingsForKeys, firstComponent, keyPathMappings);
+      }
+      [keyPathMappings addObject:@[components, mapping]];
+    }
+  }];
+  
+  plan.mappingsForKeys = mappingsForKeys;
+  plan.keyPathMappingsForKeys = keyPathMappingsForKeys;
+  return plan;
+}
+
+-(void) setValue:(id) value forMapping:(MKObjectPropertyMapping*) mapping {
+  
+  if(value == [NSNull null]) value = nil;
+  
+  if(mapping.mappedClass && value) {
+    value = [MKObject map:value usingClass:mapping.mappedClass];
+  }
+  
+  if(!mapping.ivar) {
+    
+    [super setValue:value forKey:mapping.name];
+    return;
+  }
+  
+  // through the setter when there is one, so custom setters and KVO see the change
+  SEL setter = mapping.setter;
+  void *location = (uint8_t*) (__bridge void*) self + ivar_getOffset(mapping.ivar);
+  
+  if(mapping.type == '@') {
+    
+    if(setter) {
+      
+      ((void (*)(id, SEL, id)) objc_msgSend)(self, setter, value);
+      return;
+    }
+    
+    if(mapping.ownership == 'C') value = [value copy];
+    
+    if(mapping.ownership == 'W') {
+      *(__weak id*) location = value;
+    } else {
+      *(__strong id*) location = value;
+    }
+    return;
+  }
+  
+  // scalars take numbers or numeric strings, like KVC. nil leaves the default value alone
+  if(![value respondsToSelector:@selector(longLongValue)]) return;
+  
+#define MKObjectSetScalar(scalarType, scalarValue) \
+  if(setter) { ((void (*)(id, SEL, scalarType)) objc_msgSend)(self, setter, (scalarValue)); } \
+  else { *(scalarType*) location = (scalarValue); }
+  
+  switch (mapping.type) {
+    case 'c': MKObjectSetScalar(char, [value isKindOfClass:[NSNumber class]] ? [value charValue] : [value boolValue]); break;
+    case 'B': MKObjectSetScalar(bool, [value boolValue]); break;
+    case 's': MKObjectSetScalar(short, (short) [value longLongValue]); break;
+    case 'i': MKObjectSetScalar(int, (int) [value longLongValue]); break;
+    case 'l': MKObjectSetScalar(long, (long) [value longLongValue]); break;
+    case 'q': MKObjectSetScalar(long long, [value longLongValue]); break;
+    case 'C': MKObjectSetScalar(unsigned char, (unsigned char) [value longLongValue]); break;
+    case 'S': MKObjectSetScalar(unsigned short, (unsigned short) [value longLongValue]); break;
+    case 'I': MKObjectSetScalar(unsigned int, (unsigned int) [value longLongValue]); break;
+    case 'L': MKObjectSetScalar(unsigned long, (unsigned long) [value longLongValue]); break;
+    case 'Q': MKObjectSetScalar(unsigned long long, [value isKindOfClass:[NSNumber class]] ?
+                                [value unsignedLongLongValue] : (unsigned long long) [value longLongValue]); break;
+    case 'f': MKObjectSetScalar(float, [value floatValue]); break;
+    case 'd': MKObjectSetScalar(double, [value doubleValue]); break;
+    default: [super setValue:value forKey:mapping.name]; break;
+  }
+  
+#undef MKObjectSetScalar
+}
+
+-(void) mapDictionary:(NSDictionary*) jsonObject usingPlan:(MKObjectMappingPlan*) plan {
+  
+  [jsonObject enumerateKeysAndObjectsUsingBlock:^(NSString *key, id value, BOOL *stop) {
+    
+    MKObjectPropertyMapping *mapping = plan.mappingsForKeys[key];
+    if(mapping) {
+      
+      [self setValue:value forMapping:mapping];
+      return;
+    }
+    
+    NSArray *keyPathMappings = plan.keyPathMappingsForKeys[key];
+    if(keyPathMappings) {
+      
+      for(NSArray *keyPathMapping in keyPathMappings) {
+        
+        id innerValue = value;
+        for(NSString *component in keyPathMapping[0]) {
+          innerValue = MKObjectValueForKeyVariants(innerValue, component);
+        }
+        [self setValue:innerValue forMapping:keyPathMapping[1]];
+      }
+      return;
+    }
+    
+    if(value && value != [NSNull null] && key.length > 0) {
+      
+      NSString *camelCaseKey = [key stringByReplacingCharactersInRange:NSMakeRange(0, 1)
+                                                            withString:[[key substringToIndex:1] lowercaseString]];
+      self.unmappedEntries[camelCaseKey] = value;
+    }
+  }];
+}
+
 #pragma--
 #pragma KVC stuff
 
@@ -224,8 +784,16 @@
   
   if ((self = [self init])) {
     self.unmappedEntries = [NSMutableDictionary dictionary];
-    jsonObject = [self transformedJSONObjectForJSONObject:jsonObject];
-    [self setValuesForKeysWithDictionary:jsonObject];
+    
+    MKObjectMappingPlan *plan = [self mappingPlan];
+    if(plan.usesKeyValueCoding) {
+      
+      jsonObject = [self transformedJSONObjectForJSONObject:jsonObject];
+      [self setValuesForKeysWithDictionary:jsonObject];
+    } else {
+      
+      [self mapDictionary:jsonObject usingPlan:plan];
+    }
     [self mappingDidComplete];
   }
   return self;
@@ -315,13 +883,67 @@
 #pragma--
 #pragma JSON stuff
 
+// Same properties as objectAsDictionary, written straight from the getters without boxing or an intermediate dictionary
+-(void) writeJSONWithWriter:(MKObjectJSONWriter*) writer {
+  
+  MKObjectMappingPlan *plan = [self mappingPlan];
+  
+  [writer appendBytes:"{" length:1];
+  BOOL first = YES;
+  for(MKObjectPropertyMapping *mapping in plan.serializedMappings) {
+    
+    id value = nil;
+    if(mapping.type == '@') {
+      
+      value = ((id (*)(id, SEL)) objc_msgSend)(self, mapping.getter);
+      if(!value || value == [NSNull null]) continue;
+      if(![MKObjectJSONWriter canWriteValue:value]) {
+        
+        NSLog(@"Property %@ is of type %@ which is unknown", mapping.name, NSStringFromClass([value class]));
+        continue;
+      }
+    }
+    
+    if(!first) [writer appendBytes:"," length:1];
+    first = NO;
+    [writer appendBytes:mapping.jsonKey.bytes length:mapping.jsonKey.length];
+    
+    switch (mapping.type) {
+      case '@': [writer writeValue:value]; break;
+      case 'B': [writer writeBool:((bool (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'c': [writer writeInteger:((char (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 's': [writer writeInteger:((short (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'i': [writer writeInteger:((int (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'l': [writer writeInteger:((long (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'q': [writer writeInteger:((long long (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'C': [writer writeUnsignedInteger:((unsigned char (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'S': [writer writeUnsignedInteger:((unsigned short (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'I': [writer writeUnsignedInteger:((unsigned int (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'L': [writer writeUnsignedInteger:((unsigned long (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'Q': [writer writeUnsignedInteger:((unsigned long long (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'f': [writer writeFloat:((float (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      case 'd': [writer writeDouble:((double (*)(id, SEL)) objc_msgSend)(self, mapping.getter)]; break;
+      default: {
+        
+        // other scalar types go through KVC boxing, structs have no JSON representation
+        id boxedValue = [self valueForKey:mapping.name];
+        [writer writeValue:[boxedValue isKindOfClass:[NSNumber class]] ? boxedValue : nil];
+      }
+    }
+  }
+  [writer appendBytes:"}" length:1];
+}
+
+-(NSData*) jsonData {
+  
+  MKObjectJSONWriter *writer = [[MKObjectJSONWriter alloc] init];
+  [self writeJSONWithWriter:writer];
+  return writer.buffer;
+}
+
 - (NSString *)jsonString {
-  NSError *error = nil;
-  NSData *jsonData =
-  [NSJSONSerialization dataWithJSONObject:[self objectAsDictionary]
-                                  options:0
-                                    error:&error];
-  return [[NSString alloc] initWithData:jsonData encoding:NSUTF8StringEncoding];
+  
+  return [[NSString alloc] initWithData:[self jsonData] encoding:NSUTF8StringEncoding];
 }
 
 - (NSString *)prettyJsonString {
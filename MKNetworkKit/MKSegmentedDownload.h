@@ -0,0 +1,50 @@
+//
+//  MKSegmentedDownload.h
+//  MKNetworkKit
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+@class MKNetworkRequest;
+
+/*!
+ *  @abstract Downloads a large file as byte ranges fetched in parallel and written in place at the request's downloadPath
+ *
+ *  @discussion
+ *	The pieces already written are recorded next to the file, along with the resource's ETag (or Last-Modified).
+ *  Downloading the same resource to the same path again fetches only the missing pieces.
+ *  Every range is requested with If-Range, so pieces of a resource that changed are never mixed with the old ones.
+ *  A piece that fails on a dropped connection or a retryable status is requested again a couple of times before the download fails.
+ */
+@interface MKSegmentedDownload : NSObject
+
+-(instancetype) initWithRequest:(MKNetworkRequest*) request
+                        session:(NSURLSession*) session
+                   segmentCount:(NSUInteger) segmentCount;
+
+// Called instead of downloading when the server doesn't serve byte ranges of a known length
+@property (copy) void (^rangesUnsupportedHandler)(MKNetworkRequest *request);
+
+-(void) start;
+-(void) cancel;
+
+@end
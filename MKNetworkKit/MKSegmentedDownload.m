@@ -0,0 +1,417 @@
+//
+//  MKSegmentedDownload.m
+//  MKNetworkKit
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import "MKSegmentedDownload.h"
+
+#import "MKNetworkRequest.h"
+
+#import "NSDictionary+MKNKAdditions.h"
+
+// a lost connection costs at most one piece per segment
+static unsigned long long const kMKSegmentedDownloadPieceSize = 8 * 1024 * 1024;
+static NSUInteger const kMKSegmentedDownloadCopyBufferSize = 1024 * 1024;
+
+// a piece that fails transiently is requested again, after a growing delay, before the whole download fails
+static NSUInteger const kMKSegmentedDownloadMaximumPieceAttempts = 3;
+static NSTimeInterval const kMKSegmentedDownloadPieceRetryDelay = 0.25;
+
+NSString *const kMKSegmentedDownloadStateExtension = @"mknkdownload";
+NSString *const kMKSegmentedDownloadValidatorKey = @"validator";
+NSString *const kMKSegmentedDownloadLengthKey = @"length";
+NSString *const kMKSegmentedDownloadCompletedPiecesKey = @"completedPieces";
+
+@interface MKNetworkRequest (/*Private Methods*/)
+@property (readwrite) NSHTTPURLResponse *response;
+@property (readwrite) NSError *error;
+@property (readwrite) MKNKRequestState state;
+@property (readwrite) NSURLSessionTask *task;
+-(void) setProgressValue:(CGFloat) updatedValue;
+@end
+
+@interface MKSegmentedDownload (/*Private Methods*/)
+@property MKNetworkRequest *request;
+@property NSURLSession *session;
+@property NSUInteger segmentCount;
+@property NSString *statePath;
+
+// everything below is guarded by the assembly queue, which also writes the pieces into the file
+@property dispatch_queue_t assemblyQueue;
+@property NSHTTPURLResponse *probeResponse;
+@property NSString *validator; // strong ETag, or Last-Modified, nil when the download can't be resumed
+@property unsigned long long contentLength;
+@property NSUInteger pieceCount;
+@property NSMutableIndexSet *completedPieces;
+@property NSMutableIndexSet *pendingPieces;
+@property NSMutableArray *runningTasks;
+@property NSCountedSet *pieceFailures; // piece -> number of failed attempts
+@property BOOL finished;
+@end
+
+// A dropped connection, a short body or a busy server, another request for the same range may succeed
+static BOOL MKNKIsTransientPieceFailure(NSError *error, NSHTTPURLResponse *response, BOOL rangeMatches) {
+
+  if(error) {
+
+    if(![error.domain isEqualToString:NSURLErrorDomain]) return NO;
+
+    switch (error.code) {
+      case NSURLErrorTimedOut:
+      case NSURLErrorNetworkConnectionLost:
+      case NSURLErrorCannotConnectToHost:
+      case NSURLErrorCannotFindHost:
+      case NSURLErrorDNSLookupFailed:
+      case NSURLErrorNotConnectedToInternet:
+        return YES;
+      default:
+        return NO;
+    }
+  }
+
+  switch (response.statusCode) {
+    case 206:
+      return rangeMatches; // the body was cut short
+    case 408:
+    case 429:
+    case 500:
+    case 502:
+    case 503:
+    case 504:
+      return YES;
+    default:
+      return NO;
+  }
+}
+
+@implementation MKSegmentedDownload
+
+-(instancetype) initWithRequest:(MKNetworkRequest*) request
+                        session:(NSURLSession*) session
+                   segmentCount:(NSUInteger) segmentCount {
+
+  if(self = [super init]) {
+
+    self.request = request;
+    self.session = session;
+    self.segmentCount = MAX(segmentCount, 1);
+    self.statePath = [request.downloadPath stringByAppendingPathExtension:kMKSegmentedDownloadStateExtension];
+    self.assemblyQueue = dispatch_queue_create("com.mknetworkkit.segmenteddownload", DISPATCH_QUEUE_SERIAL);
+    self.runningTasks = [NSMutableArray array];
+    self.pieceFailures = [NSCountedSet set];
+  }
+
+  return self;
+}
+
+-(void) start {
+
+  NSMutableURLRequest *probeRequest = self.request.request;
+  probeRequest.HTTPMethod = @"HEAD";
+
+  NSURLSessionDataTask *probeTask =
+  [self.session dataTaskWithRequest:probeRequest completionHandler:^(NSData *data, NSURLResponse *response, NSError *error) {
+
+    dispatch_async(self.assemblyQueue, ^{
+      [self startWithProbeResponse:(NSHTTPURLResponse*) response error:error];
+    });
+  }];
+
+  self.request.task = probeTask;
+  [probeTask resume];
+}
+
+-(void) cancel {
+
+  // the pieces written so far stay recorded, the next download of the same resource continues from them
+  dispatch_async(self.assemblyQueue, ^{
+
+    self.finished = YES;
+    [self.request.task cancel];
+    [self.runningTasks makeObjectsPerformSelector:@selector(cancel)];
+    [self.runningTasks removeAllObjects];
+  });
+}
+
+#pragma mark -
+#pragma mark Assembly queue
+
+-(void) startWithProbeResponse:(NSHTTPURLResponse*) response error:(NSError*) error {
+
+  if(self.finished) return;
+
+  NSDictionary *headerFields = response.allHeaderFields;
+  NSString *acceptRanges = [headerFields objectForCaseInsensitiveKey:@"Accept-Ranges"];
+  long long contentLength = response.expectedContentLength;
+
+  if(error || response.statusCode >= 300 || contentLength <= 0 ||
+     [acceptRanges.lowercaseString rangeOfString:@"bytes"].location == NSNotFound) {
+
+    self.finished = YES;
+    if(self.rangesUnsupportedHandler) self.rangesUnsupportedHandler(self.request);
+    return;
+  }
+
+  // If-Range needs a strong validator
+  NSString *eTag = [headerFields objectForCaseInsensitiveKey:@"ETag"];
+  self.validator = [eTag hasPrefix:@"W/"] ? [headerFields objectForCaseInsensitiveKey:@"Last-Modified"] : eTag;
+  if(!self.validator) self.validator = [headerFields objectForCaseInsensitiveKey:@"Last-Modified"];
+
+  self.probeResponse = response;
+  self.contentLength = (unsigned long long) contentLength;
+  self.pieceCount = (NSUInteger) ((self.contentLength + kMKSegmentedDownloadPieceSize - 1) / kMKSegmentedDownloadPieceSize);
+  self.completedPieces = [NSMutableIndexSet indexSet];
+
+  NSFileManager *fileManager = [[NSFileManager alloc] init];
+  NSDictionary *savedState = [NSDictionary dictionaryWithContentsOfFile:self.statePath];
+  BOOL resumes = self.validator &&
+  [savedState[kMKSegmentedDownloadValidatorKey] isEqualToString:self.validator] &&
+  [savedState[kMKSegmentedDownloadLengthKey] unsignedLongLongValue] == self.contentLength &&
+  [fileManager fileExistsAtPath:self.request.downloadPath];
+
+  if(resumes) {
+
+    for(NSNumber *piece in savedState[kMKSegmentedDownloadCompletedPiecesKey]) {
+      if(piece.unsignedIntegerValue < self.pieceCount) [self.completedPieces addIndex:piece.unsignedIntegerValue];
+    }
+  } else {
+
+    // the file is allocated up front so that pieces can be written in place as they arrive, in any order
+    [fileManager removeItemAtPath:self.statePath error:nil];
+    NSFileHandle *fileHandle = nil;
+    if([fileManager createFileAtPath:self.request.downloadPath contents:nil attributes:nil]) {
+      fileHandle = [NSFileHandle fileHandleForWritingAtPath:self.request.downloadPath];
+    }
+
+    if(!fileHandle) {
+
+      NSLog(@"Failed to create file at requested download path [%@]", self.request.downloadPath);
+      [self failWithError:[NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:nil]];
+      return;
+    }
+
+    [fileHandle truncateFileAtOffset:self.contentLength];
+    [fileHandle closeFile];
+    [self saveState];
+  }
+
+  self.pendingPieces = [NSMutableIndexSet indexSetWithIndexesInRange:NSMakeRange(0, self.pieceCount)];
+  [self.pendingPieces removeIndexes:self.completedPieces];
+
+  if(self.pendingPieces.count == 0) {
+
+    [self finish];
+    return;
+  }
+
+  for(NSUInteger segment = 0; segment < self.segmentCount; segment ++) {
+    [self startNextPiece];
+  }
+}
+
+-(void) startNextPiece {
+
+  NSUInteger piece = self.pendingPieces.firstIndex;
+  if(piece == NSNotFound) return;
+  [self.pendingPieces removeIndex:piece];
+
+  unsigned long long firstByte = piece * kMKSegmentedDownloadPieceSize;
+  unsigned long long lastByte = MIN(firstByte + kMKSegmentedDownloadPieceSize, self.contentLength) - 1;
+
+  NSMutableURLRequest *pieceRequest = self.request.request;
+  [pieceRequest setValue:[NSString stringWithFormat:@"bytes=%llu-%llu", firstByte, lastByte] forHTTPHeaderField:@"Range"];
+  if(self.validator) [pieceRequest setValue:self.validator forHTTPHeaderField:@"If-Range"];
+
+  __block NSURLSessionDownloadTask *pieceTask = nil;
+  pieceTask = [self.session downloadTaskWithRequest:pieceRequest completionHandler:^(NSURL *location, NSURLResponse *response, NSError *error) {
+
+    // the downloaded file is removed when this handler returns, it is moved aside and written in place later
+    NSString *piecePath = nil;
+    if(location) {
+
+      piecePath = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                   [NSString stringWithFormat:@"%@.mknkpiece", [NSUUID UUID].UUIDString]];
+      if(![[NSFileManager defaultManager] moveItemAtPath:location.path toPath:piecePath error:nil]) piecePath = nil;
+    }
+
+    dispatch_async(self.assemblyQueue, ^{
+
+      [self.runningTasks removeObjectIdenticalTo:pieceTask];
+      [self piece:piece firstByte:firstByte lastByte:lastByte didDownloadToPath:piecePath
+         response:(NSHTTPURLResponse*) response error:error];
+      pieceTask = nil;
+    });
+  }];
+
+  [self.runningTasks addObject:pieceTask];
+  [pieceTask resume];
+}
+
+-(void) piece:(NSUInteger) piece
+    firstByte:(unsigned long long) firstByte
+     lastByte:(unsigned long long) lastByte
+didDownloadToPath:(NSString*) piecePath
+     response:(NSHTTPURLResponse*) response
+        error:(NSError*) error {
+
+  NSFileManager *fileManager = [[NSFileManager alloc] init];
+
+  if(self.finished) {
+
+    if(piecePath) [fileManager removeItemAtPath:piecePath error:nil];
+    return;
+  }
+
+  NSString *contentRange = [response.allHeaderFields objectForCaseInsensitiveKey:@"Content-Range"];
+  NSString *expectedContentRange = [NSString stringWithFormat:@"bytes %llu-%llu/", firstByte, lastByte];
+  unsigned long long pieceLength = piecePath ? [[fileManager attributesOfItemAtPath:piecePath error:nil] fileSize] : 0;
+
+  BOOL rangeMatches = [contentRange hasPrefix:expectedContentRange];
+  if(error || response.statusCode != 206 || !rangeMatches || pieceLength != lastByte - firstByte + 1) {
+
+    if(piecePath) [fileManager removeItemAtPath:piecePath error:nil];
+
+    if(MKNKIsTransientPieceFailure(error, response, rangeMatches) &&
+       [self.pieceFailures countForObject:@(piece)] + 1 < kMKSegmentedDownloadMaximumPieceAttempts) {
+
+      [self.pieceFailures addObject:@(piece)];
+      [self retryPiece:piece];
+      return;
+    }
+
+    // a full response to a ranged request means If-Range failed, the resource changed and the saved pieces are useless
+    if(!error && response.statusCode == 200) [fileManager removeItemAtPath:self.statePath error:nil];
+
+    if(!error) {
+
+      NSMutableDictionary *userInfo = [NSMutableDictionary dictionary];
+      if(response) userInfo[@"response"] = response;
+      error = [NSError errorWithDomain:@"com.mknetworkkit.httperrordomain" code:response.statusCode userInfo:userInfo];
+    }
+
+    [self failWithError:error];
+    return;
+  }
+
+  NSError *writeError = nil;
+  BOOL written = [self writePieceAtPath:piecePath toOffset:firstByte error:&writeError];
+  [fileManager removeItemAtPath:piecePath error:nil];
+  if(!written) {
+
+    NSLog(@"Failed to write downloaded range to requested path [%@] with error %@", self.request.downloadPath, writeError);
+    [self failWithError:writeError];
+    return;
+  }
+
+  [self.completedPieces addIndex:piece];
+  [self saveState];
+  [self.request setProgressValue:(CGFloat) self.completedPieces.count / self.pieceCount];
+
+  if(self.completedPieces.count == self.pieceCount) {
+
+    [self finish];
+  } else {
+
+    [self startNextPiece];
+  }
+}
+
+-(void) retryPiece:(NSUInteger) piece {
+
+  NSTimeInterval delay = kMKSegmentedDownloadPieceRetryDelay * [self.pieceFailures countForObject:@(piece)];
+  dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t) (delay * NSEC_PER_SEC)), self.assemblyQueue, ^{
+
+    if(self.finished) return;
+    [self.pendingPieces addIndex:piece];
+    [self startNextPiece];
+  });
+}
+
+-(BOOL) writePieceAtPath:(NSString*) piecePath toOffset:(unsigned long long) offset error:(NSError**) error {
+
+  NSFileHandle *reader = [NSFileHandle fileHandleForReadingAtPath:piecePath];
+  NSFileHandle *writer = [NSFileHandle fileHandleForWritingAtPath:self.request.downloadPath];
+  if(!reader || !writer) {
+
+    if(error) *error = [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileWriteUnknownError userInfo:nil];
+    return NO;
+  }
+
+  [writer seekToFileOffset:offset];
+
+  BOOL copied = NO;
+  while(!copied) {
+
+    @autoreleasepool {
+
+      NSData *chunk = [reader readDataOfLength:kMKSegmentedDownloadCopyBufferSize];
+      if(chunk.length > 0) {
+        [writer writeData:chunk];
+      } else {
+        copied = YES;
+      }
+    }
+  }
+
+  [reader closeFile];
+  [writer synchronizeFile]; // the piece is recorded as written right after this
+  [writer closeFile];
+  return YES;
+}
+
+-(void) saveState {
+
+  if(!self.validator) return;
+
+  NSMutableArray *completedPieces = [NSMutableArray arrayWithCapacity:self.completedPieces.count];
+  [self.completedPieces enumerateIndexesUsingBlock:^(NSUInteger piece, BOOL *stop) {
+    [completedPieces addObject:@(piece)];
+  }];
+
+  NSDictionary *state = @{kMKSegmentedDownloadValidatorKey : self.validator,
+                          kMKSegmentedDownloadLengthKey : @(self.contentLength),
+                          kMKSegmentedDownloadCompletedPiecesKey : completedPieces};
+  [state writeToFile:self.statePath atomically:YES];
+}
+
+-(void) finish {
+
+  self.finished = YES;
+  [[NSFileManager defaultManager] removeItemAtPath:self.statePath error:nil];
+
+  self.request.response = self.probeResponse;
+  self.request.state = MKNKRequestStateCompleted;
+}
+
+-(void) failWithError:(NSError*) error {
+
+  self.finished = YES;
+  [self.runningTasks makeObjectsPerformSelector:@selector(cancel)];
+  [self.runningTasks removeAllObjects];
+
+  if(self.request.state == MKNKRequestStateCancelled) return;
+
+  self.request.error = error;
+  self.request.state = MKNKRequestStateError;
+}
+
+@end
@@ -0,0 +1,602 @@
+//
+//  MKNKBenchmarks.m
+//  MKNetworkKitBenchmarks
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import "MKNKHarness.h"
+
+#import "MKCache.h"
+#import "MKCacheMetadata.h"
+#import "MKCachedResponse.h"
+#import "NSDate+RFC1123.h"
+#import "NSDictionary+MKNKAdditions.h"
+
+@interface MKNetworkHost (/*Private Methods*/)
+@property MKCache *responseCache;
+@property (readonly) NSURLSession *defaultSession;
+-(void) registerRequest:(MKNetworkRequest*) request forTask:(NSURLSessionTask*) task inSession:(NSURLSession*) session;
+-(MKNetworkRequest*) requestForTask:(NSURLSessionTask*) task inSession:(NSURLSession*) session;
+-(MKNetworkRequest*) unregisterTask:(NSURLSessionTask*) task inSession:(NSURLSession*) session;
+@end
+
+@interface MKNetworkRequest (/*Private Methods*/)
+-(NSURLRequest*) urlRequest;
+-(NSURLRequest*) writeUploadBodyToFile:(NSString*) filePath error:(NSError**) error;
+@end
+
+// A typical API model, scalars, strings, an array and a renamed key
+@interface MKNKBenchmarkItem : MKObject
+@property NSString *identifier;
+@property NSString *name;
+@property NSInteger count;
+@property double score;
+@property BOOL active;
+@property NSArray *tags;
+@end
+
+@implementation MKNKBenchmarkItem
+
+-(NSDictionary*) equivalentKeys {
+
+  return @{@"id" : @"identifier"};
+}
+
+@end
+
+static NSDictionary *MKNKBenchmarkItemDictionary(NSUInteger index) {
+
+  return @{@"id" : [NSString stringWithFormat:@"item-%lu", (unsigned long) index],
+           @"name" : [NSString stringWithFormat:@"Item number %lu", (unsigned long) index],
+           @"count" : @(index),
+           @"score" : @(index / 7.0),
+           @"active" : @(index % 2 == 0),
+           @"tags" : @[@"alpha", @"beta", @"gamma"]};
+}
+
+static NSDictionary *MKNKLatencyResults(NSArray *latencies) {
+
+  NSArray *sortedLatencies = [latencies sortedArrayUsingSelector:@selector(compare:)];
+  return @{@"p50" : @(MKNKPercentileOfSamples(sortedLatencies, 0.5)),
+           @"p99" : @(MKNKPercentileOfSamples(sortedLatencies, 0.99)),
+           @"max" : @(MKNKPercentileOfSamples(sortedLatencies, 1.0))};
+}
+
+#pragma mark -
+#pragma mark Host
+
+// Every delegate callback looks its request up by session and task identifier
+// The cost per lookup should stay flat however many tasks are in flight
+static void MKNKRunRegistryBenchmarks(MKNKHarness *harness) {
+
+  NSUInteger const lookupCount = 100000;
+  NSTimeInterval baselineLookupDuration = 0;
+
+  for(NSNumber *concurrency in @[@1, @16, @256]) {
+
+    MKNetworkHost *host = [harness host];
+    NSURLSession *session = host.defaultSession;
+    NSUInteger taskCount = concurrency.unsignedIntegerValue;
+
+    // tasks that are never resumed, the registry only needs their identifiers
+    NSMutableArray *tasks = [NSMutableArray arrayWithCapacity:taskCount];
+    NSMutableArray *requests = [NSMutableArray arrayWithCapacity:taskCount];
+    for(NSUInteger index = 0; index < taskCount; index ++) {
+
+      MKNetworkRequest *request = [host requestWithPath:@"/registry" params:@{@"request" : @(index)}];
+      NSURLSessionTask *task = [session dataTaskWithRequest:request.request];
+      [host registerRequest:request forTask:task inSession:session];
+      [tasks addObject:task];
+      [requests addObject:request];
+    }
+
+    __block BOOL allFound = YES;
+    NSTimeInterval roundDuration = MKNKMeasure(lookupCount / taskCount, ^{
+
+      [tasks enumerateObjectsUsingBlock:^(NSURLSessionTask *task, NSUInteger idx, BOOL *stop) {
+        if([host requestForTask:task inSession:session] != requests[idx]) allFound = NO;
+      }];
+    });
+    NSTimeInterval lookupDuration = roundDuration / taskCount;
+    if(baselineLookupDuration == 0) baselineLookupDuration = lookupDuration;
+
+    for(NSURLSessionTask *task in tasks) {
+
+      [host unregisterTask:task inSession:session];
+      [task cancel];
+    }
+    [session invalidateAndCancel];
+
+    [harness recordBenchmark:@"host.registry"
+                  parameters:@{@"concurrency" : concurrency, @"lookups" : @(lookupCount)}
+                     results:@{@"secondsPerLookup" : @(lookupDuration),
+                               @"relativeToConcurrency1" : @(lookupDuration / baselineLookupDuration)}];
+    [harness check:allFound name:[NSString stringWithFormat:@"host.registry.concurrency%@.finds", concurrency] detail:nil];
+  }
+}
+
+void MKNKRunHostBenchmarks(MKNKHarness *harness) {
+
+  NSUInteger const requestCount = 256;
+  MKNKLoopbackScenario *scenario = [MKNKLoopbackScenario scenarioWithPayloadSize:16 * 1024 latency:0.005];
+  [harness.server setScenario:scenario forPath:@"/throughput"];
+
+  for(NSNumber *concurrency in @[@1, @4, @16, @64]) {
+
+    [harness.server resetRequestLog];
+    MKNetworkHost *host = [harness host];
+    host.maximumConcurrentRequests = concurrency.unsignedIntegerValue;
+
+    NSMutableArray *requests = [NSMutableArray arrayWithCapacity:requestCount];
+    for(NSUInteger index = 0; index < requestCount; index ++) {
+      [requests addObject:[host requestWithPath:@"/throughput" params:@{@"request" : @(index)}]];
+    }
+
+    NSTimeInterval startTime = [NSProcessInfo processInfo].systemUptime;
+    BOOL finished = [harness runRequests:requests onHost:host timeout:120];
+    NSTimeInterval duration = [NSProcessInfo processInfo].systemUptime - startTime;
+
+    NSMutableArray *latencies = [NSMutableArray arrayWithCapacity:requestCount];
+    NSUInteger succeededCount = 0;
+    for(MKNetworkRequest *request in requests) {
+
+      if(request.state == MKNKRequestStateCompleted && [request.responseData isEqualToData:scenario.payload]) succeededCount ++;
+      NSTimeInterval latency = [harness latencyOfRequest:request];
+      if(latency >= 0) [latencies addObject:@(latency)];
+    }
+
+    MKNetworkHostMetrics *metrics = [host metricsSnapshot];
+    NSMutableDictionary *results = [MKNKLatencyResults(latencies) mutableCopy];
+    results[@"duration"] = @(duration);
+    results[@"requestsPerSecond"] = @(requestCount / duration);
+    results[@"histogramP50"] = @([MKNetworkHostMetrics percentile:0.5 ofHistogram:metrics.totalDurationHistogram]);
+    results[@"histogramP99"] = @([MKNetworkHostMetrics percentile:0.99 ofHistogram:metrics.totalDurationHistogram]);
+    results[@"hostMetrics"] = [metrics dictionaryRepresentation];
+
+    [harness recordBenchmark:@"host.throughput"
+                  parameters:@{@"concurrency" : concurrency, @"requests" : @(requestCount),
+                               @"payloadSize" : @(scenario.payloadSize), @"serverLatency" : @(scenario.latency)}
+                     results:results];
+
+    NSString *checkName = [NSString stringWithFormat:@"host.throughput.concurrency%@", concurrency];
+    [harness check:finished && succeededCount == requestCount
+              name:checkName
+            detail:[NSString stringWithFormat:@"%lu of %lu requests completed with the payload",
+                     (unsigned long) succeededCount, (unsigned long) requestCount]];
+    [harness check:[harness.server requestsForPath:@"/throughput"].count == requestCount
+              name:[checkName stringByAppendingString:@".serverRequests"]
+            detail:nil];
+  }
+
+  // errors are answered as fast as successes, failures shouldn't slow the rest down
+  MKNKLoopbackScenario *flakyScenario = [MKNKLoopbackScenario scenarioWithPayloadSize:16 * 1024 latency:0.005];
+  flakyScenario.errorRate = 0.1;
+  [harness.server setScenario:flakyScenario forPath:@"/flaky"];
+  [harness.server resetRequestLog];
+
+  MKNetworkHost *host = [harness host];
+  host.maximumConcurrentRequests = 16;
+  NSMutableArray *requests = [NSMutableArray arrayWithCapacity:requestCount];
+  for(NSUInteger index = 0; index < requestCount; index ++) {
+    [requests addObject:[host requestWithPath:@"/flaky" params:@{@"request" : @(index)}]];
+  }
+
+  NSTimeInterval startTime = [NSProcessInfo processInfo].systemUptime;
+  BOOL finished = [harness runRequests:requests onHost:host timeout:120];
+  NSTimeInterval duration = [NSProcessInfo processInfo].systemUptime - startTime;
+
+  NSUInteger failedCount = [requests indexesOfObjectsPassingTest:^BOOL(MKNetworkRequest *request, NSUInteger idx, BOOL *stop) {
+    return request.state == MKNKRequestStateError;
+  }].count;
+  NSUInteger expectedFailedCount = (NSUInteger) (requestCount * flakyScenario.errorRate);
+
+  [harness recordBenchmark:@"host.errors"
+                parameters:@{@"concurrency" : @16, @"requests" : @(requestCount), @"errorRate" : @(flakyScenario.errorRate)}
+                   results:@{@"duration" : @(duration), @"requestsPerSecond" : @(requestCount / duration),
+                             @"failedRequests" : @(failedCount), @"hostMetrics" : [[host metricsSnapshot] dictionaryRepresentation]}];
+  [harness check:finished && failedCount == expectedFailedCount
+            name:@"host.errors.failWithoutRetries"
+          detail:[NSString stringWithFormat:@"%lu failed, %lu expected", (unsigned long) failedCount, (unsigned long) expectedFailedCount]];
+
+  MKNKRunRegistryBenchmarks(harness);
+}
+
+#pragma mark -
+#pragma mark Cache
+
+// What the host read from a response before MKCacheMetadata, one header lookup and Cache-Control split per accessor
+// Copied from the NSHTTPURLResponse category it replaced, with max-age read as a number
+typedef struct {
+  BOOL isContentTypeImage;
+  BOOL hasDoNotCacheDirective;
+  BOOL hasHTTPCacheHeaders;
+  BOOL hasRequiredRevalidationHeaders;
+  NSTimeInterval expiryTimeFromNow;
+} MKNKLegacyCacheHeaders;
+
+static NSInteger MKNKLegacyMaxAge(NSDictionary *headerFields) {
+
+  NSString *cacheControl = [headerFields objectForCaseInsensitiveKey:@"Cache-Control"];
+  for(NSString *substring in [cacheControl componentsSeparatedByString:@","]) {
+
+    if([substring.lowercaseString rangeOfString:@"max-age"].location != NSNotFound) {
+
+      NSArray *array = [substring componentsSeparatedByString:@"="];
+      if(array.count > 1) return [array[1] integerValue];
+    }
+  }
+  return 0;
+}
+
+static MKNKLegacyCacheHeaders MKNKReadLegacyCacheHeaders(NSDictionary *headerFields) {
+
+  MKNKLegacyCacheHeaders headers;
+
+  NSString *contentType = [headerFields objectForCaseInsensitiveKey:@"Content-Type"];
+  headers.isContentTypeImage = [contentType.lowercaseString rangeOfString:@"image"].location != NSNotFound;
+
+  NSString *cacheControl = [headerFields objectForCaseInsensitiveKey:@"Cache-Control"];
+  headers.hasDoNotCacheDirective = cacheControl &&
+  ([cacheControl.lowercaseString rangeOfString:@"no-cache"].location != NSNotFound || MKNKLegacyMaxAge(headerFields) == 0);
+
+  NSString *eTag = [headerFields objectForCaseInsensitiveKey:@"ETag"];
+  NSString *lastModified = [headerFields objectForCaseInsensitiveKey:@"Last-Modified"];
+  headers.hasHTTPCacheHeaders = [headerFields objectForCaseInsensitiveKey:@"Cache-Control"] || eTag || lastModified;
+  headers.hasRequiredRevalidationHeaders = [headerFields objectForCaseInsensitiveKey:@"ETag"] ||
+  [headerFields objectForCaseInsensitiveKey:@"Last-Modified"];
+
+  NSDate *expiryDate = [NSDate dateFromRFC1123:[headerFields objectForCaseInsensitiveKey:@"Expires"]];
+  if(!expiryDate) {
+
+    for(NSString *substring in [[headerFields objectForCaseInsensitiveKey:@"Cache-Control"] componentsSeparatedByString:@","]) {
+
+      if([substring.lowercaseString rangeOfString:@"max-age"].location != NSNotFound) {
+
+        NSArray *array = [substring componentsSeparatedByString:@"="];
+        if(array.count > 1) expiryDate = [[NSDate date] dateByAddingTimeInterval:[array[1] intValue]];
+      }
+      if([substring.lowercaseString rangeOfString:@"no-cache"].location != NSNotFound) expiryDate = [NSDate date];
+    }
+  }
+  headers.expiryTimeFromNow = expiryDate ? expiryDate.timeIntervalSinceNow : 0;
+
+  return headers;
+}
+
+// Everything the host reads from a response's cache headers, the old accessors against one MKCacheMetadata pass
+static void MKNKRunCacheMetadataBenchmarks(MKNKHarness *harness) {
+
+  NSUInteger const parseCount = 20000;
+  NSDate *now = [NSDate date];
+  NSDictionary *headerFields = @{@"Content-Type" : @"application/json; charset=utf-8",
+                                 @"Content-Length" : @"32768",
+                                 @"Cache-Control" : @"public, max-age=3600, stale-while-revalidate=60, stale-if-error=86400",
+                                 @"ETag" : @"\"33a64df551425fcc55e4d42a148795d9f25f89d4\"",
+                                 @"Last-Modified" : [[now dateByAddingTimeInterval:-86400] rfc1123String],
+                                 @"Date" : [now rfc1123String],
+                                 @"Vary" : @"Accept-Encoding",
+                                 @"Server" : @"loopback",
+                                 @"Connection" : @"keep-alive",
+                                 @"X-Request-Id" : @"f058ebd6-02f7-4d3f-942e-904344e8cde5"};
+
+  __block MKNKLegacyCacheHeaders legacyHeaders;
+  NSTimeInterval legacyDuration = MKNKMeasure(parseCount, ^{
+    legacyHeaders = MKNKReadLegacyCacheHeaders(headerFields);
+  });
+
+  __block MKCacheMetadata *metadata = nil;
+  __block NSTimeInterval expiryTimeFromNow = 0;
+  NSTimeInterval metadataDuration = MKNKMeasure(parseCount, ^{
+
+    metadata = [[MKCacheMetadata alloc] initWithHeaderFields:headerFields responseDate:now];
+    NSString *contentType = [headerFields objectForCaseInsensitiveKey:@"Content-Type"];
+    (void) ([contentType.lowercaseString rangeOfString:@"image"].location != NSNotFound);
+    (void) metadata.hasDoNotCacheDirective;
+    (void) metadata.hasHTTPCacheHeaders;
+    (void) metadata.hasValidators;
+    expiryTimeFromNow = metadata.expiryDate.timeIntervalSinceNow;
+  });
+
+  [harness recordBenchmark:@"cache.metadata"
+                parameters:@{@"headers" : @(headerFields.count), @"parses" : @(parseCount)}
+                   results:@{@"perHeaderSecondsPerResponse" : @(legacyDuration),
+                             @"singlePassSecondsPerResponse" : @(metadataDuration),
+                             @"speedup" : @(legacyDuration / metadataDuration)}];
+  [harness check:legacyHeaders.hasDoNotCacheDirective == metadata.hasDoNotCacheDirective &&
+   legacyHeaders.hasHTTPCacheHeaders == metadata.hasHTTPCacheHeaders &&
+   legacyHeaders.hasRequiredRevalidationHeaders == metadata.hasValidators &&
+   fabs(legacyHeaders.expiryTimeFromNow - expiryTimeFromNow) < 5
+            name:@"cache.metadata.matchesPerHeaderParsing"
+          detail:nil];
+}
+
+void MKNKRunCacheBenchmarks(MKNKHarness *harness) {
+
+  NSUInteger const resourceCount = 128;
+  MKNKLoopbackScenario *scenario = [MKNKLoopbackScenario scenarioWithPayloadSize:32 * 1024 latency:0.005];
+  scenario.cacheControl = @"max-age=3600";
+  scenario.eTag = @"\"v1\"";
+  [harness.server setScenario:scenario forPath:@"/cached"];
+  [harness.server resetRequestLog];
+
+  NSString *cacheDirectory = [harness.temporaryDirectory stringByAppendingPathComponent:@"hostcache"];
+  MKNetworkHost *host = [harness hostWithCacheDirectory:cacheDirectory];
+
+  NSArray *(^makeRequests)(void) = ^NSArray* {
+
+    NSMutableArray *requests = [NSMutableArray arrayWithCapacity:resourceCount];
+    for(NSUInteger index = 0; index < resourceCount; index ++) {
+      [requests addObject:[host requestWithPath:@"/cached" params:@{@"resource" : @(index)}]];
+    }
+    return requests;
+  };
+
+  NSArray *populatingRequests = makeRequests();
+  [harness check:[harness runRequests:populatingRequests onHost:host timeout:60]
+            name:@"cache.populate"
+          detail:nil];
+
+  // one at a time, so that the latency is the cache's and not the queue's
+  NSArray *(^runSequentially)(NSArray*) = ^NSArray*(NSArray *requests) {
+
+    NSMutableArray *latencies = [NSMutableArray arrayWithCapacity:requests.count];
+    for(MKNetworkRequest *request in requests) {
+
+      [harness runRequest:request onHost:host timeout:10];
+      [latencies addObject:@([harness latencyOfRequest:request])];
+    }
+    return latencies;
+  };
+
+  BOOL (^allFreshHits)(NSArray*) = ^BOOL(NSArray *requests) {
+
+    for(MKNetworkRequest *request in requests) {
+
+      if(request.metrics.cacheOutcome != MKNKCacheOutcomeFreshHit) return NO;
+      if(![request.responseData isEqualToData:scenario.payload]) return NO;
+    }
+    return YES;
+  };
+
+  // flushing writes the records out and empties the memory tier, the next reads come from disk
+  [host.responseCache flush];
+  [harness.server resetRequestLog];
+
+  NSArray *coldRequests = makeRequests();
+  NSArray *coldLatencies = runSequentially(coldRequests);
+  NSArray *warmRequests = makeRequests();
+  NSArray *warmLatencies = runSequentially(warmRequests);
+
+  [harness recordBenchmark:@"cache.host.cold" parameters:@{@"resources" : @(resourceCount), @"payloadSize" : @(scenario.payloadSize)}
+                   results:MKNKLatencyResults(coldLatencies)];
+  [harness recordBenchmark:@"cache.host.warm" parameters:@{@"resources" : @(resourceCount), @"payloadSize" : @(scenario.payloadSize)}
+                   results:MKNKLatencyResults(warmLatencies)];
+
+  [harness check:allFreshHits(coldRequests) name:@"cache.host.cold.freshHits" detail:nil];
+  [harness check:allFreshHits(warmRequests) name:@"cache.host.warm.freshHits" detail:nil];
+  [harness check:harness.server.requestLog.count == 0
+            name:@"cache.host.noNetwork"
+          detail:[NSString stringWithFormat:@"%lu requests reached the server", (unsigned long) harness.server.requestLog.count]];
+
+  // the cache on its own, without the host and the completion queue
+  MKCache *cache = [[MKCache alloc] initWithCacheDirectory:[harness.temporaryDirectory stringByAppendingPathComponent:@"directcache"]
+                                        inMemoryByteBudget:32 * 1024 * 1024];
+  cache.recordClass = [MKCachedResponse class];
+
+  NSHTTPURLResponse *response = [[NSHTTPURLResponse alloc] initWithURL:[NSURL URLWithString:@"http://127.0.0.1/cached"]
+                                                            statusCode:200
+                                                           HTTPVersion:@"HTTP/1.1"
+                                                          headerFields:@{@"Cache-Control" : @"max-age=3600"}];
+  for(NSUInteger index = 0; index < resourceCount; index ++) {
+    cache[@(index).stringValue] = [[MKCachedResponse alloc] initWithResponse:response data:scenario.payload];
+  }
+  [cache flush];
+
+  NSTimeInterval (^readAll)(void) = ^NSTimeInterval {
+
+    NSTimeInterval startTime = [NSProcessInfo processInfo].systemUptime;
+    for(NSUInteger index = 0; index < resourceCount; index ++) {
+      (void) cache[@(index).stringValue];
+    }
+    return ([NSProcessInfo processInfo].systemUptime - startTime) / resourceCount;
+  };
+
+  NSTimeInterval coldReadDuration = readAll();
+  NSTimeInterval warmReadDuration = readAll();
+  [harness recordBenchmark:@"cache.direct"
+                parameters:@{@"records" : @(resourceCount), @"payloadSize" : @(scenario.payloadSize)}
+                   results:@{@"coldRead" : @(coldReadDuration), @"warmRead" : @(warmReadDuration),
+                             @"hitCount" : @(cache.hitCount), @"missCount" : @(cache.missCount)}];
+  [harness check:cache.missCount == 0 name:@"cache.direct.noMisses" detail:nil];
+
+  MKNKRunCacheMetadataBenchmarks(harness);
+}
+
+#pragma mark -
+#pragma mark Encoding
+
+void MKNKRunEncodingBenchmarks(MKNKHarness *harness) {
+
+  NSMutableDictionary *parameters = [NSMutableDictionary dictionary];
+  for(NSUInteger index = 0; index < 64; index ++) {
+
+    NSString *key = [NSString stringWithFormat:@"parameter %lu", (unsigned long) index];
+    parameters[key] = [NSString stringWithFormat:@"value & more = %lu / ünïcødé ✓", (unsigned long) index];
+  }
+  parameters[@42] = @"a number key";
+
+  NSTimeInterval formEncodingDuration = MKNKMeasure(2000, ^{
+    (void) [parameters urlEncodedKeyValueString];
+  });
+
+  NSMutableString *longString = [NSMutableString string];
+  while(longString.length < 4096) [longString appendString:@"path/with spaces?and=reserved&characters#ünïcødé "];
+  NSTimeInterval stringEncodingDuration = MKNKMeasure(2000, ^{
+    (void) [longString mk_urlEncodedString];
+  });
+
+  [harness recordBenchmark:@"encoding.form"
+                parameters:@{@"parameters" : @(parameters.count)}
+                   results:@{@"secondsPerEncoding" : @(formEncodingDuration)}];
+  [harness recordBenchmark:@"encoding.string"
+                parameters:@{@"length" : @(longString.length)}
+                   results:@{@"secondsPerEncoding" : @(stringEncodingDuration)}];
+
+  [harness check:[[longString mk_urlEncodedString].urlDecodedString isEqualToString:longString]
+            name:@"encoding.string.roundTrip"
+          detail:nil];
+
+  // cache keys sort query items by key, the values of a repeated key keep their order
+  MKNetworkHost *host = [harness host];
+  NSString *(^cacheKeyOfURL)(NSString*) = ^NSString*(NSString *urlString) {
+    return [host requestWithURLString:urlString].cacheKey;
+  };
+  [harness check:[cacheKeyOfURL(@"http://127.0.0.1/items?b=1&a=2&a=1") isEqualToString:cacheKeyOfURL(@"http://127.0.0.1/items?a=2&a=1&b=1")]
+            name:@"encoding.cacheKey.sortsKeys"
+          detail:nil];
+  [harness check:![cacheKeyOfURL(@"http://127.0.0.1/items?a=2&a=1") isEqualToString:cacheKeyOfURL(@"http://127.0.0.1/items?a=1&a=2")]
+            name:@"encoding.cacheKey.keepsRepeatedKeyOrder"
+          detail:nil];
+
+  // the built request and its cache key are memoized, and rebuilt only after the request changes
+  // a rebuild returns a new NSURLRequest, so rebuilds are counted by the distinct requests returned
+  NSUInteger const memoizedCallCount = 10000;
+  MKNetworkRequest *memoizedRequest = [host requestWithPath:@"/items" params:parameters];
+  NSHashTable *builtRequests = [NSHashTable hashTableWithOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality];
+
+  NSTimeInterval unchangedDuration = MKNKMeasure(memoizedCallCount, ^{
+
+    [builtRequests addObject:memoizedRequest.urlRequest];
+    (void) memoizedRequest.cacheKey;
+  });
+  NSUInteger unchangedRebuildCount = builtRequests.count - 1; // the first build isn't a rebuild
+
+  [builtRequests removeAllObjects];
+  __block NSUInteger changeCount = 0;
+  NSTimeInterval changedDuration = MKNKMeasure(memoizedCallCount, ^{
+
+    [memoizedRequest addParameters:@{@"page" : @(changeCount ++)}];
+    [builtRequests addObject:memoizedRequest.urlRequest];
+    (void) memoizedRequest.cacheKey;
+  });
+  NSUInteger changedRebuildCount = builtRequests.count;
+
+  [harness recordBenchmark:@"encoding.memoizedRequest"
+                parameters:@{@"parameters" : @(parameters.count), @"calls" : @(memoizedCallCount)}
+                   results:@{@"unchangedSecondsPerCall" : @(unchangedDuration), @"unchangedRebuilds" : @(unchangedRebuildCount),
+                             @"changedSecondsPerCall" : @(changedDuration), @"changedRebuilds" : @(changedRebuildCount)}];
+  [harness check:unchangedRebuildCount == 0
+            name:@"encoding.memoizedRequest.reusedWhileUnchanged"
+          detail:[NSString stringWithFormat:@"%lu rebuilds", (unsigned long) unchangedRebuildCount]];
+  [harness check:changedRebuildCount == changeCount
+            name:@"encoding.memoizedRequest.rebuiltAfterChanges"
+          detail:[NSString stringWithFormat:@"%lu rebuilds after %lu changes", (unsigned long) changedRebuildCount, (unsigned long) changeCount]];
+
+  // multipart bodies the way uploads send them, attached files streamed into the upload file
+  NSMutableData *attachment = [NSMutableData dataWithLength:256 * 1024];
+  memset(attachment.mutableBytes, 'x', attachment.length);
+  NSUInteger const partCount = 8;
+
+  NSString *attachmentPath = [harness.temporaryDirectory stringByAppendingPathComponent:@"attachment.bin"];
+  [attachment writeToFile:attachmentPath atomically:YES];
+  NSString *bodyFilePath = [harness.temporaryDirectory stringByAppendingPathComponent:@"multipart.body"];
+
+  __block unsigned long long bodyLength = 0;
+  __block BOOL bodyWritten = YES;
+  NSTimeInterval multipartDuration = MKNKMeasure(50, ^{
+
+    MKNetworkRequest *request = [host requestWithPath:@"/upload" params:@{@"title" : @"benchmark"} httpMethod:@"POST"];
+    for(NSUInteger part = 0; part < partCount; part ++) {
+
+      [request attachFile:attachmentPath
+                   forKey:[NSString stringWithFormat:@"file%lu", (unsigned long) part]
+                 mimeType:@"application/octet-stream"];
+    }
+    if(![request writeUploadBodyToFile:bodyFilePath error:nil]) bodyWritten = NO;
+    bodyLength = [[[NSFileManager defaultManager] attributesOfItemAtPath:bodyFilePath error:nil] fileSize];
+  });
+  [[NSFileManager defaultManager] removeItemAtPath:bodyFilePath error:nil];
+
+  [harness recordBenchmark:@"encoding.multipart"
+                parameters:@{@"parts" : @(partCount), @"partSize" : @(attachment.length)}
+                   results:@{@"secondsPerBody" : @(multipartDuration), @"bodyLength" : @(bodyLength)}];
+  [harness check:bodyWritten && bodyLength > partCount * attachment.length name:@"encoding.multipart.containsParts" detail:nil];
+}
+
+#pragma mark -
+#pragma mark Mapping
+
+void MKNKRunMappingBenchmarks(MKNKHarness *harness) {
+
+  NSUInteger const itemCount = 10000;
+  NSMutableArray *dictionaries = [NSMutableArray arrayWithCapacity:itemCount];
+  for(NSUInteger index = 0; index < itemCount; index ++) {
+    [dictionaries addObject:MKNKBenchmarkItemDictionary(index)];
+  }
+
+  __block NSArray *items = nil;
+  NSTimeInterval serialDuration = MKNKMeasure(5, ^{
+    items = [MKObject map:dictionaries usingClass:[MKNKBenchmarkItem class]];
+  });
+  NSTimeInterval parallelDuration = MKNKMeasure(5, ^{
+    items = [MKObject map:dictionaries usingClass:[MKNKBenchmarkItem class] parallelThreshold:1000];
+  });
+
+  // throughput by the number of chunks mapped concurrently, 0 is the default of a few chunks per core
+  NSUInteger processorCount = [NSProcessInfo processInfo].activeProcessorCount;
+  NSOrderedSet *workerCounts = [NSOrderedSet orderedSetWithArray:@[@1, @2, @4, @(processorCount), @0]];
+  for(NSNumber *workerCount in workerCounts) {
+
+    __block NSArray *workerItems = nil;
+    NSTimeInterval workerDuration = MKNKMeasure(5, ^{
+      workerItems = [MKObject map:dictionaries usingClass:[MKNKBenchmarkItem class]
+                parallelThreshold:1000 workerCount:workerCount.unsignedIntegerValue];
+    });
+
+    [harness recordBenchmark:@"mapping.workers"
+                  parameters:@{@"items" : @(itemCount), @"workers" : workerCount, @"processors" : @(processorCount)}
+                     results:@{@"objectsPerSecond" : @(itemCount / workerDuration),
+                               @"speedupOverSerial" : @(serialDuration / workerDuration)}];
+    [harness check:workerItems.count == itemCount && [[workerItems.lastObject identifier] isEqualToString:@"item-9999"]
+              name:[NSString stringWithFormat:@"mapping.workers%@.keepsOrder", workerCount]
+            detail:nil];
+  }
+
+  __block NSUInteger serializedLength = 0;
+  NSTimeInterval serializationDuration = MKNKMeasure(5, ^{
+
+    serializedLength = 0;
+    for(MKNKBenchmarkItem *item in items) serializedLength += [item jsonData].length;
+  });
+
+  [harness recordBenchmark:@"mapping.objects"
+                parameters:@{@"items" : @(itemCount)}
+                   results:@{@"serialObjectsPerSecond" : @(itemCount / serialDuration),
+                             @"parallelObjectsPerSecond" : @(itemCount / parallelDuration),
+                             @"serializedObjectsPerSecond" : @(itemCount / serializationDuration),
+                             @"serializedBytes" : @(serializedLength)}];
+
+  MKNKBenchmarkItem *item = items.lastObject;
+  [harness check:items.count == itemCount &&
+   [item.identifier isEqualToString:@"item-9999"] && item.count == 9999 && !item.active && item.tags.count == 3
+            name:@"mapping.objects.values"
+          detail:nil];
+}
@@ -0,0 +1,187 @@
+//
+//  MKNKDownloadChecks.m
+//  MKNetworkKitBenchmarks
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import "MKNKHarness.h"
+
+// defined in MKSegmentedDownload.m, the pieces already written are recorded in a file with this extension
+extern NSString *const kMKSegmentedDownloadStateExtension;
+
+// larger than two 8MB pieces, so that a download has two full pieces and a short last one
+static NSUInteger const kMKNKDownloadPayloadSize = 20 * 1024 * 1024;
+static NSUInteger const kMKNKDownloadPieceSize = 8 * 1024 * 1024;
+
+static MKNetworkRequest *MKNKDownloadRequest(MKNetworkHost *host, NSString *path, NSString *downloadPath) {
+
+  MKNetworkRequest *request = [host requestWithPath:path];
+  request.downloadPath = downloadPath;
+  request.downloadSegmentCount = 2;
+  return request;
+}
+
+static NSString *MKNKStatePath(NSString *downloadPath) {
+
+  return [downloadPath stringByAppendingPathExtension:kMKSegmentedDownloadStateExtension];
+}
+
+static NSArray *MKNKCompletedPieces(NSString *downloadPath) {
+
+  NSDictionary *state = [NSDictionary dictionaryWithContentsOfFile:MKNKStatePath(downloadPath)];
+  return state[@"completedPieces"] ? state[@"completedPieces"] : @[];
+}
+
+// first bytes of the ranges the server was asked for
+static NSIndexSet *MKNKRequestedRangeStarts(NSArray *requests) {
+
+  NSMutableIndexSet *rangeStarts = [NSMutableIndexSet indexSet];
+  for(MKNKLoopbackRequest *request in requests) {
+
+    NSString *range = [request valueForHeader:@"Range"];
+    if(![range hasPrefix:@"bytes="]) continue;
+    [rangeStarts addIndex:(NSUInteger) [range substringFromIndex:6].longLongValue];
+  }
+  return rangeStarts;
+}
+
+static MKNKLoopbackScenario *MKNKDownloadScenario(void) {
+
+  MKNKLoopbackScenario *scenario = [MKNKLoopbackScenario scenarioWithPayloadSize:kMKNKDownloadPayloadSize latency:0];
+  scenario.eTag = @"\"download-v1\"";
+  return scenario;
+}
+
+void MKNKRunDownloadChecks(MKNKHarness *harness) {
+
+  MKNetworkHost *host = [harness host];
+  NSFileManager *fileManager = [NSFileManager defaultManager];
+  [harness.server resetRequestLog];
+
+  // the whole file, in parallel ranges
+  MKNKLoopbackScenario *scenario = MKNKDownloadScenario();
+  [harness.server setScenario:scenario forPath:@"/download/file"];
+  NSString *downloadPath = [harness.temporaryDirectory stringByAppendingPathComponent:@"file.bin"];
+
+  MKNetworkRequest *request = MKNKDownloadRequest(host, @"/download/file", downloadPath);
+  BOOL finished = [harness runDownloadRequest:request onHost:host timeout:60];
+  [harness check:finished && request.state == MKNKRequestStateCompleted &&
+   [[NSData dataWithContentsOfFile:downloadPath] isEqualToData:scenario.payload] &&
+   ![fileManager fileExistsAtPath:MKNKStatePath(downloadPath)]
+            name:@"download.segmented.completes"
+          detail:[NSString stringWithFormat:@"state %d, error %@", request.state, request.error]];
+
+  // a 200 to a ranged request means If-Range failed, the saved pieces must not be reused
+  MKNKLoopbackScenario *fullResponseScenario = MKNKDownloadScenario();
+  fullResponseScenario.ignoresRanges = YES;
+  [harness.server setScenario:fullResponseScenario forPath:@"/download/ignoresranges"];
+  downloadPath = [harness.temporaryDirectory stringByAppendingPathComponent:@"ignoresranges.bin"];
+
+  request = MKNKDownloadRequest(host, @"/download/ignoresranges", downloadPath);
+  finished = [harness runDownloadRequest:request onHost:host timeout:60];
+  [harness check:finished && request.state == MKNKRequestStateError && request.error.code == 200
+            name:@"download.fullResponseToRange.fails"
+          detail:[NSString stringWithFormat:@"state %d, error %@", request.state, request.error]];
+  [harness check:![fileManager fileExistsAtPath:MKNKStatePath(downloadPath)]
+            name:@"download.fullResponseToRange.discardsState"
+          detail:nil];
+
+  // a 206 for bytes other than those asked for is never written into the file
+  MKNKLoopbackScenario *shiftedScenario = MKNKDownloadScenario();
+  shiftedScenario.contentRangeOffset = 1;
+  [harness.server setScenario:shiftedScenario forPath:@"/download/shifted"];
+  downloadPath = [harness.temporaryDirectory stringByAppendingPathComponent:@"shifted.bin"];
+
+  request = MKNKDownloadRequest(host, @"/download/shifted", downloadPath);
+  finished = [harness runDownloadRequest:request onHost:host timeout:60];
+  [harness check:finished && request.state == MKNKRequestStateError && request.error.code == 206
+            name:@"download.contentRangeMismatch.fails"
+          detail:[NSString stringWithFormat:@"state %d, error %@", request.state, request.error]];
+  [harness check:MKNKCompletedPieces(downloadPath).count == 0
+            name:@"download.contentRangeMismatch.recordsNoPieces"
+          detail:[NSString stringWithFormat:@"%@ recorded", MKNKCompletedPieces(downloadPath)]];
+
+  // a piece that fails once is requested again instead of failing the download
+  MKNKLoopbackScenario *flakyScenario = MKNKDownloadScenario();
+  NSString *flakyRange = [NSString stringWithFormat:@"bytes=%lu-", (unsigned long) kMKNKDownloadPieceSize];
+  __block BOOL pieceFailed = NO;
+  [harness.server setHandler:^MKNKLoopbackResponse *(MKNKLoopbackRequest *loopbackRequest, NSUInteger requestIndex) {
+
+    @synchronized(flakyScenario) {
+
+      if(!pieceFailed && [[loopbackRequest valueForHeader:@"Range"] hasPrefix:flakyRange]) {
+
+        pieceFailed = YES;
+        return [MKNKLoopbackResponse responseWithStatusCode:503 headers:nil body:nil];
+      }
+    }
+    return [flakyScenario responseToRequest:loopbackRequest requestIndex:requestIndex];
+  } forPath:@"/download/flaky"];
+  downloadPath = [harness.temporaryDirectory stringByAppendingPathComponent:@"flaky.bin"];
+
+  request = MKNKDownloadRequest(host, @"/download/flaky", downloadPath);
+  finished = [harness runDownloadRequest:request onHost:host timeout:60];
+  NSUInteger flakyRangeRequests = 0;
+  for(MKNKLoopbackRequest *loopbackRequest in [harness.server requestsForPath:@"/download/flaky"]) {
+    if([[loopbackRequest valueForHeader:@"Range"] hasPrefix:flakyRange]) flakyRangeRequests ++;
+  }
+  [harness check:finished && request.state == MKNKRequestStateCompleted &&
+   [[NSData dataWithContentsOfFile:downloadPath] isEqualToData:flakyScenario.payload] && flakyRangeRequests == 2
+            name:@"download.transientPieceFailure.retries"
+          detail:[NSString stringWithFormat:@"state %d, error %@, range requested %lu times", request.state, request.error,
+                   (unsigned long) flakyRangeRequests]];
+  [fileManager removeItemAtPath:downloadPath error:nil];
+
+  // the last piece fails, the download started again fetches only what is missing
+  MKNKLoopbackScenario *resumedScenario = MKNKDownloadScenario();
+  resumedScenario.failingRangeStarts = [NSIndexSet indexSetWithIndex:2 * kMKNKDownloadPieceSize];
+  [harness.server setScenario:resumedScenario forPath:@"/download/resumed"];
+  downloadPath = [harness.temporaryDirectory stringByAppendingPathComponent:@"resumed.bin"];
+
+  request = MKNKDownloadRequest(host, @"/download/resumed", downloadPath);
+  finished = [harness runDownloadRequest:request onHost:host timeout:60];
+  NSArray *savedPieces = MKNKCompletedPieces(downloadPath);
+  [harness check:finished && request.state == MKNKRequestStateError && savedPieces.count > 0
+            name:@"download.resume.savesPieces"
+          detail:[NSString stringWithFormat:@"state %d, %@ recorded", request.state, savedPieces]];
+
+  resumedScenario.failingRangeStarts = nil;
+  NSUInteger firstRequest = harness.server.requestLog.count;
+  request = MKNKDownloadRequest(host, @"/download/resumed", downloadPath);
+  finished = [harness runDownloadRequest:request onHost:host timeout:60];
+
+  NSArray *resumeRequests = [harness.server.requestLog subarrayWithRange:NSMakeRange(firstRequest, harness.server.requestLog.count - firstRequest)];
+  NSMutableIndexSet *missingRangeStarts = [NSMutableIndexSet indexSet];
+  for(NSUInteger piece = 0; piece * kMKNKDownloadPieceSize < kMKNKDownloadPayloadSize; piece ++) {
+    if(![savedPieces containsObject:@(piece)]) [missingRangeStarts addIndex:piece * kMKNKDownloadPieceSize];
+  }
+
+  [harness check:finished && request.state == MKNKRequestStateCompleted &&
+   [[NSData dataWithContentsOfFile:downloadPath] isEqualToData:resumedScenario.payload]
+            name:@"download.resume.completes"
+          detail:[NSString stringWithFormat:@"state %d, error %@", request.state, request.error]];
+  [harness check:[MKNKRequestedRangeStarts(resumeRequests) isEqualToIndexSet:missingRangeStarts]
+            name:@"download.resume.fetchesMissingPiecesOnly"
+          detail:[NSString stringWithFormat:@"requested %@, missing %@", MKNKRequestedRangeStarts(resumeRequests), missingRangeStarts]];
+
+  [fileManager removeItemAtPath:[harness.temporaryDirectory stringByAppendingPathComponent:@"file.bin"] error:nil];
+  [fileManager removeItemAtPath:[harness.temporaryDirectory stringByAppendingPathComponent:@"resumed.bin"] error:nil];
+}
@@ -0,0 +1,76 @@
+//
+//  MKNKHarness.h
+//  MKNetworkKitBenchmarks
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+#import "MKNetworkKit.h"
+#import "MKNKLoopbackServer.h"
+
+/*!
+ *  @abstract Runs suites of benchmarks and checks against a loopback server and collects a machine readable report
+ *
+ *  @discussion
+ *	Benchmarks record measurements, checks record whether the library behaved as expected.
+ *  A run fails when any check fails. Benchmarks don't fail a run, their numbers are compared across runs.
+ */
+@interface MKNKHarness : NSObject <MKNetworkHostDelegate>
+
+-(instancetype) initWithServer:(MKNKLoopbackServer*) server;
+
+@property (readonly) MKNKLoopbackServer *server;
+@property (readonly) NSString *temporaryDirectory; // removed when the run ends
+
+// The loopback server's host, without NSURLCache so that only MKCache answers from the cache
+-(MKNetworkHost*) host;
+-(MKNetworkHost*) hostWithCacheDirectory:(NSString*) cacheDirectory;
+
+// Starts the request and waits until the host has finished it, NO if it didn't finish in time
+// Completion handlers run on a harness queue, not on the main queue
+-(BOOL) runRequest:(MKNetworkRequest*) request onHost:(MKNetworkHost*) host timeout:(NSTimeInterval) timeout;
+-(BOOL) runDownloadRequest:(MKNetworkRequest*) request onHost:(MKNetworkHost*) host timeout:(NSTimeInterval) timeout;
+-(BOOL) runRequests:(NSArray*) requests onHost:(MKNetworkHost*) host timeout:(NSTimeInterval) timeout;
+
+// seconds from startRequest: until the host finished the request, -1 if it hasn't
+-(NSTimeInterval) latencyOfRequest:(MKNetworkRequest*) request;
+
+-(void) recordBenchmark:(NSString*) name parameters:(NSDictionary*) parameters results:(NSDictionary*) results;
+-(BOOL) check:(BOOL) passed name:(NSString*) name detail:(NSString*) detail;
+
+@property (readonly) NSUInteger failedCheckCount;
+-(NSDictionary*) report;
+@end
+
+// p50 is 0.5, the nearest rank of the sorted samples. -1 without samples
+NSTimeInterval MKNKPercentileOfSamples(NSArray *sortedSamples, double percentile);
+
+// Seconds per call of the block, the mean of a timed run after a warm-up call
+NSTimeInterval MKNKMeasure(NSUInteger iterations, void (^block)(void));
+
+// Suites, each runs its benchmarks and checks against the harness
+void MKNKRunHostBenchmarks(MKNKHarness *harness);
+void MKNKRunCacheBenchmarks(MKNKHarness *harness);
+void MKNKRunEncodingBenchmarks(MKNKHarness *harness);
+void MKNKRunMappingBenchmarks(MKNKHarness *harness);
+void MKNKRunRetryChecks(MKNKHarness *harness); // retries, Retry-After and hedged requests
+void MKNKRunDownloadChecks(MKNKHarness *harness); // segmented downloads against misbehaving range servers
@@ -0,0 +1,232 @@
+//
+//  MKNKHarness.m
+//  MKNetworkKitBenchmarks
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import "MKNKHarness.h"
+
+// When a request was started and finished, and who waits for it
+@interface MKNKRunningRequest : NSObject
+@property NSTimeInterval startTime;
+@property NSTimeInterval finishTime;
+@property dispatch_group_t group;
+@end
+
+@implementation MKNKRunningRequest
+@end
+
+@interface MKNKHarness (/*Private Methods*/)
+@property (readwrite) MKNKLoopbackServer *server;
+@property (readwrite) NSString *temporaryDirectory;
+@property (readwrite) NSUInteger failedCheckCount;
+@property dispatch_queue_t completionQueue;
+@property NSMapTable *runningRequests; // request -> MKNKRunningRequest
+@property NSMutableArray *benchmarks;
+@property NSMutableArray *checks;
+@end
+
+@implementation MKNKHarness
+
+-(instancetype) initWithServer:(MKNKLoopbackServer*) server {
+
+  if(self = [super init]) {
+
+    self.server = server;
+    self.temporaryDirectory = [NSTemporaryDirectory() stringByAppendingPathComponent:
+                               [NSString stringWithFormat:@"mknkbenchmarks-%@", [NSUUID UUID].UUIDString]];
+    [[NSFileManager defaultManager] createDirectoryAtPath:self.temporaryDirectory withIntermediateDirectories:YES attributes:nil error:nil];
+
+    self.completionQueue = dispatch_queue_create("com.mknetworkkit.benchmarks.completion", DISPATCH_QUEUE_SERIAL);
+    self.runningRequests = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality
+                                                 valueOptions:NSPointerFunctionsStrongMemory];
+    self.benchmarks = [NSMutableArray array];
+    self.checks = [NSMutableArray array];
+  }
+
+  return self;
+}
+
+-(void) dealloc {
+
+  [[NSFileManager defaultManager] removeItemAtPath:_temporaryDirectory error:nil];
+}
+
+#pragma mark -
+#pragma mark Hosts
+
+-(MKNetworkHost*) host {
+
+  MKNetworkHost *host = [[MKNetworkHost alloc] initWithHostName:@"127.0.0.1"];
+  host.portNumber = self.server.port;
+  host.delegate = self;
+  return host;
+}
+
+-(MKNetworkHost*) hostWithCacheDirectory:(NSString*) cacheDirectory {
+
+  MKNetworkHost *host = [self host];
+  [host enableCacheWithDirectory:cacheDirectory inMemoryByteBudget:32 * 1024 * 1024];
+  return host;
+}
+
+-(void) networkHost:(MKNetworkHost*) networkHost didCreateDefaultSessionConfiguration:(NSURLSessionConfiguration*) configuration {
+
+  configuration.URLCache = nil;
+  configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+}
+
+-(void) networkHost:(MKNetworkHost*) networkHost didCreateEphemeralSessionConfiguration:(NSURLSessionConfiguration*) configuration {
+
+  configuration.URLCache = nil;
+  configuration.requestCachePolicy = NSURLRequestReloadIgnoringLocalCacheData;
+}
+
+#pragma mark -
+#pragma mark Running requests
+
+-(BOOL) runRequest:(MKNetworkRequest*) request onHost:(MKNetworkHost*) host timeout:(NSTimeInterval) timeout {
+
+  return [self runRequests:@[request] onHost:host timeout:timeout];
+}
+
+-(BOOL) runDownloadRequest:(MKNetworkRequest*) request onHost:(MKNetworkHost*) host timeout:(NSTimeInterval) timeout {
+
+  dispatch_group_t group = [self groupForRequests:@[request]];
+  [host startDownloadRequest:request];
+  return dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, (int64_t) (timeout * NSEC_PER_SEC))) == 0;
+}
+
+-(BOOL) runRequests:(NSArray*) requests onHost:(MKNetworkHost*) host timeout:(NSTimeInterval) timeout {
+
+  dispatch_group_t group = [self groupForRequests:requests];
+  for(MKNetworkRequest *request in requests) {
+    [host startRequest:request];
+  }
+  return dispatch_group_wait(group, dispatch_time(DISPATCH_TIME_NOW, (int64_t) (timeout * NSEC_PER_SEC))) == 0;
+}
+
+-(dispatch_group_t) groupForRequests:(NSArray*) requests {
+
+  dispatch_group_t group = dispatch_group_create();
+  NSTimeInterval startTime = [NSProcessInfo processInfo].systemUptime;
+
+  @synchronized(self) {
+
+    for(MKNetworkRequest *request in requests) {
+
+      MKNKRunningRequest *runningRequest = [[MKNKRunningRequest alloc] init];
+      runningRequest.startTime = startTime;
+      runningRequest.finishTime = -1;
+      runningRequest.group = group;
+      [self.runningRequests setObject:runningRequest forKey:request];
+
+      request.completionQueue = self.completionQueue;
+      dispatch_group_enter(group);
+    }
+  }
+
+  return group;
+}
+
+-(void) networkHost:(MKNetworkHost*) networkHost
+   didFinishRequest:(MKNetworkRequest*) request
+        withMetrics:(MKNetworkRequestMetrics*) metrics {
+
+  dispatch_group_t group = nil;
+  @synchronized(self) {
+
+    MKNKRunningRequest *runningRequest = [self.runningRequests objectForKey:request];
+    if(runningRequest.finishTime >= 0) return;
+    runningRequest.finishTime = [NSProcessInfo processInfo].systemUptime;
+    group = runningRequest.group;
+  }
+
+  if(group) dispatch_group_leave(group);
+}
+
+-(NSTimeInterval) latencyOfRequest:(MKNetworkRequest*) request {
+
+  @synchronized(self) {
+
+    MKNKRunningRequest *runningRequest = [self.runningRequests objectForKey:request];
+    if(!runningRequest || runningRequest.finishTime < 0) return -1;
+    return runningRequest.finishTime - runningRequest.startTime;
+  }
+}
+
+#pragma mark -
+#pragma mark Results
+
+-(void) recordBenchmark:(NSString*) name parameters:(NSDictionary*) parameters results:(NSDictionary*) results {
+
+  NSLog(@"[benchmark] %@ %@ %@", name, parameters, results);
+  [self.benchmarks addObject:@{@"name" : name,
+                               @"parameters" : parameters ? parameters : @{},
+                               @"results" : results}];
+}
+
+-(BOOL) check:(BOOL) passed name:(NSString*) name detail:(NSString*) detail {
+
+  NSLog(@"[check] %@ %@%@%@", passed ? @"PASS" : @"FAIL", name, detail ? @": " : @"", detail ? detail : @"");
+  if(!passed) self.failedCheckCount ++;
+  [self.checks addObject:@{@"name" : name,
+                           @"passed" : @(passed),
+                           @"detail" : detail ? detail : @""}];
+  return passed;
+}
+
+-(NSDictionary*) report {
+
+  NSProcessInfo *processInfo = [NSProcessInfo processInfo];
+  return @{@"date" : [[NSISO8601DateFormatter new] stringFromDate:[NSDate date]],
+           @"environment" : @{@"operatingSystem" : processInfo.operatingSystemVersionString,
+                              @"processorCount" : @(processInfo.activeProcessorCount),
+                              @"physicalMemory" : @(processInfo.physicalMemory)},
+           @"benchmarks" : self.benchmarks,
+           @"checks" : self.checks,
+           @"failedCheckCount" : @(self.failedCheckCount)};
+}
+
+@end
+
+NSTimeInterval MKNKPercentileOfSamples(NSArray *sortedSamples, double percentile) {
+
+  if(sortedSamples.count == 0) return -1;
+  NSUInteger rank = (NSUInteger) ceil(percentile * sortedSamples.count);
+  return [sortedSamples[MIN(MAX(rank, 1), sortedSamples.count) - 1] doubleValue];
+}
+
+NSTimeInterval MKNKMeasure(NSUInteger iterations, void (^block)(void)) {
+
+  @autoreleasepool {
+    block();
+  }
+
+  NSTimeInterval startTime = [NSProcessInfo processInfo].systemUptime;
+  for(NSUInteger iteration = 0; iteration < iterations; iteration ++) {
+
+    @autoreleasepool {
+      block();
+    }
+  }
+  return ([NSProcessInfo processInfo].systemUptime - startTime) / MAX(iterations, 1);
+}
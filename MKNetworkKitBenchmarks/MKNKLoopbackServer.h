@@ -0,0 +1,105 @@
+//
+//  MKNKLoopbackServer.h
+//  MKNetworkKitBenchmarks
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+// A request as the server received it, kept in the server's request log
+@interface MKNKLoopbackRequest : NSObject
+
+@property (readonly) NSString *method;
+@property (readonly) NSString *path; // without the query
+@property (readonly) NSString *query;
+@property (readonly) NSDictionary *headers; // names in lower case
+@property (readonly) NSData *body;
+@property (readonly) NSTimeInterval receivedTime; // system uptime, in seconds
+
+-(NSString*) valueForHeader:(NSString*) headerName;
+@end
+
+@interface MKNKLoopbackResponse : NSObject
+
++(instancetype) responseWithStatusCode:(NSInteger) statusCode headers:(NSDictionary*) headers body:(NSData*) body;
+
+@property NSInteger statusCode;
+@property NSDictionary *headers; // Content-Length is added by the server
+@property NSData *body; // not sent for HEAD requests
+@property NSTimeInterval delay; // waited before the response is written, in seconds
+// The connection is closed after this many body bytes, 0 sends the whole body
+// Content-Length still announces the whole body, so the client sees a lost connection
+@property NSUInteger truncatedLength;
+@end
+
+// requestIndex counts the requests to the same path, from 0
+typedef MKNKLoopbackResponse* (^MKNKLoopbackHandler)(MKNKLoopbackRequest *request, NSUInteger requestIndex);
+
+/*!
+ *  @abstract A resource with configurable latency, size, cache headers, error rate and byte range support
+ *
+ *  @discussion
+ *	The payload is a deterministic byte pattern, so clients can check what they received against it.
+ *  Errors are spread evenly over the requests instead of being random, runs are repeatable.
+ */
+@interface MKNKLoopbackScenario : NSObject
+
++(instancetype) scenarioWithPayloadSize:(NSUInteger) payloadSize latency:(NSTimeInterval) latency;
+
+@property NSTimeInterval latency;
+@property (nonatomic) NSUInteger payloadSize;
+@property NSString *cacheControl; // sent with successful responses when set
+@property NSString *eTag; // sent when set, conditional requests that match it get a 304
+@property double errorRate; // 0 to 1, the share of requests answered with errorStatusCode
+@property NSInteger errorStatusCode; // defaults to 503
+@property BOOL supportsRanges; // defaults to YES, single byte ranges only
+
+// misbehaving servers
+@property BOOL ignoresRanges; // advertises Accept-Ranges, but answers ranged requests with the whole payload
+@property long long contentRangeOffset; // shifts the range reported in Content-Range away from the one sent
+@property NSIndexSet *failingRangeStarts; // ranges starting at these bytes are answered with errorStatusCode
+
+@property (readonly, nonatomic) NSData *payload;
+
+-(MKNKLoopbackResponse*) responseToRequest:(MKNKLoopbackRequest*) request requestIndex:(NSUInteger) requestIndex;
+@end
+
+/*!
+ *  @abstract A minimal HTTP/1.1 server on 127.0.0.1, for benchmarks and checks that must not depend on the network
+ *
+ *  @discussion
+ *	Listens on an ephemeral port. Every connection is served on its own thread and kept alive between requests.
+ *  Requests to paths without a handler get a 404. Every request is logged, in the order it arrived.
+ */
+@interface MKNKLoopbackServer : NSObject
+
+-(BOOL) start:(NSError**) error;
+-(void) stop;
+
+@property (readonly) uint16_t port;
+
+-(void) setHandler:(MKNKLoopbackHandler) handler forPath:(NSString*) path;
+-(void) setScenario:(MKNKLoopbackScenario*) scenario forPath:(NSString*) path;
+
+@property (readonly) NSArray *requestLog;
+-(NSArray*) requestsForPath:(NSString*) path;
+-(void) resetRequestLog; // also restarts the request indexes handed to handlers
+@end
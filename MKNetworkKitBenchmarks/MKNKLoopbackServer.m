@@ -0,0 +1,510 @@
+//
+//  MKNKLoopbackServer.m
+//  MKNetworkKitBenchmarks
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import "MKNKLoopbackServer.h"
+
+#import "NSDate+RFC1123.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static NSUInteger const kMKNKLoopbackReadBufferSize = 64 * 1024;
+static NSUInteger const kMKNKLoopbackMaximumHeaderLength = 64 * 1024;
+
+@interface MKNKLoopbackRequest (/*Private Methods*/)
+@property (readwrite) NSString *method;
+@property (readwrite) NSString *path;
+@property (readwrite) NSString *query;
+@property (readwrite) NSDictionary *headers;
+@property (readwrite) NSData *body;
+@property (readwrite) NSTimeInterval receivedTime;
+@end
+
+@implementation MKNKLoopbackRequest
+
+-(NSString*) valueForHeader:(NSString*) headerName {
+
+  return self.headers[headerName.lowercaseString];
+}
+
+-(NSString*) description {
+
+  return [NSString stringWithFormat:@"%@ %@%@%@", self.method, self.path, self.query ? @"?" : @"", self.query ? self.query : @""];
+}
+
+@end
+
+@implementation MKNKLoopbackResponse
+
++(instancetype) responseWithStatusCode:(NSInteger) statusCode headers:(NSDictionary*) headers body:(NSData*) body {
+
+  MKNKLoopbackResponse *response = [[self alloc] init];
+  response.statusCode = statusCode;
+  response.headers = headers;
+  response.body = body;
+  return response;
+}
+
+@end
+
+#pragma mark -
+#pragma mark Scenarios
+
+@implementation MKNKLoopbackScenario {
+
+  NSData *_payload;
+}
+
++(instancetype) scenarioWithPayloadSize:(NSUInteger) payloadSize latency:(NSTimeInterval) latency {
+
+  MKNKLoopbackScenario *scenario = [[self alloc] init];
+  scenario.payloadSize = payloadSize;
+  scenario.latency = latency;
+  return scenario;
+}
+
+-(instancetype) init {
+
+  if(self = [super init]) {
+
+    self.errorStatusCode = 503;
+    self.supportsRanges = YES;
+  }
+
+  return self;
+}
+
+-(void) setPayloadSize:(NSUInteger) payloadSize {
+
+  @synchronized(self) {
+
+    _payloadSize = payloadSize;
+    _payload = nil;
+  }
+}
+
+// not all bytes repeat at the same period, so a range written at the wrong offset doesn't compare equal
+-(NSData*) payload {
+
+  @synchronized(self) {
+
+    if(!_payload) {
+
+      NSMutableData *payload = [NSMutableData dataWithLength:_payloadSize];
+      uint8_t *bytes = payload.mutableBytes;
+      for(NSUInteger index = 0; index < _payloadSize; index ++) {
+        bytes[index] = (uint8_t) ((index * 31 + index / 251) % 251);
+      }
+      _payload = payload;
+    }
+    return _payload;
+  }
+}
+
+// spreads errorRate evenly, request n fails when the count of failures up to it goes up
+-(BOOL) failsRequestAtIndex:(NSUInteger) requestIndex {
+
+  if(self.errorRate <= 0) return NO;
+  return (NSUInteger) ((requestIndex + 1) * self.errorRate) != (NSUInteger) (requestIndex * self.errorRate);
+}
+
+-(MKNKLoopbackResponse*) responseToRequest:(MKNKLoopbackRequest*) request requestIndex:(NSUInteger) requestIndex {
+
+  MKNKLoopbackResponse *response = [[MKNKLoopbackResponse alloc] init];
+  response.delay = self.latency;
+
+  if([self failsRequestAtIndex:requestIndex]) {
+
+    response.statusCode = self.errorStatusCode;
+    return response;
+  }
+
+  NSMutableDictionary *headers = [NSMutableDictionary dictionary];
+  headers[@"Content-Type"] = @"application/octet-stream";
+  if(self.cacheControl) headers[@"Cache-Control"] = self.cacheControl;
+  if(self.eTag) headers[@"ETag"] = self.eTag;
+  if(self.supportsRanges) headers[@"Accept-Ranges"] = @"bytes";
+  response.headers = headers;
+
+  NSString *ifNoneMatch = [request valueForHeader:@"If-None-Match"];
+  if(self.eTag && [ifNoneMatch isEqualToString:self.eTag]) {
+
+    response.statusCode = 304;
+    return response;
+  }
+
+  NSData *payload = self.payload;
+  response.statusCode = 200;
+  response.body = payload;
+
+  NSString *range = [request valueForHeader:@"Range"];
+  NSString *ifRange = [request valueForHeader:@"If-Range"];
+  if(!range || !self.supportsRanges || self.ignoresRanges || (ifRange && ![ifRange isEqualToString:self.eTag])) {
+    return response;
+  }
+
+  // bytes=first-last or bytes=first-
+  unsigned long long firstByte = 0, lastByte = payload.length - 1;
+  NSScanner *scanner = [NSScanner scannerWithString:range];
+  if(![scanner scanString:@"bytes=" intoString:NULL] ||
+     ![scanner scanUnsignedLongLong:&firstByte] ||
+     ![scanner scanString:@"-" intoString:NULL]) {
+    return response;
+  }
+  [scanner scanUnsignedLongLong:&lastByte];
+  lastByte = MIN(lastByte, (unsigned long long) payload.length - 1);
+
+  if(firstByte > lastByte) {
+
+    response.statusCode = 416;
+    response.body = nil;
+    headers[@"Content-Range"] = [NSString stringWithFormat:@"bytes */%lu", (unsigned long) payload.length];
+    return response;
+  }
+
+  if([self.failingRangeStarts containsIndex:(NSUInteger) firstByte]) {
+
+    response.statusCode = self.errorStatusCode;
+    response.body = nil;
+    return response;
+  }
+
+  response.statusCode = 206;
+  response.body = [payload subdataWithRange:NSMakeRange((NSUInteger) firstByte, (NSUInteger) (lastByte - firstByte + 1))];
+  headers[@"Content-Range"] = [NSString stringWithFormat:@"bytes %lld-%lld/%lu",
+                               (long long) firstByte + self.contentRangeOffset, (long long) lastByte + self.contentRangeOffset,
+                               (unsigned long) payload.length];
+  return response;
+}
+
+@end
+
+#pragma mark -
+#pragma mark Server
+
+@interface MKNKLoopbackServer (/*Private Methods*/)
+@property (readwrite) uint16_t port;
+@property int listeningSocket;
+@property dispatch_source_t acceptSource;
+@property NSMutableDictionary *handlers; // path -> MKNKLoopbackHandler
+@property NSMutableArray *loggedRequests;
+@property NSMutableDictionary *requestCounts; // path -> requests so far
+@property NSMutableSet *connectionSockets;
+@end
+
+@implementation MKNKLoopbackServer
+
+-(instancetype) init {
+
+  if(self = [super init]) {
+
+    self.listeningSocket = -1;
+    self.handlers = [NSMutableDictionary dictionary];
+    self.loggedRequests = [NSMutableArray array];
+    self.requestCounts = [NSMutableDictionary dictionary];
+    self.connectionSockets = [NSMutableSet set];
+  }
+
+  return self;
+}
+
+-(void) dealloc {
+
+  [self stop];
+}
+
+-(BOOL) start:(NSError**) error {
+
+  int listeningSocket = socket(AF_INET, SOCK_STREAM, 0);
+  if(listeningSocket < 0) {
+
+    if(error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+    return NO;
+  }
+
+  int enabled = 1;
+  setsockopt(listeningSocket, SOL_SOCKET, SO_REUSEADDR, &enabled, sizeof(enabled));
+
+  struct sockaddr_in address = {0};
+  address.sin_len = sizeof(address);
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = 0; // ephemeral
+
+  socklen_t addressLength = sizeof(address);
+  if(bind(listeningSocket, (struct sockaddr*) &address, sizeof(address)) != 0 ||
+     listen(listeningSocket, SOMAXCONN) != 0 ||
+     getsockname(listeningSocket, (struct sockaddr*) &address, &addressLength) != 0) {
+
+    if(error) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+    close(listeningSocket);
+    return NO;
+  }
+
+  fcntl(listeningSocket, F_SETFL, fcntl(listeningSocket, F_GETFL) | O_NONBLOCK);
+  self.listeningSocket = listeningSocket;
+  self.port = ntohs(address.sin_port);
+
+  dispatch_queue_t acceptQueue = dispatch_queue_create("com.mknetworkkit.loopbackserver.accept", DISPATCH_QUEUE_SERIAL);
+  self.acceptSource = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, (uintptr_t) listeningSocket, 0, acceptQueue);
+
+  __weak MKNKLoopbackServer *weakSelf = self;
+  dispatch_source_set_event_handler(self.acceptSource, ^{
+    [weakSelf acceptConnections];
+  });
+  dispatch_source_set_cancel_handler(self.acceptSource, ^{
+    close(listeningSocket);
+  });
+  dispatch_resume(self.acceptSource);
+
+  return YES;
+}
+
+-(void) stop {
+
+  if(self.acceptSource) {
+
+    dispatch_source_cancel(self.acceptSource);
+    self.acceptSource = nil;
+    self.listeningSocket = -1;
+  }
+
+  // wakes the connection threads up, they close their sockets on the way out
+  @synchronized(self) {
+
+    for(NSNumber *connectionSocket in self.connectionSockets) {
+      shutdown(connectionSocket.intValue, SHUT_RDWR);
+    }
+  }
+}
+
+-(void) setHandler:(MKNKLoopbackHandler) handler forPath:(NSString*) path {
+
+  @synchronized(self) {
+    self.handlers[path] = [handler copy];
+  }
+}
+
+-(void) setScenario:(MKNKLoopbackScenario*) scenario forPath:(NSString*) path {
+
+  [self setHandler:^MKNKLoopbackResponse *(MKNKLoopbackRequest *request, NSUInteger requestIndex) {
+    return [scenario responseToRequest:request requestIndex:requestIndex];
+  } forPath:path];
+}
+
+-(NSArray*) requestLog {
+
+  @synchronized(self) {
+    return [self.loggedRequests copy];
+  }
+}
+
+-(NSArray*) requestsForPath:(NSString*) path {
+
+  return [self.requestLog filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"path == %@", path]];
+}
+
+-(void) resetRequestLog {
+
+  @synchronized(self) {
+
+    [self.loggedRequests removeAllObjects];
+    [self.requestCounts removeAllObjects];
+  }
+}
+
+#pragma mark -
+#pragma mark Connections
+
+// Runs on the accept queue
+-(void) acceptConnections {
+
+  int connectionSocket = -1;
+  while((connectionSocket = accept(self.listeningSocket, NULL, NULL)) >= 0) {
+
+    int enabled = 1;
+    setsockopt(connectionSocket, SOL_SOCKET, SO_NOSIGPIPE, &enabled, sizeof(enabled));
+    setsockopt(connectionSocket, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+
+    @synchronized(self) {
+      [self.connectionSockets addObject:@(connectionSocket)];
+    }
+
+    // blocking reads and response delays on a thread of their own don't hold up other connections or GCD's pool
+    NSThread *connectionThread = [[NSThread alloc] initWithTarget:self
+                                                         selector:@selector(serveConnection:)
+                                                           object:@(connectionSocket)];
+    connectionThread.name = @"com.mknetworkkit.loopbackserver.connection";
+    [connectionThread start];
+  }
+}
+
+-(void) serveConnection:(NSNumber*) connectionSocketNumber {
+
+  @autoreleasepool {
+
+    int connectionSocket = connectionSocketNumber.intValue;
+    NSMutableData *buffer = [NSMutableData data];
+
+    BOOL keepsAlive = YES;
+    while(keepsAlive) {
+
+      @autoreleasepool {
+
+        MKNKLoopbackRequest *request = [self readRequestFromSocket:connectionSocket buffer:buffer];
+        if(!request) break;
+
+        MKNKLoopbackResponse *response = [self responseToRequest:request];
+        if(response.delay > 0) [NSThread sleepForTimeInterval:response.delay];
+
+        keepsAlive = [self writeResponse:response toRequest:request socket:connectionSocket];
+        if([[request valueForHeader:@"Connection"].lowercaseString isEqualToString:@"close"]) keepsAlive = NO;
+      }
+    }
+
+    @synchronized(self) {
+      [self.connectionSockets removeObject:connectionSocketNumber];
+    }
+    close(connectionSocket);
+  }
+}
+
+// nil when the connection was closed or the request couldn't be parsed
+-(MKNKLoopbackRequest*) readRequestFromSocket:(int) connectionSocket buffer:(NSMutableData*) buffer {
+
+  NSData *headerTerminator = [@"\r\n\r\n" dataUsingEncoding:NSASCIIStringEncoding];
+  NSRange headerEnd = NSMakeRange(NSNotFound, 0);
+  while((headerEnd = [buffer rangeOfData:headerTerminator options:0 range:NSMakeRange(0, buffer.length)]).location == NSNotFound) {
+
+    if(buffer.length > kMKNKLoopbackMaximumHeaderLength) return nil;
+    if(![self readFromSocket:connectionSocket intoBuffer:buffer]) return nil;
+  }
+
+  NSString *header = [[NSString alloc] initWithData:[buffer subdataWithRange:NSMakeRange(0, headerEnd.location)]
+                                           encoding:NSISOLatin1StringEncoding];
+  NSArray *lines = [header componentsSeparatedByString:@"\r\n"];
+  NSArray *requestLine = [lines.firstObject componentsSeparatedByString:@" "];
+  if(requestLine.count < 3) return nil;
+
+  NSMutableDictionary *headers = [NSMutableDictionary dictionary];
+  for(NSString *line in [lines subarrayWithRange:NSMakeRange(1, lines.count - 1)]) {
+
+    NSRange colon = [line rangeOfString:@":"];
+    if(colon.location == NSNotFound) continue;
+    NSString *name = [line substringToIndex:colon.location].lowercaseString;
+    NSString *value = [[line substringFromIndex:colon.location + 1] stringByTrimmingCharactersInSet:[NSCharacterSet whitespaceCharacterSet]];
+    headers[name] = value;
+  }
+
+  NSUInteger bodyStart = NSMaxRange(headerEnd);
+  NSUInteger bodyLength = (NSUInteger) [headers[@"content-length"] longLongValue];
+  while(buffer.length < bodyStart + bodyLength) {
+    if(![self readFromSocket:connectionSocket intoBuffer:buffer]) return nil;
+  }
+
+  MKNKLoopbackRequest *request = [[MKNKLoopbackRequest alloc] init];
+  request.receivedTime = [NSProcessInfo processInfo].systemUptime;
+  request.method = requestLine[0];
+  request.headers = headers;
+  request.body = [buffer subdataWithRange:NSMakeRange(bodyStart, bodyLength)];
+
+  NSString *target = requestLine[1];
+  NSRange queryStart = [target rangeOfString:@"?"];
+  request.path = queryStart.location == NSNotFound ? target : [target substringToIndex:queryStart.location];
+  request.query = queryStart.location == NSNotFound ? nil : [target substringFromIndex:queryStart.location + 1];
+
+  // pipelined requests stay in the buffer
+  [buffer replaceBytesInRange:NSMakeRange(0, bodyStart + bodyLength) withBytes:NULL length:0];
+  return request;
+}
+
+-(BOOL) readFromSocket:(int) connectionSocket intoBuffer:(NSMutableData*) buffer {
+
+  uint8_t bytes[kMKNKLoopbackReadBufferSize];
+  ssize_t bytesRead = 0;
+  do {
+    bytesRead = recv(connectionSocket, bytes, sizeof(bytes), 0);
+  } while(bytesRead < 0 && errno == EINTR);
+
+  if(bytesRead <= 0) return NO;
+  [buffer appendBytes:bytes length:(NSUInteger) bytesRead];
+  return YES;
+}
+
+-(MKNKLoopbackResponse*) responseToRequest:(MKNKLoopbackRequest*) request {
+
+  MKNKLoopbackHandler handler = nil;
+  NSUInteger requestIndex = 0;
+  @synchronized(self) {
+
+    [self.loggedRequests addObject:request];
+    requestIndex = [self.requestCounts[request.path] unsignedIntegerValue];
+    self.requestCounts[request.path] = @(requestIndex + 1);
+    handler = self.handlers[request.path];
+  }
+
+  MKNKLoopbackResponse *response = handler ? handler(request, requestIndex) : nil;
+  return response ? response : [MKNKLoopbackResponse responseWithStatusCode:404 headers:nil body:nil];
+}
+
+// NO when the connection can't be used for another request
+-(BOOL) writeResponse:(MKNKLoopbackResponse*) response toRequest:(MKNKLoopbackRequest*) request socket:(int) connectionSocket {
+
+  NSData *body = response.body ? response.body : [NSData data];
+
+  NSMutableString *header = [NSMutableString stringWithFormat:@"HTTP/1.1 %ld %@\r\n", (long) response.statusCode,
+                             [NSHTTPURLResponse localizedStringForStatusCode:response.statusCode]];
+  [header appendFormat:@"Date: %@\r\n", [[NSDate date] rfc1123String]];
+  [header appendFormat:@"Content-Length: %lu\r\n", (unsigned long) body.length];
+  [response.headers enumerateKeysAndObjectsUsingBlock:^(NSString *name, NSString *value, BOOL *stop) {
+    [header appendFormat:@"%@: %@\r\n", name, value];
+  }];
+  [header appendString:@"\r\n"];
+
+  NSMutableData *responseData = [[header dataUsingEncoding:NSISOLatin1StringEncoding] mutableCopy];
+  BOOL sendsBody = ![request.method isEqualToString:@"HEAD"] && response.statusCode != 304 && response.statusCode >= 200;
+  BOOL truncated = sendsBody && response.truncatedLength > 0 && response.truncatedLength < body.length;
+  if(sendsBody) {
+    [responseData appendData:truncated ? [body subdataWithRange:NSMakeRange(0, response.truncatedLength)] : body];
+  }
+
+  const uint8_t *bytes = responseData.bytes;
+  NSUInteger bytesWritten = 0;
+  while(bytesWritten < responseData.length) {
+
+    ssize_t result = send(connectionSocket, bytes + bytesWritten, responseData.length - bytesWritten, 0);
+    if(result < 0 && errno == EINTR) continue;
+    if(result <= 0) return NO;
+    bytesWritten += (NSUInteger) result;
+  }
+
+  return !truncated;
+}
+
+@end
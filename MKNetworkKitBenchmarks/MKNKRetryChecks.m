@@ -0,0 +1,226 @@
+//
+//  MKNKRetryChecks.m
+//  MKNetworkKitBenchmarks
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import "MKNKHarness.h"
+
+#import "NSDate+RFC1123.h"
+
+static MKNKLoopbackResponse *MKNKOKResponse(NSData *payload) {
+
+  return [MKNKLoopbackResponse responseWithStatusCode:200 headers:@{@"Content-Type" : @"application/octet-stream"} body:payload];
+}
+
+static MKNetworkHost *MKNKRetryingHost(MKNKHarness *harness) {
+
+  MKNetworkHost *host = [harness host];
+  host.maximumAttempts = 3;
+  host.retryBaseDelay = 0.02;
+  return host;
+}
+
+#pragma mark -
+#pragma mark Retries
+
+static void MKNKCheckRetries(MKNKHarness *harness) {
+
+  NSData *payload = [MKNKLoopbackScenario scenarioWithPayloadSize:4096 latency:0].payload;
+
+  // fails twice, then succeeds on the last attempt
+  [harness.server setHandler:^MKNKLoopbackResponse *(MKNKLoopbackRequest *request, NSUInteger requestIndex) {
+    return requestIndex < 2 ? [MKNKLoopbackResponse responseWithStatusCode:503 headers:nil body:nil] : MKNKOKResponse(payload);
+  } forPath:@"/retry/recovers"];
+
+  MKNetworkHost *host = MKNKRetryingHost(harness);
+  MKNetworkRequest *request = [host requestWithPath:@"/retry/recovers"];
+  BOOL finished = [harness runRequest:request onHost:host timeout:10];
+  [harness check:finished && request.state == MKNKRequestStateCompleted && [request.responseData isEqualToData:payload]
+            name:@"retry.recoversFromRetryableStatus"
+          detail:[NSString stringWithFormat:@"state %d, status %ld", request.state, (long) request.response.statusCode]];
+  [harness check:[harness.server requestsForPath:@"/retry/recovers"].count == 3 && request.metrics.retryCount == 2
+            name:@"retry.recoversFromRetryableStatus.attempts"
+          detail:[NSString stringWithFormat:@"%lu requests, %lu retries",
+                   (unsigned long) [harness.server requestsForPath:@"/retry/recovers"].count, (unsigned long) request.metrics.retryCount]];
+
+  // never recovers, stops after maximumAttempts
+  MKNKLoopbackScenario *failingScenario = [MKNKLoopbackScenario scenarioWithPayloadSize:16 latency:0];
+  failingScenario.errorRate = 1;
+  [harness.server setScenario:failingScenario forPath:@"/retry/exhausts"];
+
+  request = [host requestWithPath:@"/retry/exhausts"];
+  finished = [harness runRequest:request onHost:host timeout:10];
+  [harness check:finished && request.state == MKNKRequestStateError && request.response.statusCode == 503
+            name:@"retry.exhaustsAttempts"
+          detail:nil];
+  [harness check:[harness.server requestsForPath:@"/retry/exhausts"].count == 3
+            name:@"retry.exhaustsAttempts.attempts"
+          detail:[NSString stringWithFormat:@"%lu requests", (unsigned long) [harness.server requestsForPath:@"/retry/exhausts"].count]];
+
+  // POST isn't idempotent
+  request = [host requestWithPath:@"/retry/exhausts" params:@{@"key" : @"value"} httpMethod:@"POST"];
+  [harness.server resetRequestLog];
+  finished = [harness runRequest:request onHost:host timeout:10];
+  [harness check:finished && request.state == MKNKRequestStateError && [harness.server requestsForPath:@"/retry/exhausts"].count == 1
+            name:@"retry.skipsPOST"
+          detail:nil];
+
+  // PUT is idempotent even though it has no cache key
+  [harness.server setScenario:failingScenario forPath:@"/retry/put"];
+  request = [host requestWithPath:@"/retry/put" params:@{@"key" : @"value"} httpMethod:@"PUT"];
+  finished = [harness runRequest:request onHost:host timeout:10];
+  [harness check:finished && request.state == MKNKRequestStateError && [harness.server requestsForPath:@"/retry/put"].count == 3
+            name:@"retry.retriesPUT"
+          detail:[NSString stringWithFormat:@"%lu requests", (unsigned long) [harness.server requestsForPath:@"/retry/put"].count]];
+
+  // 404 isn't retryable
+  request = [host requestWithPath:@"/retry/missing"];
+  finished = [harness runRequest:request onHost:host timeout:10];
+  [harness check:finished && request.response.statusCode == 404 && [harness.server requestsForPath:@"/retry/missing"].count == 1
+            name:@"retry.skipsNonRetryableStatus"
+          detail:nil];
+
+  // a connection lost halfway through the body is a transient error
+  [harness.server setHandler:^MKNKLoopbackResponse *(MKNKLoopbackRequest *loopbackRequest, NSUInteger requestIndex) {
+
+    MKNKLoopbackResponse *response = MKNKOKResponse(payload);
+    if(requestIndex == 0) response.truncatedLength = payload.length / 2;
+    return response;
+  } forPath:@"/retry/dropped"];
+
+  request = [host requestWithPath:@"/retry/dropped"];
+  finished = [harness runRequest:request onHost:host timeout:10];
+  [harness check:finished && request.state == MKNKRequestStateCompleted && [request.responseData isEqualToData:payload] &&
+   request.metrics.retryCount >= 1
+            name:@"retry.recoversFromLostConnection"
+          detail:[NSString stringWithFormat:@"state %d, error %@", request.state, request.error]];
+}
+
+static void MKNKCheckRetryAfter(MKNKHarness *harness) {
+
+  NSData *payload = [MKNKLoopbackScenario scenarioWithPayloadSize:1024 latency:0].payload;
+  [harness.server setHandler:^MKNKLoopbackResponse *(MKNKLoopbackRequest *request, NSUInteger requestIndex) {
+
+    if(requestIndex > 0) return MKNKOKResponse(payload);
+    return [MKNKLoopbackResponse responseWithStatusCode:503 headers:@{@"Retry-After" : @"1"} body:nil];
+  } forPath:@"/retry/after"];
+
+  // the backoff alone would wait at most 20ms
+  MKNetworkHost *host = MKNKRetryingHost(harness);
+  MKNetworkRequest *request = [host requestWithPath:@"/retry/after"];
+  BOOL finished = [harness runRequest:request onHost:host timeout:10];
+
+  NSArray *requests = [harness.server requestsForPath:@"/retry/after"];
+  NSTimeInterval wait = requests.count == 2 ? [requests[1] receivedTime] - [requests[0] receivedTime] : -1;
+  [harness check:finished && request.state == MKNKRequestStateCompleted
+            name:@"retry.retryAfter.completes"
+          detail:nil];
+  [harness check:wait >= 0.95 && wait < 3
+            name:@"retry.retryAfter.honoured"
+          detail:[NSString stringWithFormat:@"retried after %.3fs, Retry-After was 1s", wait]];
+
+  // the same wait given as an HTTP date, which only has a precision of one second
+  [harness.server setHandler:^MKNKLoopbackResponse *(MKNKLoopbackRequest *loopbackRequest, NSUInteger requestIndex) {
+
+    if(requestIndex > 0) return MKNKOKResponse(payload);
+    NSString *retryDate = [[NSDate dateWithTimeIntervalSinceNow:2] rfc1123String];
+    return [MKNKLoopbackResponse responseWithStatusCode:503 headers:@{@"Retry-After" : retryDate} body:nil];
+  } forPath:@"/retry/afterDate"];
+
+  request = [host requestWithPath:@"/retry/afterDate"];
+  finished = [harness runRequest:request onHost:host timeout:10];
+
+  requests = [harness.server requestsForPath:@"/retry/afterDate"];
+  wait = requests.count == 2 ? [requests[1] receivedTime] - [requests[0] receivedTime] : -1;
+  [harness check:finished && request.state == MKNKRequestStateCompleted && wait >= 0.95 && wait < 3.5
+            name:@"retry.retryAfter.httpDate"
+          detail:[NSString stringWithFormat:@"retried after %.3fs, Retry-After was 1 to 2s away", wait]];
+}
+
+#pragma mark -
+#pragma mark Hedging
+
+static void MKNKCheckHedging(MKNKHarness *harness) {
+
+  NSData *payload = [MKNKLoopbackScenario scenarioWithPayloadSize:4096 latency:0].payload;
+
+  // the first copy stalls, the hedge sent after the hedging delay answers right away
+  [harness.server setHandler:^MKNKLoopbackResponse *(MKNKLoopbackRequest *request, NSUInteger requestIndex) {
+
+    MKNKLoopbackResponse *response = MKNKOKResponse(payload);
+    if(requestIndex == 0) response.delay = 3;
+    return response;
+  } forPath:@"/hedge/slow"];
+
+  MKNetworkHost *host = [harness host];
+  host.defaultHedgingDelay = 0.1;
+
+  MKNetworkRequest *request = [host requestWithPath:@"/hedge/slow"];
+  request.hedged = YES;
+  BOOL finished = [harness runRequest:request onHost:host timeout:10];
+  NSTimeInterval latency = [harness latencyOfRequest:request];
+
+  [harness check:finished && request.state == MKNKRequestStateCompleted && [request.responseData isEqualToData:payload]
+            name:@"hedge.completes"
+          detail:nil];
+  [harness check:[harness.server requestsForPath:@"/hedge/slow"].count == 2 && request.metrics.hedgeCount == 1
+            name:@"hedge.sendsSecondCopy"
+          detail:[NSString stringWithFormat:@"%lu requests, %lu hedges",
+                   (unsigned long) [harness.server requestsForPath:@"/hedge/slow"].count, (unsigned long) request.metrics.hedgeCount]];
+  [harness check:latency >= 0 && latency < 1.5
+            name:@"hedge.hedgeWins"
+          detail:[NSString stringWithFormat:@"finished after %.3fs, the first copy takes 3s", latency]];
+
+  // fast responses never trigger a hedge
+  [harness.server setScenario:[MKNKLoopbackScenario scenarioWithPayloadSize:4096 latency:0] forPath:@"/hedge/fast"];
+  host.defaultHedgingDelay = 0.5;
+  request = [host requestWithPath:@"/hedge/fast"];
+  request.hedged = YES;
+  finished = [harness runRequest:request onHost:host timeout:10];
+  [NSThread sleepForTimeInterval:0.6];
+  [harness check:finished && [harness.server requestsForPath:@"/hedge/fast"].count == 1 && request.metrics.hedgeCount == 0
+            name:@"hedge.skipsFastRequests"
+          detail:nil];
+
+  // only GETs are hedged
+  [harness.server setHandler:^MKNKLoopbackResponse *(MKNKLoopbackRequest *loopbackRequest, NSUInteger requestIndex) {
+
+    MKNKLoopbackResponse *response = MKNKOKResponse(payload);
+    response.delay = 0.5;
+    return response;
+  } forPath:@"/hedge/post"];
+  host.defaultHedgingDelay = 0.1;
+  request = [host requestWithPath:@"/hedge/post" params:@{@"key" : @"value"} httpMethod:@"POST"];
+  request.hedged = YES;
+  finished = [harness runRequest:request onHost:host timeout:10];
+  [harness check:finished && [harness.server requestsForPath:@"/hedge/post"].count == 1
+            name:@"hedge.skipsPOST"
+          detail:nil];
+}
+
+void MKNKRunRetryChecks(MKNKHarness *harness) {
+
+  [harness.server resetRequestLog];
+  MKNKCheckRetries(harness);
+  MKNKCheckRetryAfter(harness);
+  MKNKCheckHedging(harness);
+}
@@ -0,0 +1,104 @@
+//
+//  main.m
+//  MKNetworkKitBenchmarks
+//
+//  Copyright (C) 2011-2020 by Steinlogic Consulting and Training Pte Ltd
+
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#import <Foundation/Foundation.h>
+
+#include <signal.h>
+
+#import "MKNKHarness.h"
+
+typedef void (*MKNKSuite)(MKNKHarness *harness);
+
+// Usage: mknkbenchmarks [-report <path>] [-suites host,cache,...]
+// Writes the JSON report to the path (or to standard output) and exits with 1 when a check failed
+int main(int argc, const char *argv[]) {
+
+  @autoreleasepool {
+
+    // the server writes to connections the client may have dropped
+    signal(SIGPIPE, SIG_IGN);
+
+    NSDictionary *suites = @{@"host" : [NSValue valueWithPointer:(const void*) MKNKRunHostBenchmarks],
+                             @"cache" : [NSValue valueWithPointer:(const void*) MKNKRunCacheBenchmarks],
+                             @"encoding" : [NSValue valueWithPointer:(const void*) MKNKRunEncodingBenchmarks],
+                             @"mapping" : [NSValue valueWithPointer:(const void*) MKNKRunMappingBenchmarks],
+                             @"retry" : [NSValue valueWithPointer:(const void*) MKNKRunRetryChecks],
+                             @"download" : [NSValue valueWithPointer:(const void*) MKNKRunDownloadChecks]};
+    NSArray *suiteOrder = @[@"host", @"cache", @"encoding", @"mapping", @"retry", @"download"];
+
+    NSUserDefaults *arguments = [NSUserDefaults standardUserDefaults];
+    NSString *reportPath = [arguments stringForKey:@"report"];
+    NSString *selectedSuites = [arguments stringForKey:@"suites"];
+    NSArray *suiteNames = selectedSuites ? [selectedSuites componentsSeparatedByString:@","] : suiteOrder;
+
+    MKNKLoopbackServer *server = [[MKNKLoopbackServer alloc] init];
+    NSError *error = nil;
+    if(![server start:&error]) {
+
+      NSLog(@"Failed to start the loopback server with error %@", error);
+      return 2;
+    }
+
+    MKNKHarness *harness = [[MKNKHarness alloc] initWithServer:server];
+    for(NSString *suiteName in suiteNames) {
+
+      MKNKSuite suite = (MKNKSuite) [suites[suiteName] pointerValue];
+      if(!suite) {
+
+        [harness check:NO name:@"harness.suites" detail:[NSString stringWithFormat:@"Unknown suite %@", suiteName]];
+        continue;
+      }
+
+      NSLog(@"Running suite %@", suiteName);
+      @autoreleasepool {
+        suite(harness);
+      }
+    }
+
+    [server stop];
+
+    NSData *report = [NSJSONSerialization dataWithJSONObject:[harness report]
+                                                     options:NSJSONWritingPrettyPrinted | NSJSONWritingSortedKeys
+                                                       error:&error];
+    if(!report) {
+
+      NSLog(@"Failed to encode the report with error %@", error);
+      return 2;
+    }
+
+    if(reportPath) {
+
+      if(![report writeToFile:reportPath options:NSDataWritingAtomic error:&error]) {
+
+        NSLog(@"Failed to write the report to [%@] with error %@", reportPath, error);
+        return 2;
+      }
+    } else {
+
+      [[NSFileHandle fileHandleWithStandardOutput] writeData:report];
+    }
+
+    return harness.failedCheckCount > 0 ? 1 : 0;
+  }
+}